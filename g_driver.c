@@ -0,0 +1,115 @@
+/**
+ * Stress driver for the published snapshots in graffit.c.
+ *
+ * Reader threads query whatever snapshot is published, by name, while a
+ * writer keeps deleting and recreating users and republishing. Nothing a
+ * reader touches may belong to a deleted user, so build it with
+ *   gcc -g -fsanitize=address -pthread g_driver.c -o g_driver
+ * (or -fsanitize=thread) and run it from this folder, next to brands.txt.
+ */
+
+#include "graffit.c"
+
+#define NUM_USERS 400
+#define NUM_READERS 4
+#define ROUNDS 300
+
+bool writer_done;
+
+void user_name(char *buf, int i)
+{
+  sprintf(buf, "user%03d", i);
+}
+
+void *snapshot_reader(void *arg)
+{
+  long *queries = arg;
+  unsigned int seed = (unsigned int)(uintptr_t)arg;
+  char a[16], b[16];
+  while (!__atomic_load_n(&writer_done, __ATOMIC_ACQUIRE))
+  {
+    GraphSnapshot *s = acquire_graph_snapshot();
+    if (s == NULL)
+      continue;
+    for (int q = 0; q < 64; q++)
+    {
+      user_name(a, rand_r(&seed) % NUM_USERS);
+      user_name(b, rand_r(&seed) % NUM_USERS);
+      int da = snapshot_find_user(s, a);
+      int db = snapshot_find_user(s, b);
+      if (da >= 0 && strcmp(s->names[da], a) != 0)
+      {
+        printf("snapshot_find_user(%s) found %s\n", a, s->names[da]);
+        exit(1);
+      }
+      snapshot_degrees_between(s, da, db);
+      snapshot_mutual_between(s, da, db);
+      int best = snapshot_suggested_index(s, da);
+      if (best >= 0 && s->names[best][0] != 'u')
+      {
+        printf("Bad suggestion for %s\n", a);
+        exit(1);
+      }
+      (*queries)++;
+    }
+    release_graph_snapshot(s);
+  }
+  free_query_context();
+  return NULL;
+}
+
+int main()
+{
+  populate_brand_matrix("brands.txt");
+  User *users[NUM_USERS];
+  char name[16];
+  for (int i = 0; i < NUM_USERS; i++)
+  {
+    user_name(name, i);
+    users[i] = create_user(name);
+    follow_brand(users[i], brand_names[i % 3]);
+  }
+  for (int i = 0; i < NUM_USERS; i++)
+  {
+    for (int k = 1; k <= 3; k++)
+      add_friend(users[i], users[(i * 7 + k * 13) % NUM_USERS]);
+  }
+  publish_graph_snapshot();
+
+  pthread_t readers[NUM_READERS];
+  long queries[NUM_READERS] = {0};
+  for (int t = 0; t < NUM_READERS; t++)
+    pthread_create(&readers[t], NULL, snapshot_reader, &queries[t]);
+
+  // Delete a handful of users, republish, then bring them back
+  for (int r = 0; r < ROUNDS; r++)
+  {
+    int first = (r * 37) % NUM_USERS;
+    for (int k = 0; k < 8; k++)
+    {
+      int i = (first + k * 11) % NUM_USERS;
+      delete_user(users[i]);
+      users[i] = NULL;
+    }
+    publish_graph_snapshot();
+    for (int k = 0; k < 8; k++)
+    {
+      int i = (first + k * 11) % NUM_USERS;
+      user_name(name, i);
+      users[i] = create_user(name);
+      follow_brand(users[i], brand_names[r % 3]);
+      add_friend(users[i], users[(i + 1) % NUM_USERS]);
+    }
+    publish_graph_snapshot();
+  }
+  __atomic_store_n(&writer_done, true, __ATOMIC_RELEASE);
+
+  long total = 0;
+  for (int t = 0; t < NUM_READERS; t++)
+  {
+    pthread_join(readers[t], NULL);
+    total += queries[t];
+  }
+  printf("%d rounds, %ld snapshot queries\n", ROUNDS, total);
+  return 0;
+}
@@ -3,16 +3,33 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <time.h>
 
 #define MAX_STR_LEN 1024
-#define MAT_SIZE 3 // A small graph
+#define BRAND_ROW_ALIGN 64 // Matrix rows start on a cache line (and AVX boundary)
+#define BRAND_ROW_WORD_ALIGN (BRAND_ROW_ALIGN / sizeof(uint64_t))
+#define popcount64(x) __builtin_popcountll(x)
 
+// Users, FriendNodes and BrandNodes come from per-type slabs and names
+// live in name_arena, so a User is only the handful of fields a traversal
+// touches (32 bytes, two to a cache line); the name bytes are kept apart.
 typedef struct user_struct
 {
-  char name[MAX_STR_LEN];
+  char *name; // Interned in name_arena
   struct friend_node_struct *friends;
   struct brand_node_struct *brands;
-  bool visited;
+  int id; // Dense index into user_table, reused after the user is deleted
+  bool listed; // In allUsers, unless its node couldn't be allocated (fits in padding)
 } User;
 
 typedef struct friend_node_struct
@@ -23,749 +40,8319 @@ typedef struct friend_node_struct
 
 typedef struct brand_node_struct
 {
-  char brand_name[MAX_STR_LEN];
+  char *brand_name; // Interned in name_arena
   struct brand_node_struct *next;
+  User *user;        // The follower
+  int idx;           // Index into brand_names, -1 until indexed
+  int follower_pos;  // Position in brand_followers[idx].nodes
 } BrandNode;
 
-// Adjacency List 
-FriendNode *allUsers;
+// Opt-in instrumentation, off until enable_stats(true). Each thread counts
+// into its own ThreadStats, so recording is a few stores to memory no other
+// thread writes; readers sum the blocks of all threads. When stats are off
+// an API call costs one extra load and branch. Latencies go in HDR-style
+// log-linear histograms: every power of two is split into 2^STAT_SUB_BITS
+// buckets, so a bucket's bounds are within 12.5% of each other.
+#define STAT_SUB_BITS 3
+#define STAT_SUB_BUCKETS (1 << STAT_SUB_BITS)
+#define STAT_BUCKETS ((64 - STAT_SUB_BITS + 1) * STAT_SUB_BUCKETS)
+
+enum
+{
+  STAT_CREATE_USER,
+  STAT_DELETE_USER,
+  STAT_FIND_USER,
+  STAT_ADD_FRIEND,
+  STAT_REMOVE_FRIEND,
+  STAT_FOLLOW_BRAND,
+  STAT_UNFOLLOW_BRAND,
+  STAT_MUTUAL_FRIENDS,
+  STAT_DEGREES,
+  STAT_SUGGESTED_FRIENDS,
+  STAT_FRIEND_OF_FRIEND,
+  STAT_ADD_SUGGESTED_FRIENDS,
+  STAT_FOLLOW_SUGGESTED_BRANDS,
+  NUM_STAT_OPS
+};
+
+const char *stat_op_names[NUM_STAT_OPS] = {
+    "create_user", "delete_user", "find_user", "add_friend", "remove_friend", "follow_brand", "unfollow_brand",
+    "get_mutual_friends", "get_degrees_of_connection", "get_suggested_friends", "get_friend_of_friend_suggestions",
+    "add_suggested_friends", "follow_suggested_brands"};
+
+enum
+{
+  STAT_LIST_NODES,     // Friend, brand and follower list entries walked
+  STAT_NAME_COMPARES,  // strcmp calls on user and brand names
+  STAT_USERS_EXPANDED, // Users whose friends a degree search scanned
+  STAT_ALLOCS,         // Slab objects and interned names handed out
+  STAT_ALLOC_BYTES,
+  NUM_STAT_COUNTERS
+};
+
+const char *stat_counter_names[NUM_STAT_COUNTERS] = {"list_nodes", "name_compares", "users_expanded", "allocs", "alloc_bytes"};
 
-int brand_adjacency_matrix[MAT_SIZE][MAT_SIZE];
-char brand_names[MAT_SIZE][MAX_STR_LEN];
+typedef struct op_stats_struct
+{
+  uint64_t calls;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[STAT_BUCKETS];
+} OpStats;
+
+typedef struct thread_stats_struct
+{
+  OpStats ops[NUM_STAT_OPS];
+  uint64_t counters[NUM_STAT_COUNTERS];
+  struct thread_stats_struct *next;
+} ThreadStats;
+
+bool stats_enabled;
+ThreadStats *live_stats;     // One block per thread that recorded anything
+ThreadStats retired_stats;   // Totals of threads that called free_query_context()
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+_Thread_local ThreadStats *thread_stats;
+
+void enable_stats(bool on)
+{
+  __atomic_store_n(&stats_enabled, on, __ATOMIC_RELAXED);
+}
 
 /**
- * Checks if a user is inside a FriendNode LL.
+ * Returns this thread's block, registering a new one on first use, or NULL
+ * if stats are off or there's no memory for it.
  **/
-bool in_friend_list(FriendNode *head, User *node)
+ThreadStats *my_stats()
 {
-  for (FriendNode *cur = head; cur != NULL; cur = cur->next)
+  if (!__atomic_load_n(&stats_enabled, __ATOMIC_RELAXED))
+    return NULL;
+  if (thread_stats == NULL && (thread_stats = calloc(1, sizeof(ThreadStats))) != NULL)
   {
-    if (strcmp(cur->user->name, node->name) == 0)
-    {
-      return true;
-    }
+    pthread_mutex_lock(&stats_lock);
+    thread_stats->next = live_stats;
+    live_stats = thread_stats;
+    pthread_mutex_unlock(&stats_lock);
   }
-  return false;
+  return thread_stats;
 }
 
-/**
- * Checks if a brand is inside a BrandNode LL.
- **/
-bool in_brand_list(BrandNode *head, char *name)
+// Only the owning thread writes a counter, so a relaxed load and store is
+// enough (and unlike a plain ++ lets readers load it concurrently)
+void stat_add(uint64_t *counter, uint64_t n)
 {
-  for (BrandNode *cur = head; cur != NULL; cur = cur->next)
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void stat_count(int counter, uint64_t n)
+{
+  ThreadStats *ts = my_stats();
+  if (ts != NULL)
+    stat_add(&ts->counters[counter], n);
+}
+
+void stat_alloc(size_t bytes)
+{
+  ThreadStats *ts = my_stats();
+  if (ts != NULL)
   {
-    if (strcmp(cur->brand_name, name) == 0)
-    {
-      return true;
-    }
+    stat_add(&ts->counters[STAT_ALLOCS], 1);
+    stat_add(&ts->counters[STAT_ALLOC_BYTES], bytes);
   }
-  return false;
 }
 
 /**
- * Inserts a User into a FriendNode LL in sorted position. If the user
- * already exists, nothing is done. Returns the new head of the LL.
+ * Returns the time to pass to stat_record() when the call ends, or 0 if
+ * stats are off.
  **/
-FriendNode *insert_into_friend_list(FriendNode *head, User *node)
+long long stat_start()
 {
-  if (node == NULL)
-    return head;
+  if (!__atomic_load_n(&stats_enabled, __ATOMIC_RELAXED))
+    return 0;
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
 
-  if (in_friend_list(head, node))
-  {
-    printf("User already in list\n");
-    return head;
-  }
-  FriendNode *fn = calloc(1, sizeof(FriendNode));
-  fn->user = node;
-  fn->next = NULL;
+int stat_bucket(uint64_t ns)
+{
+  if (ns < STAT_SUB_BUCKETS)
+    return ns;
+  int e = 63 - __builtin_clzll(ns); // e >= STAT_SUB_BITS
+  return (e - STAT_SUB_BITS + 1) * STAT_SUB_BUCKETS + (int)((ns >> (e - STAT_SUB_BITS)) & (STAT_SUB_BUCKETS - 1));
+}
 
-  if (head == NULL)
-  {
-    return fn;
-  }
+// The smallest value that lands in bucket i
+uint64_t stat_bucket_floor(int i)
+{
+  if (i < STAT_SUB_BUCKETS)
+    return i;
+  int e = i / STAT_SUB_BUCKETS + STAT_SUB_BITS - 1;
+  return (uint64_t)(STAT_SUB_BUCKETS + i % STAT_SUB_BUCKETS) << (e - STAT_SUB_BITS);
+}
+
+void stat_record(int op, long long start)
+{
+  if (start == 0)
+    return;
+  ThreadStats *ts = my_stats();
+  if (ts == NULL)
+    return;
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  uint64_t ns = t.tv_sec * 1000000000LL + t.tv_nsec - start;
+  OpStats *s = &ts->ops[op];
+  stat_add(&s->calls, 1);
+  stat_add(&s->total_ns, ns);
+  stat_add(&s->buckets[stat_bucket(ns)], 1);
+  if (ns > s->max_ns)
+    __atomic_store_n(&s->max_ns, ns, __ATOMIC_RELAXED);
+}
 
-  if (strcmp(head->user->name, node->name) > 0)
+void stats_merge(ThreadStats *into, ThreadStats *from)
+{
+  for (int op = 0; op < NUM_STAT_OPS; op++)
   {
-    fn->next = head;
-    return fn;
+    OpStats *d = &into->ops[op];
+    OpStats *s = &from->ops[op];
+    d->calls += __atomic_load_n(&s->calls, __ATOMIC_RELAXED);
+    d->total_ns += __atomic_load_n(&s->total_ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+    if (max > d->max_ns)
+      d->max_ns = max;
+    for (int i = 0; i < STAT_BUCKETS; i++)
+      d->buckets[i] += __atomic_load_n(&s->buckets[i], __ATOMIC_RELAXED);
   }
+  for (int c = 0; c < NUM_STAT_COUNTERS; c++)
+    into->counters[c] += __atomic_load_n(&from->counters[c], __ATOMIC_RELAXED);
+}
 
-  FriendNode *cur;
-  for (cur = head; cur->next != NULL && strcmp(cur->next->user->name, node->name) < 0;
-       cur = cur->next)
-    ;
-  fn->next = cur->next;
-  cur->next = fn;
-  return head;
+/**
+ * Sums every thread's stats into *total. Threads may keep recording while
+ * this runs, so the sums are a moment's view rather than one instant's.
+ **/
+void read_stats(ThreadStats *total)
+{
+  memset(total, 0, sizeof(ThreadStats));
+  pthread_mutex_lock(&stats_lock);
+  stats_merge(total, &retired_stats);
+  for (ThreadStats *ts = live_stats; ts != NULL; ts = ts->next)
+    stats_merge(total, ts);
+  pthread_mutex_unlock(&stats_lock);
 }
 
 /**
- * Inserts a brand into a BrandNode LL in sorted position. If the brand
- * already exists, nothing is done. Returns the new head of the LL.
+ * Folds the calling thread's stats into the retired totals and frees its
+ * block. Called by free_query_context() as the thread winds down.
  **/
-BrandNode *insert_into_brand_list(BrandNode *head, char *node)
+void retire_thread_stats()
 {
-  if (node == NULL)
-    return head;
+  if (thread_stats == NULL)
+    return;
+  pthread_mutex_lock(&stats_lock);
+  ThreadStats **link = &live_stats;
+  while (*link != thread_stats)
+    link = &(*link)->next;
+  *link = thread_stats->next;
+  stats_merge(&retired_stats, thread_stats);
+  pthread_mutex_unlock(&stats_lock);
+  free(thread_stats);
+  thread_stats = NULL;
+}
 
-  if (in_brand_list(head, node))
+/**
+ * Zeroes every thread's stats. Calls in flight may still land in the old
+ * window.
+ **/
+void reset_stats()
+{
+  pthread_mutex_lock(&stats_lock);
+  memset(&retired_stats, 0, offsetof(ThreadStats, next));
+  for (ThreadStats *ts = live_stats; ts != NULL; ts = ts->next)
   {
-    printf("Brand already in list\n");
-    return head;
+    uint64_t *word = (uint64_t *)ts;
+    for (size_t i = 0; i < offsetof(ThreadStats, next) / sizeof(uint64_t); i++)
+      __atomic_store_n(&word[i], 0, __ATOMIC_RELAXED);
   }
-  BrandNode *fn = calloc(1, sizeof(BrandNode));
-  strcpy(fn->brand_name, node);
-  fn->next = NULL;
-
-  if (head == NULL)
-    return fn;
+  pthread_mutex_unlock(&stats_lock);
+}
 
-  if (strcmp(head->brand_name, node) > 0)
+/**
+ * Returns the latency (in ns, as its bucket's lower bound) at or below
+ * which fraction p of the calls completed.
+ **/
+uint64_t stat_percentile(const OpStats *s, double p)
+{
+  uint64_t rank = (uint64_t)(p * s->calls);
+  uint64_t seen = 0;
+  for (int i = 0; i < STAT_BUCKETS; i++)
   {
-    fn->next = head;
-    return fn;
+    seen += s->buckets[i];
+    if (seen > rank)
+      return stat_bucket_floor(i);
   }
-
-  BrandNode *cur;
-  for (cur = head; cur->next != NULL && strcmp(cur->next->brand_name, node) < 0;
-       cur = cur->next)
-    ;
-  fn->next = cur->next;
-  cur->next = fn;
-  return head;
+  return s->max_ns;
 }
 
 /**
- * Deletes a User from FriendNode LL. If the user doesn't exist, nothing is
- * done. Returns the new head of the LL.
+ * Writes the merged stats to out: a line per API that was called with its
+ * call count, mean and percentile latencies, then the work counters.
  **/
-FriendNode *delete_from_friend_list(FriendNode *head, User *node)
+void print_stats(FILE *out)
 {
-  if (node == NULL)
-    return head;
-
-  if (!in_friend_list(head, node))
+  ThreadStats *total = malloc(sizeof(ThreadStats));
+  if (total == NULL)
+    return;
+  read_stats(total);
+  fprintf(out, "%-34s %10s %10s %10s %10s %10s %10s %10s\n", "op", "calls", "mean_ns", "p50_ns", "p90_ns", "p99_ns",
+          "p999_ns", "max_ns");
+  for (int op = 0; op < NUM_STAT_OPS; op++)
   {
-    printf("User not in list\n");
-    return head;
+    OpStats *s = &total->ops[op];
+    if (s->calls == 0)
+      continue;
+    fprintf(out, "%-34s %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n", stat_op_names[op],
+            (unsigned long long)s->calls, (unsigned long long)(s->total_ns / s->calls),
+            (unsigned long long)stat_percentile(s, 0.5), (unsigned long long)stat_percentile(s, 0.9),
+            (unsigned long long)stat_percentile(s, 0.99), (unsigned long long)stat_percentile(s, 0.999),
+            (unsigned long long)s->max_ns);
   }
+  for (int c = 0; c < NUM_STAT_COUNTERS; c++)
+    fprintf(out, "%-34s %10llu\n", stat_counter_names[c], (unsigned long long)total->counters[c]);
+  free(total);
+}
 
-  if (strcmp(head->user->name, node->name) == 0)
-  {
-    FriendNode *temp = head->next;
-    free(head);
-    return temp;
-  }
+// Fixed-size object allocator. Objects are carved from large slabs and
+// freed ones are chained through their first word for reuse, so there is
+// no per-object malloc header and objects of a type sit next to each other.
+typedef struct slab_allocator_struct
+{
+  size_t item_size;
+  int items_per_slab;
+  void *free_list;
+  char *bump;     // Next never-used item in the newest slab
+  int bump_left;
+  char **slabs;
+  int num_slabs;
+  int slab_cap;
+  long live;      // Items currently handed out
+} SlabAllocator;
 
-  FriendNode *cur;
-  for (cur = head; cur->next->user != node; cur = cur->next)
-    ;
+#define SLAB_BYTES (64 * 1024)
 
-  FriendNode *temp = cur->next;
-  cur->next = temp->next;
-  free(temp);
-  return head;
-}
+SlabAllocator user_slab = {.item_size = sizeof(User), .items_per_slab = SLAB_BYTES / sizeof(User)};
+SlabAllocator friend_node_slab = {.item_size = sizeof(FriendNode), .items_per_slab = SLAB_BYTES / sizeof(FriendNode)};
+SlabAllocator brand_node_slab = {.item_size = sizeof(BrandNode), .items_per_slab = SLAB_BYTES / sizeof(BrandNode)};
 
 /**
- * Deletes a brand from BrandNode LL. If the user doesn't exist, nothing is
- * done. Returns the new head of the LL.
+ * Returns a zeroed object from the slab allocator, or NULL if out of memory.
  **/
-BrandNode *delete_from_brand_list(BrandNode *head, char *node)
+void *slab_alloc(SlabAllocator *a)
 {
-  if (node == NULL)
-    return head;
-
-  if (!in_brand_list(head, node))
+  void *item;
+  if (a->free_list != NULL)
   {
-    printf("Brand not in list\n");
-    return head;
+    item = a->free_list;
+    a->free_list = *(void **)item;
   }
-
-  if (strcmp(head->brand_name, node) == 0)
+  else
   {
-    BrandNode *temp = head->next;
-    free(head);
-    return temp;
+    if (a->bump_left == 0)
+    {
+      if (a->num_slabs == a->slab_cap)
+      {
+        int cap = a->slab_cap == 0 ? 16 : a->slab_cap * 2;
+        char **slabs = realloc(a->slabs, cap * sizeof(char *));
+        if (slabs == NULL)
+          return NULL;
+        a->slabs = slabs;
+        a->slab_cap = cap;
+      }
+      char *slab = malloc(a->item_size * a->items_per_slab);
+      if (slab == NULL)
+        return NULL;
+      a->slabs[a->num_slabs++] = slab;
+      a->bump = slab;
+      a->bump_left = a->items_per_slab;
+    }
+    item = a->bump;
+    a->bump += a->item_size;
+    a->bump_left--;
   }
+  memset(item, 0, a->item_size);
+  a->live++;
+  stat_alloc(a->item_size);
+  return item;
+}
 
-  BrandNode *cur;
-  for (cur = head; strcmp(cur->next->brand_name, node) != 0; cur = cur->next)
-    ;
-
-  BrandNode *temp = cur->next;
-  cur->next = temp->next;
-  free(temp);
-  return head;
+void slab_free(SlabAllocator *a, void *item)
+{
+  if (item == NULL)
+    return;
+  *(void **)item = a->free_list;
+  a->free_list = item;
+  a->live--;
 }
 
+// Append-only storage for user and brand names. Every distinct string is
+// stored once (interned), so equal names share one copy. Names are not
+// reclaimed when users are deleted.
+typedef struct string_arena_struct
+{
+  char **chunks;
+  int num_chunks;
+  int chunk_cap;
+  char *next;
+  size_t left;
+  char **slots; // Open addressing intern table, NULL = empty
+  int slot_mask;
+  int count;
+  size_t bytes; // Bytes taken by the chunks
+} StringArena;
+
+#define ARENA_CHUNK_BYTES (64 * 1024)
+
+StringArena name_arena;
+
 /**
- * Prints out the user data.
+ * FNV-1a hash of a string.
  **/
-void print_user_data(User *user)
+uint64_t hash_string(const char *str)
 {
-  printf("User name: %s\n", user->name);
-  printf("Friends:\n");
-  for (FriendNode *f = user->friends; f != NULL; f = f->next)
-  {
-    printf("   %s\n", f->user->name);
-  }
-  printf("Brands:\n");
-  for (BrandNode *b = user->brands; b != NULL; b = b->next)
+  uint64_t h = 14695981039346656037ULL;
+  for (; *str != '\0'; str++)
   {
-    printf("   %s\n", b->brand_name);
+    h = (h ^ (unsigned char)*str) * 1099511628211ULL;
   }
+  return h;
 }
 
 /**
- * Get the index into brand_names for the given brand name. If it doesn't
- * exist in the array, return -1
+ * hash_string() of the len bytes at str, which needn't be '\0' terminated.
  **/
-int get_brand_index(char *name)
+uint64_t hash_bytes(const char *str, size_t len)
 {
-  for (int i = 0; i < MAT_SIZE; i++)
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++)
   {
-    if (strcmp(brand_names[i], name) == 0)
-    {
-      return i;
-    }
+    h = (h ^ (unsigned char)str[i]) * 1099511628211ULL;
   }
-  printf("brand '%s' not found\n", name);
-  return -1; // Not found
+  return h;
 }
 
 /**
- * Print out brand name, index and similar brands.
+ * Copies len bytes plus a terminating '\0' into the arena.
  **/
-void print_brand_data(char *brand_name)
+char *arena_copy(StringArena *a, const char *str, size_t len)
 {
-  int idx = get_brand_index(brand_name);
-  if (idx < 0)
-  {
-    printf("Brand '%s' not in the list.\n", brand_name);
-    return;
-  }
-  printf("Brand name: %s\n", brand_name);
-  printf("Brand idx: %d\n", idx);
-  printf("Similar brands:\n");
-  for (int i = 0; i < MAT_SIZE; i++)
+  if (a->left < len + 1)
   {
-    if (brand_adjacency_matrix[idx][i] == 1 && strcmp(brand_names[i], "") != 0)
+    size_t size = len + 1 > ARENA_CHUNK_BYTES ? len + 1 : ARENA_CHUNK_BYTES;
+    if (a->num_chunks == a->chunk_cap)
     {
-      printf("   %s\n", brand_names[i]);
+      int cap = a->chunk_cap == 0 ? 16 : a->chunk_cap * 2;
+      char **chunks = realloc(a->chunks, cap * sizeof(char *));
+      if (chunks == NULL)
+        return NULL;
+      a->chunks = chunks;
+      a->chunk_cap = cap;
     }
+    char *chunk = malloc(size);
+    if (chunk == NULL)
+      return NULL;
+    a->chunks[a->num_chunks++] = chunk;
+    a->bytes += size;
+    a->next = chunk;
+    a->left = size;
   }
+  char *copy = a->next;
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  a->next += len + 1;
+  a->left -= len + 1;
+  stat_alloc(len + 1);
+  return copy;
 }
 
 /**
- * Read from a given file and populate a the brand list and brand matrix.
+ * Returns the arena's copy of str, adding it if it isn't there yet.
+ * Returns NULL if out of memory.
  **/
-void populate_brand_matrix(char *file_name)
+char *intern_string(StringArena *a, const char *str)
 {
-  // Read the file
-  char buff[MAX_STR_LEN];
-  FILE *f = fopen(file_name, "r");
-  fscanf(f, "%s", buff);
-  char *line = buff;
-  // Load up the brand_names matrix
-  for (int i = 0; i < MAT_SIZE; i++)
+  if (2 * (a->count + 1) > a->slot_mask + 1)
   {
-    if (i == MAT_SIZE - 1)
+    int cap = a->slot_mask == 0 ? 1024 : 2 * (a->slot_mask + 1);
+    char **slots = calloc(cap, sizeof(char *));
+    if (slots == NULL)
+      return NULL;
+    for (int i = 0; a->slots != NULL && i <= a->slot_mask; i++)
     {
-      strcpy(brand_names[i], line);
-      break;
+      if (a->slots[i] == NULL)
+        continue;
+      int j = hash_string(a->slots[i]) & (cap - 1);
+      while (slots[j] != NULL)
+        j = (j + 1) & (cap - 1);
+      slots[j] = a->slots[i];
     }
-    int index = strchr(line, ',') - line;
-    strncpy(brand_names[i], line, index);
-    line = strchr(line, ',') + sizeof(char);
+    free(a->slots);
+    a->slots = slots;
+    a->slot_mask = cap - 1;
   }
-  // Load up the brand_adjacency_matrix
-  for (int x = 0; x < MAT_SIZE; x++)
+  int i = hash_string(str) & a->slot_mask;
+  for (; a->slots[i] != NULL; i = (i + 1) & a->slot_mask)
   {
-    fscanf(f, "%s", buff);
-    for (int y = 0; y < MAT_SIZE; y++)
-    {
-      int value = (int)buff[y * 2];
-      if (value == 48)
-      {
-        value = 0;
-      }
-      else
-      {
-        value = 1;
-      }
-      brand_adjacency_matrix[x][y] = value;
-    }
+    if (strcmp(a->slots[i], str) == 0)
+      return a->slots[i];
   }
+  char *copy = arena_copy(a, str, strlen(str));
+  if (copy != NULL)
+  {
+    a->slots[i] = copy;
+    a->count++;
+  }
+  return copy;
+}
+
+// Adjacency List 
+FriendNode *allUsers;
+
+// Every live User by id. Ids of deleted users go on free_user_ids and are
+// handed out again, so user_table_size stays close to the live user count.
+User **user_table;
+int user_table_size;
+int user_table_cap;
+int *free_user_ids;
+int num_free_user_ids;
+
+// Live users by name, open addressing with linear probing (NULL = empty).
+// If several users share a name only the first one is indexed.
+User **user_slots;
+int user_slot_mask;
+int user_slot_count;
+
+// Any number of readers or a single writer. Each public query takes the read
+// side and each public update the write side, then runs its *_unlocked
+// body; those bodies call each other directly. Lower-level helpers (the list
+// functions, get_brand_index, brand_row, ...) don't lock at all, so callers
+// mixing them with concurrent updates hold graph_lock around them. Traversal
+// state (bfs_engine, suggest_counter, csr_search) is per thread.
+pthread_rwlock_t graph_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void graph_read_lock()
+{
+  pthread_rwlock_rdlock(&graph_lock);
 }
 
+void graph_write_lock()
+{
+  pthread_rwlock_wrlock(&graph_lock);
+}
 
-int checkName(char *name)
+void graph_unlock()
 {
-  int len = strlen(name);
-  for (int i = 0; i < len; i++)
+  pthread_rwlock_unlock(&graph_lock);
+}
+
+// Bumped by every change to users, friendships or follows so that derived
+// read-only structures (e.g. GraphSnapshot) can tell whether they're stale.
+unsigned long graph_version;
+
+// Influence (PageRank) of each user by id, from the last
+// compute_influence(); 0 for users it hasn't seen. It is replaced as a
+// whole under influence_lock, since computing it only needs graph_lock for
+// reading.
+double *influence;
+int influence_size;
+unsigned long influence_version; // graph_version it was computed at
+pthread_rwlock_t influence_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Brand similarity graph. The matrix is a symmetric bitset with one bit per
+// pair of brands: row i holds brand_row_words 64-bit words, padded so every
+// row is BRAND_ROW_ALIGN aligned and can be processed a word at a time.
+int num_brands;
+int brand_row_words;
+uint64_t *brand_adjacency_matrix;
+char **brand_names;
+
+// Open addressing table of brand indices keyed by name (-1 = empty slot)
+int *brand_slots;
+int brand_slot_mask;
+
+// Inverted index: the BrandNode of every user following each brand
+typedef struct brand_followers_struct
+{
+  BrandNode **nodes;
+  int count;
+  int cap;
+} BrandFollowers;
+
+BrandFollowers *brand_followers;
+
+// Brand popularity, kept up to date as follows are indexed and unindexed.
+// Exact mode orders every brand by follower count: order holds the brand
+// indices most followed first, and ahead[c] is the number of brands with
+// more than c followers, so the brands with c followers are the run
+// order[ahead[c] .. ahead[c - 1]]. A follow swaps the brand to the front
+// of its run and grows ahead[c], an unfollow the reverse, both O(1), and
+// the top n brands are simply order[0 .. n].
+// Approximate mode is for brand spaces too large for per-brand state: a
+// Count-Min sketch (POPULARITY_DEPTH rows of popularity_sketch_width
+// counters) estimates counts, never under, and a min-heap keeps the
+// popularity_k brands with the highest estimates seen.
+#define POPULARITY_DEPTH 4
+
+enum
+{
+  POPULARITY_EXACT,
+  POPULARITY_APPROXIMATE
+};
+
+typedef struct brand_popularity_struct
+{
+  int mode;
+  // Exact
+  int *order;
+  int *pos; // Each brand's place in order
+  int *ahead;
+  int ahead_cap;
+  // Approximate
+  uint32_t *sketch;
+  int width;
+  int k;
+  int *heap;       // Brand indices, least popular estimate at the root
+  uint32_t *heap_count;
+  int heap_size;
+  int *slot_brand; // Open addressing table of heap positions by brand (-1 = empty)
+  int *slot_pos;
+  int slot_mask;
+} BrandPopularity;
+
+BrandPopularity popularity = {POPULARITY_EXACT};
+int popularity_k = 100;                  // Brands tracked in approximate mode
+int popularity_sketch_width = 1 << 16;   // Counters per sketch row
+bool popular_brand_ties = false;         // follow_suggested_brands() prefers popular brands on ties
+
+void free_brand_popularity()
+{
+  free(popularity.order);
+  free(popularity.pos);
+  free(popularity.ahead);
+  free(popularity.sketch);
+  free(popularity.heap);
+  free(popularity.heap_count);
+  free(popularity.slot_brand);
+  free(popularity.slot_pos);
+  popularity = (BrandPopularity){.mode = popularity.mode};
+}
+
+/**
+ * Sets up an empty tracker for n brands in the current mode. Returns -1 if
+ * out of memory.
+ **/
+int reset_brand_popularity(int n)
+{
+  BrandPopularity *p = &popularity;
+  free_brand_popularity();
+  if (p->mode == POPULARITY_EXACT)
   {
-    if (name[i] != ' ' || name[i] != '\0')
+    p->order = malloc((n > 0 ? n : 1) * sizeof(int));
+    p->pos = malloc((n > 0 ? n : 1) * sizeof(int));
+    p->ahead = calloc(16, sizeof(int));
+    p->ahead_cap = 16;
+    if (p->order == NULL || p->pos == NULL || p->ahead == NULL)
     {
-      return 1;
+      free_brand_popularity();
+      return -1;
     }
+    for (int i = 0; i < n; i++)
+      p->order[i] = p->pos[i] = i;
+    return 0;
+  }
+  int slots = 16;
+  while (slots < 2 * popularity_k)
+    slots *= 2;
+  p->width = popularity_sketch_width > 0 ? popularity_sketch_width : 1;
+  p->k = popularity_k > 0 ? popularity_k : 1;
+  p->sketch = calloc((size_t)POPULARITY_DEPTH * p->width, sizeof(uint32_t));
+  p->heap = malloc(p->k * sizeof(int));
+  p->heap_count = malloc(p->k * sizeof(uint32_t));
+  p->slot_brand = malloc(slots * sizeof(int));
+  p->slot_pos = malloc(slots * sizeof(int));
+  if (p->sketch == NULL || p->heap == NULL || p->heap_count == NULL || p->slot_brand == NULL || p->slot_pos == NULL)
+  {
+    free_brand_popularity();
+    return -1;
   }
+  memset(p->slot_brand, -1, slots * sizeof(int));
+  p->slot_mask = slots - 1;
   return 0;
 }
 
-User *create_user(char *name)
+void swap_popularity_order(BrandPopularity *p, int i, int j)
 {
-  if (strcmp("", name) == 0 || checkName(name) == 0)
-  {
-    return NULL;
-  }
-  User *newUser = (User *)calloc(1, sizeof(User));
-  strcpy(newUser->name, name);
-  newUser->friends = NULL;
-  newUser->brands = NULL;
-  newUser->visited = false;
-  allUsers = insert_into_friend_list(allUsers, newUser);
-  return newUser;
+  int a = p->order[i];
+  int b = p->order[j];
+  p->order[i] = b;
+  p->order[j] = a;
+  p->pos[a] = j;
+  p->pos[b] = i;
 }
 
-
-BrandNode *delete_brand_from_user(BrandNode *head)
+/**
+ * Moves the brand within order after its follower count went from count to
+ * count + delta (delta is 1 or -1).
+ **/
+void track_exact(BrandPopularity *p, int brand, int count, int delta)
 {
-  if (head == NULL)
+  if (delta > 0)
   {
-    return head;
+    if (count + 1 >= p->ahead_cap)
+    {
+      int cap = p->ahead_cap * 2;
+      int *ahead = realloc(p->ahead, cap * sizeof(int));
+      if (ahead == NULL)
+      {
+        free_brand_popularity(); // Off until the next reset
+        return;
+      }
+      memset(ahead + p->ahead_cap, 0, (cap - p->ahead_cap) * sizeof(int));
+      p->ahead = ahead;
+      p->ahead_cap = cap;
+    }
+    swap_popularity_order(p, p->pos[brand], p->ahead[count]);
+    p->ahead[count]++;
   }
-  BrandNode *current = head;
-  BrandNode *after = NULL;
-  while (current != NULL)
+  else
   {
-    after = current->next;
-    free(current);
-    current = after;
+    swap_popularity_order(p, p->pos[brand], p->ahead[count - 1] - 1);
+    p->ahead[count - 1]--;
   }
-  return NULL;
+}
+
+uint32_t sketch_column(int brand, int row, int width)
+{
+  uint64_t x = ((uint64_t)brand + 1) * 0x9E3779B97F4A7C15ull + (uint64_t)row * 0xBF58476D1CE4E5B9ull;
+  x ^= x >> 31;
+  x *= 0x94D049BB133111EBull;
+  x ^= x >> 29;
+  return (uint32_t)(x % (uint64_t)width);
+}
+
+uint32_t sketch_estimate(BrandPopularity *p, int brand)
+{
+  uint32_t est = UINT32_MAX;
+  for (int r = 0; r < POPULARITY_DEPTH; r++)
+  {
+    uint32_t c = p->sketch[(size_t)r * p->width + sketch_column(brand, r, p->width)];
+    if (c < est)
+      est = c;
+  }
+  return est;
+}
+
+int popularity_home(BrandPopularity *p, int brand)
+{
+  return (int)(((uint64_t)brand * 0x9E3779B97F4A7C15ull) >> 32) & p->slot_mask;
+}
+
+/**
+ * Returns the brand's slot, or the empty slot where it would go.
+ **/
+int popularity_slot(BrandPopularity *p, int brand)
+{
+  int i = popularity_home(p, brand);
+  while (p->slot_brand[i] >= 0 && p->slot_brand[i] != brand)
+    i = (i + 1) & p->slot_mask;
+  return i;
+}
+
+/**
+ * Removes the brand's slot, shifting later entries of the probe run back so
+ * lookups never stop early at the freed slot.
+ **/
+void popularity_slot_remove(BrandPopularity *p, int brand)
+{
+  int i = popularity_slot(p, brand);
+  p->slot_brand[i] = -1;
+  for (int j = (i + 1) & p->slot_mask; p->slot_brand[j] >= 0; j = (j + 1) & p->slot_mask)
+  {
+    int home = popularity_home(p, p->slot_brand[j]);
+    bool stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+    if (!stays)
+    {
+      p->slot_brand[i] = p->slot_brand[j];
+      p->slot_pos[i] = p->slot_pos[j];
+      p->slot_brand[j] = -1;
+      i = j;
+    }
+  }
+}
+
+void heap_place(BrandPopularity *p, int at, int brand, uint32_t count)
+{
+  int i = popularity_slot(p, brand);
+  p->heap[at] = brand;
+  p->heap_count[at] = count;
+  p->slot_brand[i] = brand;
+  p->slot_pos[i] = at;
+}
+
+/**
+ * Restores the min-heap order after the entry at i changed its count.
+ **/
+void heap_fix(BrandPopularity *p, int i)
+{
+  int brand = p->heap[i];
+  uint32_t count = p->heap_count[i];
+  while (i > 0 && p->heap_count[(i - 1) / 2] > count)
+  {
+    heap_place(p, i, p->heap[(i - 1) / 2], p->heap_count[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  while (true)
+  {
+    int child = 2 * i + 1;
+    if (child >= p->heap_size)
+      break;
+    if (child + 1 < p->heap_size && p->heap_count[child + 1] < p->heap_count[child])
+      child++;
+    if (p->heap_count[child] >= count)
+      break;
+    heap_place(p, i, p->heap[child], p->heap_count[child]);
+    i = child;
+  }
+  heap_place(p, i, brand, count);
+}
+
+/**
+ * Adds delta follows (any sign) of the brand to the sketch and updates the
+ * heap of most popular brands.
+ **/
+void track_approximate(BrandPopularity *p, int brand, int delta)
+{
+  for (int r = 0; r < POPULARITY_DEPTH; r++)
+  {
+    uint32_t *c = &p->sketch[(size_t)r * p->width + sketch_column(brand, r, p->width)];
+    *c = delta < 0 && *c < (uint32_t)-delta ? 0 : *c + delta;
+  }
+  uint32_t est = sketch_estimate(p, brand);
+  int slot = popularity_slot(p, brand);
+  int at = p->slot_brand[slot] == brand ? p->slot_pos[slot] : -1;
+  if (at >= 0)
+  {
+    p->heap_count[at] = est;
+    heap_fix(p, at);
+  }
+  else if (delta > 0 && p->heap_size < p->k)
+  {
+    heap_place(p, p->heap_size, brand, est);
+    heap_fix(p, p->heap_size++);
+  }
+  else if (delta > 0 && est > p->heap_count[0])
+  {
+    popularity_slot_remove(p, p->heap[0]);
+    heap_place(p, 0, brand, est);
+    heap_fix(p, 0);
+  }
+}
+
+/**
+ * Records that the brand's follower count changed by delta (1 or -1) to
+ * brand_followers[brand].count.
+ **/
+void track_brand_follow(int brand, int delta)
+{
+  if (popularity.mode == POPULARITY_EXACT)
+  {
+    if (popularity.order != NULL)
+      track_exact(&popularity, brand, brand_followers[brand].count - delta, delta);
+  }
+  else if (popularity.sketch != NULL)
+  {
+    track_approximate(&popularity, brand, delta);
+  }
+}
+
+// Friend lists (and allUsers) with FRIEND_INDEX_MIN or more nodes get a
+// FriendIndex: an open addressing table, keyed by user id, of the link that
+// points at each node (the list head or the previous node's next field).
+// Looking a friend up, and so unlinking them, is O(1) however long the list
+// is, without growing FriendNode. Shorter lists are scanned by pointer.
+#define FRIEND_INDEX_MIN 32
+
+typedef struct friend_index_struct
+{
+  FriendNode ***links; // NULL = empty slot
+  int mask;
+  int count; // Nodes in the list
+} FriendIndex;
+
+FriendIndex **friend_index; // By user id, NULL while the friend list is short
+FriendIndex *all_users_index;
+size_t friend_index_bytes;
+
+int friend_slot(FriendIndex *ix, User *user)
+{
+  return (int)((uint64_t)user->id * 0x9E3779B97F4A7C15ull >> 32) & ix->mask;
+}
+
+/**
+ * Returns the slot holding the user's link, or -1 if the user isn't in the
+ * list. Every link in the table must point at its node when this is called.
+ **/
+int friend_index_find(FriendIndex *ix, User *user)
+{
+  for (int i = friend_slot(ix, user); ix->links[i] != NULL; i = (i + 1) & ix->mask)
+  {
+    if ((*ix->links[i])->user == user)
+      return i;
+  }
+  return -1;
+}
+
+void friend_index_put(FriendIndex *ix, FriendNode **link)
+{
+  int i = friend_slot(ix, (*link)->user);
+  while (ix->links[i] != NULL)
+    i = (i + 1) & ix->mask;
+  ix->links[i] = link;
+  ix->count++;
+}
+
+/**
+ * Removes the user's entry, shifting later entries of the probe run back so
+ * lookups never stop early at the freed slot.
+ **/
+void friend_index_remove(FriendIndex *ix, User *user)
+{
+  int i = friend_index_find(ix, user);
+  if (i < 0)
+    return;
+  ix->links[i] = NULL;
+  ix->count--;
+  for (int j = (i + 1) & ix->mask; ix->links[j] != NULL; j = (j + 1) & ix->mask)
+  {
+    int home = friend_slot(ix, (*ix->links[j])->user);
+    bool stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+    if (!stays)
+    {
+      ix->links[i] = ix->links[j];
+      ix->links[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+void free_friend_index(FriendIndex **index)
+{
+  if (*index == NULL)
+    return;
+  friend_index_bytes -= sizeof(FriendIndex) + ((*index)->mask + 1) * sizeof(FriendNode **);
+  free((*index)->links);
+  free(*index);
+  *index = NULL;
+}
+
+/**
+ * (Re)builds the index of a list after it was changed without one, dropping
+ * it if the list is short. Without memory the list simply goes unindexed.
+ **/
+void reindex_friend_list(FriendNode **head, FriendIndex **index)
+{
+  free_friend_index(index);
+  int count = 0;
+  for (FriendNode *cur = *head; cur != NULL; cur = cur->next)
+    count++;
+  if (count < FRIEND_INDEX_MIN)
+    return;
+  int slots = 2 * FRIEND_INDEX_MIN;
+  while (slots < 2 * (count + 1)) // Room for one more
+    slots *= 2;
+  FriendIndex *ix = malloc(sizeof(FriendIndex));
+  FriendNode ***links = calloc(slots, sizeof(FriendNode **));
+  if (ix == NULL || links == NULL)
+  {
+    free(ix);
+    free(links);
+    return;
+  }
+  ix->links = links;
+  ix->mask = slots - 1;
+  ix->count = 0;
+  for (FriendNode **link = head; *link != NULL; link = &(*link)->next)
+    friend_index_put(ix, link);
+  friend_index_bytes += sizeof(FriendIndex) + slots * sizeof(FriendNode **);
+  *index = ix;
+}
+
+/**
+ * Returns the link pointing at the user's node in the list, or NULL if the
+ * user isn't in it.
+ **/
+FriendNode **find_friend_link(FriendNode **head, FriendIndex *index, User *node)
+{
+  if (index != NULL)
+  {
+    int i = friend_index_find(index, node);
+    return i < 0 ? NULL : index->links[i];
+  }
+  int walked = 0;
+  for (FriendNode **link = head; *link != NULL; link = &(*link)->next, walked++)
+  {
+    if ((*link)->user == node)
+    {
+      stat_count(STAT_LIST_NODES, walked + 1);
+      return link;
+    }
+  }
+  stat_count(STAT_LIST_NODES, walked);
+  return NULL;
+}
+
+/**
+ * Returns the link to friend's node in user's friend list, or NULL if they
+ * aren't friends.
+ **/
+FriendNode **friend_link(User *user, User *friend)
+{
+  return find_friend_link(&user->friends, friend_index[user->id], friend);
+}
+
+bool are_friends(User *a, User *b)
+{
+  return friend_link(a, b) != NULL;
+}
+
+/**
+ * Inserts a User into a FriendNode LL in sorted position, keeping its index
+ * up to date. If a user with the same name is already in the list, nothing
+ * is done. Returns the new node, or NULL if nothing was inserted.
+ **/
+FriendNode *link_into_friend_list(FriendNode **head, FriendIndex **index, User *node)
+{
+  if (node == NULL)
+    return NULL;
+  FriendNode **link = head;
+  int walked = 0;
+  while (*link != NULL && strcmp((*link)->user->name, node->name) < 0)
+  {
+    link = &(*link)->next;
+    walked++;
+  }
+  stat_count(STAT_LIST_NODES, walked);
+  stat_count(STAT_NAME_COMPARES, walked + (*link != NULL));
+  if (*link != NULL && strcmp((*link)->user->name, node->name) == 0)
+  {
+    printf("User already in list\n");
+    return NULL;
+  }
+  FriendIndex *ix = *index;
+  if (ix != NULL && 2 * (ix->count + 1) > ix->mask + 1)
+  {
+    reindex_friend_list(head, index); // Rebuilt at double the size; the nodes stay put
+    ix = *index;
+  }
+  FriendNode *fn = slab_alloc(&friend_node_slab);
+  if (fn == NULL)
+    return NULL;
+  fn->user = node;
+  fn->next = *link;
+  if (ix != NULL)
+  {
+    // The node after fn is now reached through fn->next
+    if (fn->next != NULL)
+      ix->links[friend_index_find(ix, fn->next->user)] = &fn->next;
+    *link = fn;
+    friend_index_put(ix, link);
+    return fn;
+  }
+  *link = fn;
+  int count = 0;
+  for (FriendNode *cur = *head; cur != NULL && count < FRIEND_INDEX_MIN; cur = cur->next)
+    count++;
+  if (count == FRIEND_INDEX_MIN)
+    reindex_friend_list(head, index);
+  return fn;
+}
+
+/**
+ * Unlinks and frees the node that link points at, keeping the list's index
+ * up to date. O(1) whether or not the list is indexed.
+ **/
+void unlink_from_friend_list(FriendIndex **index, FriendNode **link)
+{
+  FriendNode *fn = *link;
+  FriendIndex *ix = *index;
+  if (ix != NULL)
+  {
+    friend_index_remove(ix, fn->user);
+    // The node after fn is now reached through link
+    if (fn->next != NULL)
+      ix->links[friend_index_find(ix, fn->next->user)] = link;
+  }
+  *link = fn->next;
+  slab_free(&friend_node_slab, fn);
+  if (ix != NULL && ix->count < FRIEND_INDEX_MIN / 2)
+    free_friend_index(index);
+}
+
+/**
+ * Checks if a brand is inside a BrandNode LL.
+ **/
+bool in_brand_list(BrandNode *head, char *name)
+{
+  int walked = 0;
+  for (BrandNode *cur = head; cur != NULL; cur = cur->next)
+  {
+    walked++;
+    if (strcmp(cur->brand_name, name) == 0)
+    {
+      stat_count(STAT_LIST_NODES, walked);
+      stat_count(STAT_NAME_COMPARES, walked);
+      return true;
+    }
+  }
+  stat_count(STAT_LIST_NODES, walked);
+  stat_count(STAT_NAME_COMPARES, walked);
+  return false;
+}
+
+/**
+ * Inserts a brand into a BrandNode LL in sorted position. If the brand
+ * already exists, nothing is done. Returns the new head of the LL.
+ **/
+BrandNode *insert_into_brand_list(BrandNode *head, char *node)
+{
+  if (node == NULL)
+    return head;
+
+  if (in_brand_list(head, node))
+  {
+    printf("Brand already in list\n");
+    return head;
+  }
+  BrandNode *fn = slab_alloc(&brand_node_slab);
+  if (fn == NULL)
+    return head;
+  fn->brand_name = intern_string(&name_arena, node);
+  if (fn->brand_name == NULL)
+  {
+    slab_free(&brand_node_slab, fn);
+    return head;
+  }
+  fn->next = NULL;
+  fn->idx = -1;
+  fn->follower_pos = -1;
+
+  if (head == NULL)
+    return fn;
+
+  if (strcmp(head->brand_name, node) > 0)
+  {
+    fn->next = head;
+    return fn;
+  }
+
+  BrandNode *cur;
+  for (cur = head; cur->next != NULL && strcmp(cur->next->brand_name, node) < 0;
+       cur = cur->next)
+    ;
+  fn->next = cur->next;
+  cur->next = fn;
+  return head;
+}
+
+/**
+ * Deletes a brand from BrandNode LL. If the user doesn't exist, nothing is
+ * done. Returns the new head of the LL.
+ **/
+BrandNode *delete_from_brand_list(BrandNode *head, char *node)
+{
+  if (node == NULL)
+    return head;
+
+  if (!in_brand_list(head, node))
+  {
+    printf("Brand not in list\n");
+    return head;
+  }
+
+  if (strcmp(head->brand_name, node) == 0)
+  {
+    BrandNode *temp = head->next;
+    slab_free(&brand_node_slab, head);
+    return temp;
+  }
+
+  BrandNode *cur;
+  for (cur = head; strcmp(cur->next->brand_name, node) != 0; cur = cur->next)
+    ;
+
+  BrandNode *temp = cur->next;
+  cur->next = temp->next;
+  slab_free(&brand_node_slab, temp);
+  return head;
+}
+
+/**
+ * Prints out the user data.
+ **/
+void print_user_data_unlocked(User *user)
+{
+  printf("User name: %s\n", user->name);
+  printf("Friends:\n");
+  for (FriendNode *f = user->friends; f != NULL; f = f->next)
+  {
+    printf("   %s\n", f->user->name);
+  }
+  printf("Brands:\n");
+  for (BrandNode *b = user->brands; b != NULL; b = b->next)
+  {
+    printf("   %s\n", b->brand_name);
+  }
+}
+
+void print_user_data(User *user)
+{
+  graph_read_lock();
+  print_user_data_unlocked(user);
+  graph_unlock();
+}
+
+/**
+ * Returns a pointer to the first word of row idx in the brand matrix.
+ **/
+uint64_t *brand_row(int idx)
+{
+  return brand_adjacency_matrix + (size_t)idx * brand_row_words;
+}
+
+/**
+ * Returns true if brands a and b are marked as similar.
+ **/
+bool brands_similar(int a, int b)
+{
+  return (brand_row(a)[b >> 6] >> (b & 63)) & 1;
+}
+
+/**
+ * Sets or clears the (symmetric) similarity bit between brands a and b.
+ **/
+void set_brands_similar(int a, int b, bool similar)
+{
+  uint64_t a_bit = (uint64_t)1 << (a & 63);
+  uint64_t b_bit = (uint64_t)1 << (b & 63);
+  if (similar)
+  {
+    brand_row(a)[b >> 6] |= b_bit;
+    brand_row(b)[a >> 6] |= a_bit;
+  }
+  else
+  {
+    brand_row(a)[b >> 6] &= ~b_bit;
+    brand_row(b)[a >> 6] &= ~a_bit;
+  }
+}
+
+/**
+ * set_brands_similar(a, b, true) for loaders filling the matrix from
+ * several threads at once.
+ **/
+void set_brands_similar_atomic(int a, int b)
+{
+  __atomic_fetch_or(&brand_row(a)[b >> 6], (uint64_t)1 << (b & 63), __ATOMIC_RELAXED);
+  __atomic_fetch_or(&brand_row(b)[a >> 6], (uint64_t)1 << (a & 63), __ATOMIC_RELAXED);
+}
+
+/**
+ * Counts the set bits in a row (or any word-aligned bit vector).
+ **/
+int bitset_popcount(const uint64_t *row, int words)
+{
+  int count = 0;
+  for (int w = 0; w < words; w++)
+  {
+    count += popcount64(row[w]);
+  }
+  return count;
+}
+
+/**
+ * Counts the bits set in both a and b, i.e. popcount(a AND b).
+ **/
+int bitset_and_popcount(const uint64_t *a, const uint64_t *b, int words)
+{
+  int count = 0;
+  for (int w = 0; w < words; w++)
+  {
+    count += popcount64(a[w] & b[w]);
+  }
+  return count;
+}
+
+/**
+ * Frees the brand names and matrix, leaving an empty brand graph.
+ **/
+void free_brand_matrix()
+{
+  for (int i = 0; i < num_brands && brand_followers != NULL; i++)
+  {
+    free(brand_followers[i].nodes);
+  }
+  free(brand_names);
+  free(brand_adjacency_matrix);
+  free(brand_slots);
+  free(brand_followers);
+  brand_names = NULL;
+  brand_adjacency_matrix = NULL;
+  brand_slots = NULL;
+  brand_followers = NULL;
+  num_brands = 0;
+  brand_row_words = 0;
+  free_brand_popularity();
+}
+
+/**
+ * Allocates a zeroed n x n brand matrix and an (empty) name table for n
+ * brands, replacing whatever was loaded before. Returns 0 on success.
+ **/
+int alloc_brand_matrix(int n)
+{
+  free_brand_matrix();
+  int words = (n + 63) / 64;
+  words = (words + BRAND_ROW_WORD_ALIGN - 1) / BRAND_ROW_WORD_ALIGN * BRAND_ROW_WORD_ALIGN;
+  size_t bytes = (size_t)n * words * sizeof(uint64_t);
+  if (bytes == 0)
+  {
+    bytes = BRAND_ROW_ALIGN;
+  }
+  int slots = 16;
+  while (slots < 2 * n)
+  {
+    slots *= 2;
+  }
+  brand_adjacency_matrix = aligned_alloc(BRAND_ROW_ALIGN, bytes);
+  brand_names = calloc(n > 0 ? n : 1, sizeof(char *));
+  brand_slots = malloc(slots * sizeof(int));
+  brand_followers = calloc(n > 0 ? n : 1, sizeof(BrandFollowers));
+  if (brand_adjacency_matrix == NULL || brand_names == NULL || brand_slots == NULL || brand_followers == NULL)
+  {
+    free(brand_adjacency_matrix);
+    free(brand_names);
+    free(brand_slots);
+    free(brand_followers);
+    brand_adjacency_matrix = NULL;
+    brand_names = NULL;
+    brand_slots = NULL;
+    brand_followers = NULL;
+    return -1;
+  }
+  memset(brand_adjacency_matrix, 0, bytes);
+  memset(brand_slots, -1, slots * sizeof(int));
+  brand_slot_mask = slots - 1;
+  num_brands = n;
+  brand_row_words = words;
+  if (reset_brand_popularity(n) != 0)
+  {
+    free_brand_matrix();
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Looks the brand name up in the brand hash table. Returns its index into
+ * brand_names or -1, without printing anything.
+ **/
+int find_brand_index(const char *name)
+{
+  if (brand_slots == NULL)
+  {
+    return -1;
+  }
+  for (int i = hash_string(name) & brand_slot_mask;; i = (i + 1) & brand_slot_mask)
+  {
+    int idx = brand_slots[i];
+    if (idx < 0 || strcmp(brand_names[idx], name) == 0)
+    {
+      return idx;
+    }
+  }
+}
+
+/**
+ * Adds brand_names[idx] to the hash table unless the name is already there
+ * (the first of several duplicate names wins, as with a linear search).
+ **/
+void add_brand_to_index(int idx)
+{
+  int i = hash_string(brand_names[idx]) & brand_slot_mask;
+  for (; brand_slots[i] >= 0; i = (i + 1) & brand_slot_mask)
+  {
+    if (strcmp(brand_names[brand_slots[i]], brand_names[idx]) == 0)
+    {
+      return;
+    }
+  }
+  brand_slots[i] = idx;
+}
+
+/**
+ * Get the index into brand_names for the given brand name. If it doesn't
+ * exist in the array, return -1
+ **/
+int get_brand_index(char *name)
+{
+  int idx = find_brand_index(name);
+  if (idx < 0)
+  {
+    printf("brand '%s' not found\n", name);
+  }
+  return idx;
+}
+
+/**
+ * Print out brand name, index and similar brands.
+ **/
+void print_brand_data_unlocked(char *brand_name)
+{
+  int idx = get_brand_index(brand_name);
+  if (idx < 0)
+  {
+    printf("Brand '%s' not in the list.\n", brand_name);
+    return;
+  }
+  printf("Brand name: %s\n", brand_name);
+  printf("Brand idx: %d\n", idx);
+  printf("Similar brands:\n");
+  uint64_t *row = brand_row(idx);
+  for (int w = 0; w < brand_row_words; w++)
+  {
+    for (uint64_t bits = row[w]; bits != 0; bits &= bits - 1)
+    {
+      printf("   %s\n", brand_names[w * 64 + __builtin_ctzll(bits)]);
+    }
+  }
+}
+
+void print_brand_data(char *brand_name)
+{
+  graph_read_lock();
+  print_brand_data_unlocked(brand_name);
+  graph_unlock();
+}
+
+/**
+ * Returns the user's BrandNode for the brand, or NULL if not followed.
+ **/
+BrandNode *find_brand_node(BrandNode *head, char *name)
+{
+  for (BrandNode *cur = head; cur != NULL; cur = cur->next)
+  {
+    if (strcmp(cur->brand_name, name) == 0)
+    {
+      return cur;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Records the follow in the brand's follower list. Brands that aren't
+ * loaded are left out of the index. Returns -1 if out of memory, in which
+ * case the caller must drop the follow so the index stays in step with
+ * the user's brand list.
+ **/
+int index_brand_follow(User *user, BrandNode *node)
+{
+  node->user = user;
+  node->idx = find_brand_index(node->brand_name);
+  node->follower_pos = -1;
+  if (node->idx < 0)
+  {
+    return 0;
+  }
+  BrandFollowers *bf = &brand_followers[node->idx];
+  if (bf->count == bf->cap)
+  {
+    int cap = bf->cap == 0 ? 4 : bf->cap * 2;
+    BrandNode **nodes = realloc(bf->nodes, cap * sizeof(BrandNode *));
+    if (nodes == NULL)
+    {
+      return -1;
+    }
+    bf->nodes = nodes;
+    bf->cap = cap;
+  }
+  node->follower_pos = bf->count;
+  bf->nodes[bf->count++] = node;
+  track_brand_follow(node->idx, 1);
+  return 0;
+}
+
+/**
+ * Removes the follow from its brand's follower list in O(1) by moving the
+ * last follower into its place.
+ **/
+void unindex_brand_follow(BrandNode *node)
+{
+  if (node == NULL || node->idx < 0 || node->follower_pos < 0)
+  {
+    return;
+  }
+  BrandFollowers *bf = &brand_followers[node->idx];
+  BrandNode *last = bf->nodes[--bf->count];
+  bf->nodes[node->follower_pos] = last;
+  last->follower_pos = node->follower_pos;
+  node->follower_pos = -1;
+  track_brand_follow(node->idx, -1);
+}
+
+/**
+ * Re-indexes every follow, e.g. after the brand list has been reloaded.
+ * Returns -1 if out of memory; the follows that couldn't be indexed are
+ * dropped from their users' brand lists.
+ **/
+int rebuild_brand_followers()
+{
+  int result = 0;
+  for (int i = 0; i < user_table_size; i++)
+  {
+    if (user_table[i] == NULL)
+    {
+      continue;
+    }
+    BrandNode **link = &user_table[i]->brands;
+    while (*link != NULL)
+    {
+      if (index_brand_follow(user_table[i], *link) == 0)
+      {
+        link = &(*link)->next;
+        continue;
+      }
+      BrandNode *dropped = *link;
+      *link = dropped->next;
+      slab_free(&brand_node_slab, dropped);
+      result = -1;
+    }
+  }
+  if (result != 0)
+    printf("Not enough memory to index brand followers\n");
+  return result;
+}
+
+/**
+ * Returns the brand's follower count, or in approximate mode an estimate
+ * that is never below it.
+ **/
+int brand_popularity(int brand)
+{
+  if (brand < 0 || brand >= num_brands)
+    return 0;
+  if (popularity.mode == POPULARITY_APPROXIMATE && popularity.sketch != NULL)
+    return sketch_estimate(&popularity, brand);
+  return brand_followers[brand].count;
+}
+
+int compare_popular(const void *a, const void *b)
+{
+  int x = brand_popularity(*(const int *)a);
+  int y = brand_popularity(*(const int *)b);
+  return (x < y) - (x > y);
+}
+
+/**
+ * Writes up to n of the most followed brands to out, most followed first,
+ * and their counts (estimates in approximate mode) to counts if it isn't
+ * NULL. Returns how many were written. O(n) in exact mode, where brands
+ * with equal counts come in no particular order; approximate mode sorts
+ * its popularity_k tracked brands.
+ **/
+int get_popular_brands_unlocked(char **out, int *counts, int n)
+{
+  BrandPopularity *p = &popularity;
+  int *top = NULL;
+  int size = 0;
+  if (p->mode == POPULARITY_EXACT && p->order != NULL)
+  {
+    top = p->order;
+    size = n < num_brands ? n : num_brands;
+  }
+  else if (p->mode == POPULARITY_APPROXIMATE && p->heap != NULL)
+  {
+    top = malloc((p->heap_size > 0 ? p->heap_size : 1) * sizeof(int));
+    if (top == NULL)
+      return 0;
+    memcpy(top, p->heap, p->heap_size * sizeof(int));
+    qsort(top, p->heap_size, sizeof(int), compare_popular);
+    size = n < p->heap_size ? n : p->heap_size;
+  }
+  for (int i = 0; i < size; i++)
+  {
+    out[i] = brand_names[top[i]];
+    if (counts != NULL)
+      counts[i] = brand_popularity(top[i]);
+  }
+  if (top != p->order)
+    free(top);
+  return size;
+}
+
+int get_popular_brands(char **out, int *counts, int n)
+{
+  graph_read_lock();
+  int result = get_popular_brands_unlocked(out, counts, n);
+  graph_unlock();
+  return result;
+}
+
+/**
+ * Switches the popularity tracker to POPULARITY_EXACT or
+ * POPULARITY_APPROXIMATE (taking popularity_k and popularity_sketch_width
+ * as they are now) and reloads it from the current follows. Returns -1 if
+ * out of memory, leaving the tracker off until the next brand reload.
+ **/
+int set_brand_popularity_mode_unlocked(int mode)
+{
+  if (mode != POPULARITY_EXACT && mode != POPULARITY_APPROXIMATE)
+    return -1;
+  popularity.mode = mode;
+  if (reset_brand_popularity(num_brands) != 0)
+    return -1;
+  for (int b = 0; b < num_brands; b++)
+  {
+    if (mode == POPULARITY_APPROXIMATE)
+    {
+      if (brand_followers[b].count > 0)
+        track_approximate(&popularity, b, brand_followers[b].count);
+      continue;
+    }
+    for (int c = 0; c < brand_followers[b].count && popularity.order != NULL; c++)
+      track_exact(&popularity, b, c, 1);
+  }
+  return mode == POPULARITY_EXACT && popularity.order == NULL ? -1 : 0;
+}
+
+int set_brand_popularity_mode(int mode)
+{
+  graph_write_lock();
+  int result = set_brand_popularity_mode_unlocked(mode);
+  graph_unlock();
+  return result;
+}
+
+int checkName(char *name)
+{
+  int len = strlen(name);
+  for (int i = 0; i < len; i++)
+  {
+    if (name[i] != ' ' || name[i] != '\0')
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Gives the user a free id and records it in user_table. Returns -1 if the
+ * table could not grow.
+ **/
+int register_user(User *user)
+{
+  if (num_free_user_ids > 0)
+  {
+    user->id = free_user_ids[--num_free_user_ids];
+    user_table[user->id] = user;
+    return 0;
+  }
+  if (user_table_size == user_table_cap)
+  {
+    int cap = user_table_cap == 0 ? 64 : user_table_cap * 2;
+    User **table = realloc(user_table, cap * sizeof(User *));
+    int *ids = realloc(free_user_ids, cap * sizeof(int));
+    FriendIndex **indexes = realloc(friend_index, cap * sizeof(FriendIndex *));
+    if (table != NULL)
+      user_table = table;
+    if (ids != NULL)
+      free_user_ids = ids;
+    if (indexes != NULL)
+    {
+      memset(indexes + user_table_cap, 0, (cap - user_table_cap) * sizeof(FriendIndex *));
+      friend_index = indexes;
+    }
+    if (table == NULL || ids == NULL || indexes == NULL)
+      return -1;
+    user_table_cap = cap;
+  }
+  user->id = user_table_size++;
+  user_table[user->id] = user;
+  return 0;
+}
+
+/**
+ * Releases the user's id so it can be reused.
+ **/
+void unregister_user(User *user)
+{
+  user_table[user->id] = NULL;
+  free_user_ids[num_free_user_ids++] = user->id;
+}
+
+/**
+ * Returns the user with the given name, or NULL if there is none.
+ **/
+User *find_user_unlocked(const char *name)
+{
+  if (user_slots == NULL || name == NULL)
+    return NULL;
+  for (int i = hash_string(name) & user_slot_mask;; i = (i + 1) & user_slot_mask)
+  {
+    if (user_slots[i] == NULL || strcmp(user_slots[i]->name, name) == 0)
+      return user_slots[i];
+  }
+}
+
+User *find_user(const char *name)
+{
+  long long start = stat_start();
+  graph_read_lock();
+  User *result = find_user_unlocked(name);
+  graph_unlock();
+  stat_record(STAT_FIND_USER, start);
+  return result;
+}
+
+/**
+ * Adds the user to the name index unless the name is already taken.
+ * Returns -1 if the index could not grow.
+ **/
+int index_user_name(User *user)
+{
+  if (2 * (user_slot_count + 1) > user_slot_mask + 1)
+  {
+    int cap = user_slot_mask == 0 ? 1024 : 2 * (user_slot_mask + 1);
+    User **slots = calloc(cap, sizeof(User *));
+    if (slots == NULL)
+      return -1;
+    for (int i = 0; user_slots != NULL && i <= user_slot_mask; i++)
+    {
+      if (user_slots[i] == NULL)
+        continue;
+      int j = hash_string(user_slots[i]->name) & (cap - 1);
+      while (slots[j] != NULL)
+        j = (j + 1) & (cap - 1);
+      slots[j] = user_slots[i];
+    }
+    free(user_slots);
+    user_slots = slots;
+    user_slot_mask = cap - 1;
+  }
+  int i = hash_string(user->name) & user_slot_mask;
+  for (; user_slots[i] != NULL; i = (i + 1) & user_slot_mask)
+  {
+    if (strcmp(user_slots[i]->name, user->name) == 0)
+      return 0;
+  }
+  user_slots[i] = user;
+  user_slot_count++;
+  return 0;
+}
+
+/**
+ * Removes the user from the name index. Later entries of the probe run are
+ * shifted back so lookups never stop early at the freed slot.
+ **/
+void unindex_user_name(User *user)
+{
+  if (user_slots == NULL)
+    return;
+  int i = hash_string(user->name) & user_slot_mask;
+  for (; user_slots[i] != user; i = (i + 1) & user_slot_mask)
+  {
+    if (user_slots[i] == NULL)
+      return;
+  }
+  user_slots[i] = NULL;
+  user_slot_count--;
+  for (int j = (i + 1) & user_slot_mask; user_slots[j] != NULL; j = (j + 1) & user_slot_mask)
+  {
+    int home = hash_string(user_slots[j]->name) & user_slot_mask;
+    // Move j back into the hole unless its home lies cyclically in (i, j]
+    bool stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+    if (!stays)
+    {
+      user_slots[i] = user_slots[j];
+      user_slots[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+size_t slab_bytes(SlabAllocator *a)
+{
+  return (size_t)a->num_slabs * a->items_per_slab * a->item_size;
+}
+
+/**
+ * Sets the bytes held by users, friendships and brand follows.
+ **/
+void memory_usage(size_t *user_bytes, size_t *edge_bytes, size_t *follow_bytes)
+{
+  long users = user_slab.live;
+  *user_bytes = slab_bytes(&user_slab) + name_arena.bytes + user_table_cap * (sizeof(User *) + sizeof(int) + sizeof(FriendIndex *)) + users * sizeof(FriendNode);
+  *edge_bytes = slab_bytes(&friend_node_slab) - users * sizeof(FriendNode) + friend_index_bytes; // Includes allUsers' index
+  *follow_bytes = slab_bytes(&brand_node_slab);
+}
+
+/**
+ * Prints the memory held by users, friendships and brand follows, and the
+ * resulting bytes per user, per friendship edge and per follow.
+ **/
+void print_memory_usage()
+{
+  long users = user_slab.live;
+  long edges = (friend_node_slab.live - users) / 2; // Less the allUsers nodes
+  long follows = brand_node_slab.live;
+  size_t user_bytes, edge_bytes, follow_bytes;
+  memory_usage(&user_bytes, &edge_bytes, &follow_bytes);
+  printf("Users: %ld (%zu bytes, %.1f per user)\n", users, user_bytes, users > 0 ? (double)user_bytes / users : 0.0);
+  printf("Friendships: %ld (%zu bytes, %.1f per edge)\n", edges, edge_bytes, edges > 0 ? (double)edge_bytes / edges : 0.0);
+  printf("Follows: %ld (%zu bytes, %.1f per follow)\n", follows, follow_bytes, follows > 0 ? (double)follow_bytes / follows : 0.0);
+}
+
+// Connected components of the friend graph as a union-find over user ids
+// (union by rank, path halving), so "are a and b connected at all?" needs
+// no search. create_user and add_friend keep it up to date; a removal that
+// may split a component marks it stale and the next query rebuilds it. A
+// rebuild leaves every id pointing at its root, and only writers (holding
+// graph_lock for writing) compress paths, so readers can share it.
+int *component_parent;
+unsigned char *component_rank;
+int component_cap;
+bool components_stale;
+pthread_mutex_t components_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void invalidate_components()
+{
+  __atomic_store_n(&components_stale, true, __ATOMIC_RELEASE);
+}
+
+int component_reserve(int size)
+{
+  if (size <= component_cap)
+    return 0;
+  int cap = component_cap == 0 ? 64 : component_cap;
+  while (cap < size)
+    cap *= 2;
+  int *parent = realloc(component_parent, cap * sizeof(int));
+  if (parent != NULL)
+    component_parent = parent;
+  unsigned char *rank = realloc(component_rank, cap);
+  if (rank != NULL)
+    component_rank = rank;
+  if (parent == NULL || rank == NULL)
+    return -1;
+  component_cap = cap;
+  return 0;
+}
+
+int component_find(int id)
+{
+  while (component_parent[id] != id)
+    id = component_parent[id];
+  return id;
+}
+
+int component_find_halving(int id)
+{
+  while (component_parent[id] != id)
+  {
+    component_parent[id] = component_parent[component_parent[id]];
+    id = component_parent[id];
+  }
+  return id;
+}
+
+void component_union(int a, int b)
+{
+  a = component_find_halving(a);
+  b = component_find_halving(b);
+  if (a == b)
+    return;
+  if (component_rank[a] < component_rank[b])
+  {
+    int t = a;
+    a = b;
+    b = t;
+  }
+  component_parent[b] = a;
+  if (component_rank[a] == component_rank[b])
+    component_rank[a]++;
+}
+
+/**
+ * Puts a newly registered user in a component of their own.
+ **/
+void component_add_user(User *user)
+{
+  if (components_stale)
+    return;
+  if (component_reserve(user_table_size) != 0)
+  {
+    invalidate_components();
+    return;
+  }
+  component_parent[user->id] = user->id;
+  component_rank[user->id] = 0;
+}
+
+void component_add_friendship(User *a, User *b)
+{
+  if (!components_stale)
+    component_union(a->id, b->id);
+}
+
+/**
+ * Rebuilds the components from the friend lists in O(V + E α(V)), then
+ * points every id straight at its root. Returns -1 if out of memory.
+ **/
+int rebuild_components()
+{
+  if (component_reserve(user_table_size) != 0)
+    return -1;
+  for (int i = 0; i < user_table_size; i++)
+  {
+    component_parent[i] = i;
+    component_rank[i] = 0;
+  }
+  for (int i = 0; i < user_table_size; i++)
+  {
+    if (user_table[i] == NULL)
+      continue;
+    for (FriendNode *f = user_table[i]->friends; f != NULL; f = f->next)
+    {
+      if (f->user->id > i)
+        component_union(i, f->user->id);
+    }
+  }
+  for (int i = 0; i < user_table_size; i++)
+    component_parent[i] = component_find_halving(i);
+  return 0;
+}
+
+/**
+ * Makes sure the component index is current, rebuilding it if an update
+ * left it stale. Safe under the read lock: concurrent readers serialise on
+ * components_lock and only one of them rebuilds. Returns false if the index
+ * can't be used (out of memory).
+ **/
+bool components_ready()
+{
+  if (!__atomic_load_n(&components_stale, __ATOMIC_ACQUIRE))
+    return true;
+  pthread_mutex_lock(&components_lock);
+  bool ready = !components_stale;
+  if (!ready && rebuild_components() == 0)
+  {
+    __atomic_store_n(&components_stale, false, __ATOMIC_RELEASE);
+    ready = true;
+  }
+  pthread_mutex_unlock(&components_lock);
+  return ready;
+}
+
+/**
+ * Checks whether a and b are connected by some chain of friendships, in
+ * near-constant time. Returns 1 if they are, 0 if not and -1 if a or b is
+ * NULL or the index couldn't be built.
+ **/
+int users_connected_unlocked(User *a, User *b)
+{
+  if (a == NULL || b == NULL || !components_ready())
+    return -1;
+  return component_find(a->id) == component_find(b->id);
+}
+
+int users_connected(User *a, User *b)
+{
+  graph_read_lock();
+  int result = users_connected_unlocked(a, b);
+  graph_unlock();
+  return result;
+}
+
+// Mutation journal: an append-only log of every successful mutation, so
+// the graph can be rebuilt after a crash from the last snapshot plus the
+// journal (see open_journal()). Mutations append records to the pending
+// batch under graph_lock; a flusher thread writes each batch out with one
+// write and one fdatasync, so the sync is shared by the whole batch. A
+// record is an op byte followed by one or two '\0' terminated names.
+enum
+{
+  JOURNAL_CREATE_USER = 1,
+  JOURNAL_DELETE_USER,
+  JOURNAL_ADD_FRIEND,
+  JOURNAL_REMOVE_FRIEND,
+  JOURNAL_FOLLOW_BRAND,
+  JOURNAL_UNFOLLOW_BRAND,
+  JOURNAL_CONNECT_BRANDS,
+  JOURNAL_REMOVE_BRANDS
+};
+
+#define JOURNAL_MAGIC 0x4C4E524Au // "JRNL"
+#define JOURNAL_BATCH_BYTES (256 * 1024) // Flush early once this much is pending
+
+// Each batch is written as one frame: this header, then its records
+typedef struct journal_frame_struct
+{
+  uint32_t magic;
+  uint32_t count;
+  uint64_t bytes;    // Record bytes after the header
+  uint64_t checksum; // hash_bytes() of the records
+} JournalFrame;
+
+typedef struct journal_struct
+{
+  int fd; // -1 while no journal is open
+  char *snapshot_file;
+  char *pending; // Frame header space, then the records not yet flushed
+  size_t pending_bytes;
+  size_t pending_cap;
+  uint32_t pending_count;
+  char *spare; // The other buffer, written by the flusher
+  size_t spare_cap;
+  unsigned long appended; // Records appended since the journal was opened
+  unsigned long durable;  // How many of those are known to be on disk
+  int sync_waiters;
+  bool unlogged; // A bulk load wasn't journalled, so compact instead
+  bool flushing;
+  bool failed;
+  bool stop;
+  pthread_t flusher;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+} Journal;
+
+Journal journal = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+int journal_flush_ms = 5; // Longest a record waits for the next batch
+
+/**
+ * Appends a record to the pending batch if a journal is open. b may be
+ * NULL for ops on a single name. Called with graph_lock held for writing.
+ **/
+void journal_append(int op, const char *a, const char *b)
+{
+  if (journal.fd < 0)
+    return;
+  size_t len_a = strlen(a) + 1;
+  size_t len_b = b == NULL ? 0 : strlen(b) + 1;
+  pthread_mutex_lock(&journal.lock);
+  if (journal.failed)
+  {
+    pthread_mutex_unlock(&journal.lock);
+    return;
+  }
+  size_t need = sizeof(JournalFrame) + journal.pending_bytes + 1 + len_a + len_b;
+  if (need > journal.pending_cap)
+  {
+    size_t cap = journal.pending_cap * 2;
+    while (cap < need)
+      cap *= 2;
+    char *pending = realloc(journal.pending, cap);
+    if (pending == NULL)
+    {
+      printf("Out of memory, the journal is no longer written\n");
+      journal.failed = true;
+      pthread_mutex_unlock(&journal.lock);
+      return;
+    }
+    journal.pending = pending;
+    journal.pending_cap = cap;
+  }
+  char *p = journal.pending + sizeof(JournalFrame) + journal.pending_bytes;
+  *p++ = op;
+  memcpy(p, a, len_a);
+  if (len_b > 0)
+    memcpy(p + len_a, b, len_b);
+  journal.pending_bytes += 1 + len_a + len_b;
+  journal.pending_count++;
+  journal.appended++;
+  if (journal.pending_count == 1 || journal.pending_bytes >= JOURNAL_BATCH_BYTES)
+    pthread_cond_signal(&journal.work);
+  pthread_mutex_unlock(&journal.lock);
+}
+
+/**
+ * Called by bulk loads, which aren't journalled record by record: the next
+ * sync_journal() or close_journal() compacts the journal into a snapshot
+ * instead, and nothing is flushed until then.
+ **/
+void journal_mark_unlogged()
+{
+  if (journal.fd < 0)
+    return;
+  pthread_mutex_lock(&journal.lock);
+  journal.unlogged = true;
+  pthread_mutex_unlock(&journal.lock);
+}
+
+User *create_user_unlocked(char *name)
+{
+  if (strcmp("", name) == 0 || checkName(name) == 0)
+  {
+    return NULL;
+  }
+  // The journal names users, so two of the same name couldn't be replayed
+  if (find_user_unlocked(name) != NULL)
+  {
+    printf("User already in list\n");
+    return NULL;
+  }
+  User *newUser = slab_alloc(&user_slab);
+  if (newUser == NULL)
+  {
+    return NULL;
+  }
+  newUser->name = intern_string(&name_arena, name);
+  newUser->friends = NULL;
+  newUser->brands = NULL;
+  if (newUser->name == NULL || register_user(newUser) != 0)
+  {
+    slab_free(&user_slab, newUser);
+    return NULL;
+  }
+  index_user_name(newUser);
+  component_add_user(newUser);
+  newUser->listed = link_into_friend_list(&allUsers, &all_users_index, newUser) != NULL;
+  journal_append(JOURNAL_CREATE_USER, newUser->name, NULL);
+  graph_version++;
+  return newUser;
+}
+
+User *create_user(char *name)
+{
+  long long start = stat_start();
+  graph_write_lock();
+  User *result = create_user_unlocked(name);
+  graph_unlock();
+  stat_record(STAT_CREATE_USER, start);
+  return result;
+}
+
+
+BrandNode *delete_brand_from_user(BrandNode *head)
+{
+  if (head == NULL)
+  {
+    return head;
+  }
+  BrandNode *current = head;
+  BrandNode *after = NULL;
+  while (current != NULL)
+  {
+    after = current->next;
+    unindex_brand_follow(current);
+    slab_free(&brand_node_slab, current);
+    current = after;
+  }
+  return NULL;
+}
+
+int delete_user_unlocked(User *user)
+{
+  if (user == NULL)
+  {
+    return -1;
+  }
+  user->brands = delete_brand_from_user(user->brands);
+  if (user->friends != NULL)
+    invalidate_components();
+  FriendNode *temp = user->friends;
+  FriendNode *holder = NULL;
+  while (temp != NULL)
+  {
+    FriendNode **link = friend_link(temp->user, user);
+    if (link != NULL) {
+      unlink_from_friend_list(&friend_index[temp->user->id], link);
+    }
+    temp = temp->next;
+  }
+  free_friend_index(&friend_index[user->id]);
+  temp = user->friends;
+  while (temp != NULL) {
+    holder = temp->next;
+    slab_free(&friend_node_slab, temp);
+    temp = holder;
+  }
+  FriendNode **listed = find_friend_link(&allUsers, all_users_index, user);
+  if (listed != NULL)
+    unlink_from_friend_list(&all_users_index, listed);
+  unindex_user_name(user);
+  if (user->id < influence_size)
+    influence[user->id] = 0; // Its id may be handed out again
+  journal_append(JOURNAL_DELETE_USER, user->name, NULL);
+  unregister_user(user);
+  slab_free(&user_slab, user);
+  graph_version++;
+  return 0;
 }
 
 int delete_user(User *user)
 {
-  if (user == NULL)
+  long long start = stat_start();
+  graph_write_lock();
+  int result = delete_user_unlocked(user);
+  graph_unlock();
+  stat_record(STAT_DELETE_USER, start);
+  return result;
+}
+
+
+/**
+ * Counts the friends a and b have in common. Both friend lists are sorted by
+ * name, so a single merge pass over them is enough.
+ **/
+int get_mutual_friends_unlocked(User *a, User *b)
+{
+  if (a == NULL || b == NULL || a->friends == NULL || b->friends == NULL)
+  {
+    return 0;
+  }
+  int num_friends = 0;
+  int steps = 0, compares = 0;
+  FriendNode *a_temp = a->friends;
+  FriendNode *b_temp = b->friends;
+  while (a_temp != NULL && b_temp != NULL)
+  {
+    steps++;
+    int cmp = a_temp->user == b_temp->user ? 0 : (compares++, strcmp(a_temp->user->name, b_temp->user->name));
+    if (cmp == 0)
+    {
+      num_friends++;
+      a_temp = a_temp->next;
+      b_temp = b_temp->next;
+    }
+    else if (cmp < 0)
+    {
+      a_temp = a_temp->next;
+    }
+    else
+    {
+      b_temp = b_temp->next;
+    }
+  }
+  stat_count(STAT_LIST_NODES, steps + num_friends); // A match steps both lists
+  stat_count(STAT_NAME_COMPARES, compares);
+  return num_friends;
+}
+
+int get_mutual_friends(User *a, User *b)
+{
+  long long start = stat_start();
+  graph_read_lock();
+  int result = get_mutual_friends_unlocked(a, b);
+  graph_unlock();
+  stat_record(STAT_MUTUAL_FRIENDS, start);
+  return result;
+}
+
+
+/**
+ * Checks whether a and b have a friend in common, walking the shorter
+ * friend list and looking each friend up in the other one.
+ **/
+bool have_common_friend(User *a, User *b)
+{
+  FriendIndex *ia = friend_index[a->id], *ib = friend_index[b->id];
+  if (ia != NULL && (ib == NULL || ib->count < ia->count))
+  {
+    User *t = a;
+    a = b;
+    b = t;
+  }
+  for (FriendNode *f = a->friends; f != NULL; f = f->next)
+  {
+    if (are_friends(b, f->user))
+      return true;
+  }
+  return false;
+}
+
+int add_friend_unlocked(User *user, User *friend)
+{
+  if (user == NULL || friend == NULL)
+  {
+    return -1;
+  }
+  else if (strcmp(user->name, friend->name) == 0) {
+    return -1;
+  }
+  else if (are_friends(user, friend)) {
+    return -1;
+  }
+  // Either side refuses a second user of the same name (or runs out of
+  // memory); the friendship is kept only if both sides took it
+  if (link_into_friend_list(&user->friends, &friend_index[user->id], friend) == NULL)
+    return -1;
+  if (link_into_friend_list(&friend->friends, &friend_index[friend->id], user) == NULL)
+  {
+    unlink_from_friend_list(&friend_index[user->id], friend_link(user, friend));
+    return -1;
+  }
+  component_add_friendship(user, friend);
+  journal_append(JOURNAL_ADD_FRIEND, user->name, friend->name);
+  graph_version++;
+  return 0;
+}
+
+int add_friend(User *user, User *friend)
+{
+  long long start = stat_start();
+  graph_write_lock();
+  int result = add_friend_unlocked(user, friend);
+  graph_unlock();
+  stat_record(STAT_ADD_FRIEND, start);
+  return result;
+}
+
+
+int remove_friend_unlocked(User *user, User *friend)
+{
+  if (user == NULL || friend == NULL || user->friends == NULL || friend->friends == NULL)
+  {
+    return -1;
+  }
+  FriendNode **link = friend_link(user, friend);
+  FriendNode **back = friend_link(friend, user);
+  if (link == NULL || back == NULL)
+  {
+    return -1;
+  }
+  unlink_from_friend_list(&friend_index[user->id], link);
+  unlink_from_friend_list(&friend_index[friend->id], back);
+  // A friend in common still connects them, so no component can have split
+  if (!have_common_friend(user, friend))
+    invalidate_components();
+  journal_append(JOURNAL_REMOVE_FRIEND, user->name, friend->name);
+  graph_version++;
+  return 0;
+}
+
+int remove_friend(User *user, User *friend)
+{
+  long long start = stat_start();
+  graph_write_lock();
+  int result = remove_friend_unlocked(user, friend);
+  graph_unlock();
+  stat_record(STAT_REMOVE_FRIEND, start);
+  return result;
+}
+
+
+int follow_brand_unlocked(User *user, char *brand_name)
+{
+  int brand_i = get_brand_index(brand_name);
+  if (user == NULL || brand_i == -1)
+  {
+    return -1;
+  }
+  else if (in_brand_list(user->brands, brand_name))
+  {
+    return -1;
+  }
+  user->brands = insert_into_brand_list(user->brands, brand_name);
+  BrandNode *node = find_brand_node(user->brands, brand_name);
+  if (node == NULL)
+  {
+    return -1;
+  }
+  if (index_brand_follow(user, node) != 0)
+  {
+    user->brands = delete_from_brand_list(user->brands, brand_name);
+    return -1;
+  }
+  journal_append(JOURNAL_FOLLOW_BRAND, user->name, brand_name);
+  graph_version++;
+  return 0;
+}
+
+int follow_brand(User *user, char *brand_name)
+{
+  long long start = stat_start();
+  graph_write_lock();
+  int result = follow_brand_unlocked(user, brand_name);
+  graph_unlock();
+  stat_record(STAT_FOLLOW_BRAND, start);
+  return result;
+}
+
+
+int unfollow_brand_unlocked(User *user, char *brand_name)
+{
+  if (user == NULL || get_brand_index(brand_name) == -1)
+  {
+    return -1;
+  }
+  BrandNode *node = find_brand_node(user->brands, brand_name);
+  if (node == NULL)
+  {
+    printf("Brand not in list\n");
+    return 0; // Nothing to journal, and every snapshot is still current
+  }
+  unindex_brand_follow(node);
+  user->brands = delete_from_brand_list(user->brands, brand_name);
+  journal_append(JOURNAL_UNFOLLOW_BRAND, user->name, brand_name);
+  graph_version++;
+  return 0;
+}
+
+int unfollow_brand(User *user, char *brand_name)
+{
+  long long start = stat_start();
+  graph_write_lock();
+  int result = unfollow_brand_unlocked(user, brand_name);
+  graph_unlock();
+  stat_record(STAT_UNFOLLOW_BRAND, start);
+  return result;
+}
+
+
+int numUsers_unlocked(){
+  int count = 0;
+  FriendNode *temp = allUsers;
+  while(temp != NULL) {
+    count++;
+    temp = temp->next;
+  }
+  return count;
+}
+
+int numUsers()
+{
+  graph_read_lock();
+  int result = numUsers_unlocked();
+  graph_unlock();
+  return result;
+}
+
+// State for breadth-first searches over the friend graph. The frontiers
+// are power-of-two ring buffers of users and visited marks are epoch stamps
+// indexed by user id: a user is visited in the current search iff
+// stamp[id] == epoch, so starting a new search is just epoch++.
+typedef struct bfs_engine_struct
+{
+  User **ring;
+  User **ring_back; // Second frontier for bidirectional searches
+  int ring_mask;
+  unsigned int *stamp;
+  int *dist; // Hops from the side that stamped the user
+  int stamp_cap;
+  unsigned int epoch;
+  long explored; // Users expanded by the last search
+} BfsEngine;
+
+#define BFS_SINGLE 0
+#define BFS_BIDIRECTIONAL 1
+
+// Search state is per thread, so concurrent readers never share it
+_Thread_local BfsEngine bfs_engine;
+int degrees_search_mode = BFS_BIDIRECTIONAL;
+
+/**
+ * Makes sure the engine can hold every user in user_table and reserves
+ * `epochs` fresh stamp values, the last of which is e->epoch. Returns -1 if
+ * memory could not be allocated.
+ **/
+int bfs_begin(BfsEngine *e, unsigned int epochs)
+{
+  if (e->stamp_cap < user_table_size)
+  {
+    int cap = e->stamp_cap == 0 ? 64 : e->stamp_cap;
+    while (cap < user_table_size)
+      cap *= 2;
+    unsigned int *stamp = realloc(e->stamp, cap * sizeof(unsigned int));
+    if (stamp != NULL)
+      e->stamp = stamp;
+    int *dist = realloc(e->dist, cap * sizeof(int));
+    if (dist != NULL)
+      e->dist = dist;
+    User **ring = realloc(e->ring, cap * sizeof(User *));
+    if (ring != NULL)
+      e->ring = ring;
+    User **ring_back = realloc(e->ring_back, cap * sizeof(User *));
+    if (ring_back != NULL)
+      e->ring_back = ring_back;
+    if (stamp == NULL || dist == NULL || ring == NULL || ring_back == NULL)
+      return -1;
+    memset(e->stamp + e->stamp_cap, 0, (cap - e->stamp_cap) * sizeof(unsigned int));
+    e->stamp_cap = cap;
+    e->ring_mask = cap - 1;
+  }
+  if (e->epoch > UINT32_MAX - epochs)
+  {
+    // Stamps would wrap around and old marks could look current again
+    memset(e->stamp, 0, e->stamp_cap * sizeof(unsigned int));
+    e->epoch = 0;
+  }
+  e->epoch += epochs;
+  e->explored = 0;
+  return 0;
+}
+
+/**
+ * Marks the user visited for the current search. Returns false if it was
+ * already visited.
+ **/
+bool bfs_mark(BfsEngine *e, User *user)
+{
+  if (e->stamp[user->id] == e->epoch)
+    return false;
+  e->stamp[user->id] = e->epoch;
+  return true;
+}
+
+/**
+ * Breadth-first search from a, level by level, stopping as soon as b is
+ * discovered. Returns the number of hops from a to b, or -1 if b can't be
+ * reached. Runs in O(V + E) for the part of the graph it explores.
+ **/
+int bfs_distance(BfsEngine *e, User *a, User *b)
+{
+  if (bfs_begin(e, 1) != 0)
+    return -1;
+  if (a == b)
+    return 0;
+  unsigned int head = 0, tail = 0;
+  bfs_mark(e, a);
+  e->ring[tail++ & e->ring_mask] = a;
+  for (int depth = 1; head != tail; depth++)
+  {
+    // Expand exactly the users that were queued at the previous depth
+    for (unsigned int level_end = tail; head != level_end; head++)
+    {
+      User *current = e->ring[head & e->ring_mask];
+      e->explored++;
+      for (FriendNode *f = current->friends; f != NULL; f = f->next)
+      {
+        if (f->user == b)
+          return depth;
+        if (bfs_mark(e, f->user))
+          e->ring[tail++ & e->ring_mask] = f->user;
+      }
+    }
+  }
+  return -1;
+}
+
+/**
+ * Bidirectional breadth-first search between a and b. Each round expands
+ * one full level of whichever frontier is smaller; the search stops at the
+ * end of the first level where the two sides touch, taking the shortest
+ * of the paths found through that level. Returns the same distances as
+ * bfs_distance() while typically exploring only the neighbourhoods of
+ * radius ~d/2 around each end.
+ **/
+int bfs_distance_bidirectional(BfsEngine *e, User *a, User *b)
+{
+  if (bfs_begin(e, 2) != 0)
+    return -1;
+  if (a == b)
+    return 0;
+  unsigned int mark[2] = {e->epoch - 1, e->epoch};
+  User **ring[2] = {e->ring, e->ring_back};
+  unsigned int head[2] = {0, 0};
+  unsigned int tail[2] = {0, 0};
+  int depth[2] = {0, 0};
+  User *ends[2] = {a, b};
+  for (int s = 0; s < 2; s++)
+  {
+    e->stamp[ends[s]->id] = mark[s];
+    e->dist[ends[s]->id] = 0;
+    ring[s][tail[s]++ & e->ring_mask] = ends[s];
+  }
+
+  while (head[0] != tail[0] && head[1] != tail[1])
+  {
+    int s = tail[0] - head[0] <= tail[1] - head[1] ? 0 : 1;
+    int best = -1;
+    for (unsigned int level_end = tail[s]; head[s] != level_end; head[s]++)
+    {
+      User *current = ring[s][head[s] & e->ring_mask];
+      e->explored++;
+      for (FriendNode *f = current->friends; f != NULL; f = f->next)
+      {
+        int id = f->user->id;
+        if (e->stamp[id] == mark[1 - s])
+        {
+          int total = depth[s] + 1 + e->dist[id];
+          if (best < 0 || total < best)
+            best = total;
+        }
+        else if (e->stamp[id] != mark[s])
+        {
+          e->stamp[id] = mark[s];
+          e->dist[id] = depth[s] + 1;
+          ring[s][tail[s]++ & e->ring_mask] = f->user;
+        }
+      }
+    }
+    if (best >= 0)
+      return best;
+    depth[s]++;
+  }
+  return -1;
+}
+
+int get_degrees_of_connection_unlocked(User *a, User *b)
+{
+  if (a == NULL || b == NULL || a->friends == NULL || b->friends == NULL)
+  {
+    return -1;
+  }
+  else if (strcmp(a->name, b->name) == 0) {
+    return 0;
+  }
+  else if (are_friends(a, b)) {
+    return 1;
+  }
+  else if (users_connected_unlocked(a, b) == 0) {
+    return -1;
+  }
+  int hops;
+  if (degrees_search_mode == BFS_BIDIRECTIONAL) {
+    hops = bfs_distance_bidirectional(&bfs_engine, a, b);
+  }
+  else {
+    hops = bfs_distance(&bfs_engine, a, b);
+  }
+  stat_count(STAT_USERS_EXPANDED, bfs_engine.explored);
+  return hops;
+}
+
+int get_degrees_of_connection(User *a, User *b)
+{
+  long long start = stat_start();
+  graph_read_lock();
+  int result = get_degrees_of_connection_unlocked(a, b);
+  graph_unlock();
+  stat_record(STAT_DEGREES, start);
+  return result;
+}
+
+int compare_longs(const void *a, const void *b)
+{
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+// Bit-parallel BFS from up to 64 sources at once (MS-BFS). Bit i of seen[v]
+// says source i has reached user v, so a single walk over the edges of a
+// frontier user advances every source that has reached it. mark and slot
+// are per-user extras for the callers; all arrays are indexed by user id
+// and are left zeroed between runs (only touched entries are cleared).
+typedef struct multi_source_bfs_struct
+{
+  uint64_t *seen;
+  uint64_t *visit;
+  uint64_t *visit_next;
+  uint64_t *mark;
+  int *slot;
+  int *frontier;
+  int *next_frontier;
+  int *touched;
+  int cap;
+} MultiSourceBfs;
+
+#define MSBFS_WIDTH 64
+#define MSBFS_SHARE_COST 4 // A shared BFS costs a source about 1/4 of a full one
+
+_Thread_local MultiSourceBfs ms_bfs;
+
+// Called once per user reached at each depth, with the sources that
+// reached it there. Returning false ends the search.
+typedef bool (*MsBfsVisit)(void *ctx, User *user, uint64_t sources, int depth);
+
+int msbfs_begin(MultiSourceBfs *m)
+{
+  if (m->cap >= user_table_size)
+    return 0;
+  int cap = m->cap == 0 ? 64 : m->cap;
+  while (cap < user_table_size)
+    cap *= 2;
+  uint64_t **words[] = {&m->seen, &m->visit, &m->visit_next, &m->mark};
+  for (int i = 0; i < 4; i++)
+  {
+    uint64_t *w = realloc(*words[i], cap * sizeof(uint64_t));
+    if (w == NULL)
+      return -1;
+    memset(w + m->cap, 0, (cap - m->cap) * sizeof(uint64_t));
+    *words[i] = w;
+  }
+  int **ints[] = {&m->slot, &m->frontier, &m->next_frontier, &m->touched};
+  for (int i = 0; i < 4; i++)
+  {
+    int *w = realloc(*ints[i], cap * sizeof(int));
+    if (w == NULL)
+      return -1;
+    *ints[i] = w;
+  }
+  m->cap = cap;
+  return 0;
+}
+
+/**
+ * Runs one MS-BFS from count (<= 64) sources, up to max_depth hops (no limit
+ * if negative), reporting newly reached users level by level to visit().
+ **/
+void msbfs_run(MultiSourceBfs *m, User **sources, int count, int max_depth, MsBfsVisit visit, void *ctx)
+{
+  int num_frontier = 0, num_touched = 0;
+  for (int i = 0; i < count; i++)
+  {
+    int id = sources[i]->id;
+    if (m->seen[id] == 0)
+      m->touched[num_touched++] = id;
+    if (m->visit[id] == 0)
+      m->frontier[num_frontier++] = id;
+    m->seen[id] |= (uint64_t)1 << i;
+    m->visit[id] |= (uint64_t)1 << i;
+  }
+  bool going = true;
+  for (int depth = 1; going && num_frontier > 0 && (max_depth < 0 || depth <= max_depth); depth++)
+  {
+    int num_next = 0;
+    for (int f = 0; f < num_frontier; f++)
+    {
+      int v = m->frontier[f];
+      uint64_t bits = m->visit[v];
+      m->visit[v] = 0;
+      for (FriendNode *fn = user_table[v]->friends; fn != NULL; fn = fn->next)
+      {
+        int w = fn->user->id;
+        uint64_t fresh = bits & ~m->seen[w];
+        if (fresh == 0)
+          continue;
+        if (m->seen[w] == 0)
+          m->touched[num_touched++] = w;
+        m->seen[w] |= fresh;
+        if (m->visit_next[w] == 0)
+          m->next_frontier[num_next++] = w;
+        m->visit_next[w] |= fresh;
+      }
+    }
+    for (int f = 0; f < num_next && going; f++)
+      going = visit(ctx, user_table[m->next_frontier[f]], m->visit_next[m->next_frontier[f]], depth);
+
+    uint64_t *t = m->visit;
+    m->visit = m->visit_next;
+    m->visit_next = t;
+    int *tf = m->frontier;
+    m->frontier = m->next_frontier;
+    m->next_frontier = tf;
+    num_frontier = num_next;
+  }
+  for (int i = 0; i < num_touched; i++)
+  {
+    int id = m->touched[i];
+    m->seen[id] = 0;
+    m->visit[id] = 0;
+    m->visit_next[id] = 0;
+  }
+}
+
+// Targets for one MS-BFS batch of degree queries: mark[w] holds the sources
+// (bits) that want their distance to w, recorded in levels[slot[w] * 64 + i]
+typedef struct degree_batch_struct
+{
+  MultiSourceBfs *m;
+  int *levels;
+  long remaining;
+} DegreeBatch;
+
+bool record_degrees(void *ctx, User *user, uint64_t sources, int depth)
+{
+  DegreeBatch *db = ctx;
+  uint64_t hits = sources & db->m->mark[user->id];
+  for (; hits != 0; hits &= hits - 1)
+  {
+    db->levels[db->m->slot[user->id] * MSBFS_WIDTH + __builtin_ctzll(hits)] = depth;
+    db->remaining--;
+  }
+  return db->remaining > 0;
+}
+
+/**
+ * Answers the pending pairs order[lo..hi) (sorted by source) whose sources
+ * are the distinct users in sources[0..count), count <= 64, with one MS-BFS.
+ **/
+void degrees_msbfs(MultiSourceBfs *m, User **as, User **bs, int *order, int lo, int hi, User **sources, int count, int *out)
+{
+  int *levels = malloc((size_t)(hi - lo) * MSBFS_WIDTH * sizeof(int));
+  if (levels == NULL)
+  {
+    for (int p = lo; p < hi; p++)
+      out[order[p]] = bfs_distance_bidirectional(&bfs_engine, as[order[p]], bs[order[p]]);
+    return;
+  }
+  DegreeBatch db = {m, levels, 0};
+  int num_slots = 0;
+  int bit = -1;
+  for (int p = lo; p < hi; p++)
+  {
+    if (p == lo || as[order[p]] != as[order[p - 1]])
+      bit++;
+    int b = bs[order[p]]->id;
+    if (m->mark[b] == 0)
+    {
+      m->slot[b] = num_slots;
+      for (int i = 0; i < MSBFS_WIDTH; i++)
+        levels[num_slots * MSBFS_WIDTH + i] = -1;
+      num_slots++;
+    }
+    if (!(m->mark[b] & (uint64_t)1 << bit))
+      db.remaining++;
+    m->mark[b] |= (uint64_t)1 << bit;
+  }
+  msbfs_run(m, sources, count, -1, record_degrees, &db);
+
+  bit = -1;
+  for (int p = lo; p < hi; p++)
+  {
+    if (p == lo || as[order[p]] != as[order[p - 1]])
+      bit++;
+    int b = bs[order[p]]->id;
+    out[order[p]] = levels[m->slot[b] * MSBFS_WIDTH + bit];
+  }
+  for (int p = lo; p < hi; p++)
+    m->mark[bs[order[p]]->id] = 0;
+  free(levels);
+}
+
+/**
+ * Answers n degree-of-connection queries (as[i], bs[i]) into out[i], with
+ * exactly the results get_degrees_of_connection() would give. Pairs are
+ * grouped by source and answered by bidirectional search until a source's
+ * searches have explored more than 1/MSBFS_SHARE_COST of the graph; its
+ * remaining pairs then wait for one full BFS, shared 64 sources at a time.
+ **/
+void get_degrees_of_connection_batch_unlocked(User **as, User **bs, int n, int *out)
+{
+  long long *keys = malloc((n + 1) * sizeof(long long));
+  int *order = malloc((n + 1) * sizeof(int));
+  User **sources = malloc((n + 1) * sizeof(User *));
+  if (keys == NULL || order == NULL || sources == NULL || msbfs_begin(&ms_bfs) != 0)
+  {
+    for (int i = 0; i < n; i++)
+      out[i] = get_degrees_of_connection_unlocked(as[i], bs[i]);
+    free(keys);
+    free(order);
+    free(sources);
+    return;
+  }
+
+  // Settle the trivial cases exactly like the single query, queue the rest
+  int pending = 0;
+  for (int i = 0; i < n; i++)
+  {
+    User *a = as[i], *b = bs[i];
+    if (a == NULL || b == NULL || a->friends == NULL || b->friends == NULL)
+      out[i] = -1;
+    else if (strcmp(a->name, b->name) == 0)
+      out[i] = 0;
+    else if (users_connected_unlocked(a, b) == 0)
+      out[i] = -1;
+    else
+      keys[pending++] = (long long)a->id << 32 | i;
+  }
+  qsort(keys, pending, sizeof(long long), compare_longs);
+
+  // Pairs deferred to shared searches are compacted to the front of order
+  long budget = user_slab.live / MSBFS_SHARE_COST;
+  int deferred = 0, num_sources = 0;
+  for (int p = 0; p < pending;)
+  {
+    User *a = as[keys[p] & 0xffffffff];
+    long explored = 0;
+    for (; p < pending && as[keys[p] & 0xffffffff] == a; p++)
+    {
+      int i = (int)(keys[p] & 0xffffffff);
+      if (explored > budget)
+      {
+        if (deferred == 0 || as[order[deferred - 1]] != a)
+          sources[num_sources++] = a;
+        order[deferred++] = i;
+        continue;
+      }
+      out[i] = bfs_distance_bidirectional(&bfs_engine, a, bs[i]);
+      explored += bfs_engine.explored;
+    }
+  }
+  free(keys);
+
+  for (int p = 0, first = 0; p < deferred; first += MSBFS_WIDTH)
+  {
+    int count = num_sources - first < MSBFS_WIDTH ? num_sources - first : MSBFS_WIDTH;
+    int end = p, seen = 0;
+    for (; end < deferred; end++)
+    {
+      if (end == p || as[order[end]] != as[order[end - 1]])
+      {
+        if (seen == count)
+          break;
+        seen++;
+      }
+    }
+    degrees_msbfs(&ms_bfs, as, bs, order, p, end, sources + first, count, out);
+    p = end;
+  }
+  free(order);
+  free(sources);
+}
+
+void get_degrees_of_connection_batch(User **as, User **bs, int n, int *out)
+{
+  graph_read_lock();
+  get_degrees_of_connection_batch_unlocked(as, bs, n, out);
+  graph_unlock();
+}
+
+/**
+ * Writes up to max users within `hops` hops of the user (not counting the
+ * user) to out, nearest first. Returns how many were written.
+ **/
+int get_users_within_unlocked(User *user, int hops, User **out, int max)
+{
+  if (user == NULL || hops <= 0 || max <= 0 || bfs_begin(&bfs_engine, 1) != 0)
+    return 0;
+  BfsEngine *e = &bfs_engine;
+  unsigned int head = 0, tail = 0;
+  int found = 0;
+  bfs_mark(e, user);
+  e->ring[tail++ & e->ring_mask] = user;
+  for (int depth = 1; depth <= hops && head != tail; depth++)
+  {
+    for (unsigned int level_end = tail; head != level_end; head++)
+    {
+      User *current = e->ring[head & e->ring_mask];
+      for (FriendNode *f = current->friends; f != NULL; f = f->next)
+      {
+        if (!bfs_mark(e, f->user))
+          continue;
+        out[found++] = f->user;
+        if (found == max)
+          return found;
+        e->ring[tail++ & e->ring_mask] = f->user;
+      }
+    }
+  }
+  return found;
+}
+
+int get_users_within(User *user, int hops, User **out, int max)
+{
+  graph_read_lock();
+  int result = get_users_within_unlocked(user, hops, out, max);
+  graph_unlock();
+  return result;
+}
+
+bool count_reached(void *ctx, User *user, uint64_t sources, int depth)
+{
+  (void)user;
+  (void)depth;
+  int *counts = ctx;
+  for (; sources != 0; sources &= sources - 1)
+    counts[__builtin_ctzll(sources)]++;
+  return true;
+}
+
+/**
+ * For each of n users, counts the users within `hops` hops of them (not
+ * counting themselves) into out[i], 64 users per MS-BFS.
+ **/
+void count_users_within_batch_unlocked(User **users, int n, int hops, int *out)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = 0;
+  if (hops <= 0 || msbfs_begin(&ms_bfs) != 0)
+    return;
+  User *batch[MSBFS_WIDTH];
+  int index[MSBFS_WIDTH];
+  for (int i = 0; i < n;)
+  {
+    int count = 0;
+    for (; i < n && count < MSBFS_WIDTH; i++)
+    {
+      if (users[i] == NULL)
+        continue;
+      batch[count] = users[i];
+      index[count++] = i;
+    }
+    int counts[MSBFS_WIDTH] = {0};
+    msbfs_run(&ms_bfs, batch, count, hops, count_reached, counts);
+    for (int j = 0; j < count; j++)
+      out[index[j]] = counts[j];
+  }
+}
+
+void count_users_within_batch(User **users, int n, int hops, int *out)
+{
+  graph_read_lock();
+  count_users_within_batch_unlocked(users, n, hops, out);
+  graph_unlock();
+}
+
+
+void connect_similar_brands_unlocked(char *brandNameA, char *brandNameB)
+{
+  int a_idx = get_brand_index(brandNameA);
+  int b_idx = get_brand_index(brandNameB);
+  if (a_idx == -1 || b_idx == -1)
+  {
+    return;
+  }
+  set_brands_similar(a_idx, b_idx, true);
+  journal_append(JOURNAL_CONNECT_BRANDS, brand_names[a_idx], brand_names[b_idx]);
+  return;
+}
+
+void connect_similar_brands(char *brandNameA, char *brandNameB)
+{
+  graph_write_lock();
+  connect_similar_brands_unlocked(brandNameA, brandNameB);
+  graph_unlock();
+}
+
+
+void remove_similar_brands_unlocked(char *brandNameA, char *brandNameB)
+{
+  int a_idx = get_brand_index(brandNameA);
+  int b_idx = get_brand_index(brandNameB);
+  if (a_idx == -1 || b_idx == -1)
+  {
+    return;
+  }
+  set_brands_similar(a_idx, b_idx, false);
+  journal_append(JOURNAL_REMOVE_BRANDS, brand_names[a_idx], brand_names[b_idx]);
+  return;
+}
+
+void remove_similar_brands(char *brandNameA, char *brandNameB)
+{
+  graph_write_lock();
+  remove_similar_brands_unlocked(brandNameA, brandNameB);
+  graph_unlock();
+}
+
+// Brand graph analytics. Sets of brands are bitsets laid out like matrix
+// rows, so one BFS level is the OR of the frontier's rows followed by an
+// AND NOT of what has been seen, each a word at a time.
+
+/**
+ * Allocates count zeroed brand bitsets of brand_row_words words each,
+ * aligned like the matrix. Returns NULL if memory runs out.
+ **/
+uint64_t *alloc_brand_bitsets(int count)
+{
+  size_t bytes = (size_t)count * brand_row_words * sizeof(uint64_t);
+  if (bytes == 0)
+    bytes = BRAND_ROW_ALIGN;
+  uint64_t *bits = aligned_alloc(BRAND_ROW_ALIGN, bytes);
+  if (bits != NULL)
+    memset(bits, 0, bytes);
+  return bits;
+}
+
+/**
+ * One BFS level over the brand graph: next becomes the brands similar to
+ * one in frontier that aren't in seen, and they are added to seen. Returns
+ * how many there are.
+ **/
+int brand_bfs_step(const uint64_t *frontier, uint64_t *seen, uint64_t *next)
+{
+  memset(next, 0, brand_row_words * sizeof(uint64_t));
+  for (int w = 0; w < brand_row_words; w++)
+  {
+    for (uint64_t bits = frontier[w]; bits != 0; bits &= bits - 1)
+    {
+      const uint64_t *row = brand_row(w * 64 + __builtin_ctzll(bits));
+      for (int x = 0; x < brand_row_words; x++)
+        next[x] |= row[x];
+    }
+  }
+  int count = 0;
+  for (int x = 0; x < brand_row_words; x++)
+  {
+    next[x] &= ~seen[x];
+    seen[x] |= next[x];
+    count += popcount64(next[x]);
+  }
+  return count;
+}
+
+/**
+ * Runs a BFS over the brand graph from brand idx for up to hops levels (all
+ * of them if hops < 0). If to isn't -1 it stops once brand to is reached.
+ * level[b] receives the hop count of each reached brand (0 for idx itself)
+ * and -1 for the rest. Returns the number of brands reached besides idx, or
+ * -1 if memory runs out.
+ **/
+int brand_bfs(int idx, int hops, int to, int *level)
+{
+  uint64_t *sets = alloc_brand_bitsets(3);
+  if (sets == NULL)
+    return -1;
+  uint64_t *seen = sets, *frontier = sets + brand_row_words, *next = sets + 2 * brand_row_words;
+  for (int b = 0; b < num_brands; b++)
+    level[b] = -1;
+  level[idx] = 0;
+  seen[idx >> 6] |= (uint64_t)1 << (idx & 63);
+  frontier[idx >> 6] |= (uint64_t)1 << (idx & 63);
+  int reached = 0;
+  for (int depth = 1; hops < 0 || depth <= hops; depth++)
+  {
+    if (to >= 0 && level[to] >= 0)
+      break;
+    int found = brand_bfs_step(frontier, seen, next);
+    if (found == 0)
+      break;
+    reached += found;
+    for (int w = 0; w < brand_row_words; w++)
+    {
+      for (uint64_t bits = next[w]; bits != 0; bits &= bits - 1)
+        level[w * 64 + __builtin_ctzll(bits)] = depth;
+    }
+    uint64_t *t = frontier;
+    frontier = next;
+    next = t;
+  }
+  free(sets);
+  return reached;
+}
+
+/**
+ * Writes up to max brands within hops hops of the brand (itself excluded)
+ * to out, nearest first. Returns how many were written, or -1 if the brand
+ * doesn't exist.
+ **/
+int get_brands_within_hops_unlocked(char *brand_name, int hops, char **out, int max)
+{
+  int idx = get_brand_index(brand_name);
+  if (idx < 0)
+    return -1;
+  int *level = malloc(num_brands * sizeof(int));
+  if (level == NULL || brand_bfs(idx, hops, -1, level) < 0)
+  {
+    free(level);
+    return 0;
+  }
+  int written = 0;
+  for (int depth = 1; depth <= hops && written < max; depth++)
+  {
+    for (int b = 0; b < num_brands && written < max; b++)
+    {
+      if (level[b] == depth)
+        out[written++] = brand_names[b];
+    }
+  }
+  free(level);
+  return written;
+}
+
+int get_brands_within_hops(char *brand_name, int hops, char **out, int max)
+{
+  graph_read_lock();
+  int result = get_brands_within_hops_unlocked(brand_name, hops, out, max);
+  graph_unlock();
+  return result;
+}
+
+/**
+ * Returns the number of similarity hops between two brands, 0 if they are
+ * the same brand and -1 if either doesn't exist or they aren't connected.
+ **/
+int get_brand_hops_unlocked(char *brandNameA, char *brandNameB)
+{
+  int a = get_brand_index(brandNameA);
+  int b = get_brand_index(brandNameB);
+  if (a < 0 || b < 0)
+    return -1;
+  int *level = malloc(num_brands * sizeof(int));
+  if (level == NULL || brand_bfs(a, -1, b, level) < 0)
+  {
+    free(level);
+    return -1;
+  }
+  int hops = level[b];
+  free(level);
+  return hops;
+}
+
+int get_brand_hops(char *brandNameA, char *brandNameB)
+{
+  graph_read_lock();
+  int result = get_brand_hops_unlocked(brandNameA, brandNameB);
+  graph_unlock();
+  return result;
+}
+
+void print_brands_within_hops_unlocked(char *brand_name, int hops)
+{
+  int idx = get_brand_index(brand_name);
+  if (idx < 0)
+  {
+    printf("Brand '%s' not in the list.\n", brand_name);
+    return;
+  }
+  int *level = malloc(num_brands * sizeof(int));
+  if (level == NULL || brand_bfs(idx, hops, -1, level) < 0)
+  {
+    free(level);
+    return;
+  }
+  printf("Brands within %d hops of %s:\n", hops, brand_name);
+  for (int depth = 1; depth <= hops; depth++)
+  {
+    for (int b = 0; b < num_brands; b++)
+    {
+      if (level[b] == depth)
+        printf("   %s (%d)\n", brand_names[b], depth);
+    }
+  }
+  free(level);
+}
+
+void print_brands_within_hops(char *brand_name, int hops)
+{
+  graph_read_lock();
+  print_brands_within_hops_unlocked(brand_name, hops);
+  graph_unlock();
+}
+
+/**
+ * Splits the brand graph into connected clusters, numbered from 0 in order
+ * of their lowest brand index. If cluster isn't NULL, cluster[b] receives
+ * brand b's cluster; if closure isn't NULL (num_brands rows laid out like
+ * the matrix), row b receives every brand reachable from b, which for a
+ * brand with any similar brand is its whole cluster, itself included. Each
+ * cluster costs one bitset BFS, so the whole closure is O(brands * words).
+ * Returns the number of clusters, or -1 if memory runs out.
+ **/
+int brand_clusters(int *cluster, uint64_t *closure)
+{
+  uint64_t *sets = alloc_brand_bitsets(4);
+  if (sets == NULL)
+    return -1;
+  uint64_t *assigned = sets, *frontier = sets + brand_row_words;
+  uint64_t *next = sets + 2 * brand_row_words, *members = sets + 3 * brand_row_words;
+  int count = 0;
+  for (int start = 0; start < num_brands; start++)
+  {
+    if ((assigned[start >> 6] >> (start & 63)) & 1)
+      continue;
+    // Brands already assigned belong to other clusters, so they can double
+    // as this search's seen set
+    memset(frontier, 0, brand_row_words * sizeof(uint64_t));
+    memset(members, 0, brand_row_words * sizeof(uint64_t));
+    frontier[start >> 6] = (uint64_t)1 << (start & 63);
+    members[start >> 6] = frontier[start >> 6];
+    assigned[start >> 6] |= frontier[start >> 6];
+    int size = 1;
+    int found;
+    while ((found = brand_bfs_step(frontier, assigned, next)) > 0)
+    {
+      size += found;
+      for (int x = 0; x < brand_row_words; x++)
+        members[x] |= next[x];
+      uint64_t *t = frontier;
+      frontier = next;
+      next = t;
+    }
+    for (int w = 0; w < brand_row_words; w++)
+    {
+      for (uint64_t bits = members[w]; bits != 0; bits &= bits - 1)
+      {
+        int b = w * 64 + __builtin_ctzll(bits);
+        if (cluster != NULL)
+          cluster[b] = count;
+        if (closure != NULL && size > 1)
+          memcpy(closure + (size_t)b * brand_row_words, members, brand_row_words * sizeof(uint64_t));
+      }
+    }
+    count++;
+  }
+  free(sets);
+  return count;
+}
+
+int get_brand_clusters(int *cluster)
+{
+  graph_read_lock();
+  int result = brand_clusters(cluster, NULL);
+  graph_unlock();
+  return result;
+}
+
+/**
+ * Returns the transitive closure of the brand similarity graph as a new
+ * matrix laid out like brand_adjacency_matrix (see brand_clusters()), to be
+ * released with free(). Returns NULL if memory runs out.
+ **/
+uint64_t *brand_transitive_closure_unlocked()
+{
+  uint64_t *closure = alloc_brand_bitsets(num_brands);
+  if (closure != NULL && brand_clusters(NULL, closure) < 0)
+  {
+    free(closure);
+    return NULL;
+  }
+  return closure;
+}
+
+uint64_t *brand_transitive_closure()
+{
+  graph_read_lock();
+  uint64_t *result = brand_transitive_closure_unlocked();
+  graph_unlock();
+  return result;
+}
+
+void print_brand_clusters_unlocked()
+{
+  int *cluster = malloc((num_brands + 1) * sizeof(int));
+  int count = cluster != NULL ? brand_clusters(cluster, NULL) : -1;
+  if (count < 0)
+  {
+    free(cluster);
+    return;
+  }
+  printf("Brand clusters: %d\n", count);
+  for (int c = 0, b = 0; c < count; c++)
+  {
+    // Clusters are numbered by lowest index, so each starts at a new first brand
+    while (cluster[b] != c)
+      b++;
+    printf("Cluster %d:\n", c);
+    for (int x = b; x < num_brands; x++)
+    {
+      if (cluster[x] == c)
+        printf("   %s\n", brand_names[x]);
+    }
+  }
+  free(cluster);
+}
+
+void print_brand_clusters()
+{
+  graph_read_lock();
+  print_brand_clusters_unlocked();
+  graph_unlock();
+}
+
+
+int get_sim_brands_user(User *user, User *other)
+{
+  if (user == NULL || other == NULL)
+  {
+    return 0;
+  }
+  int sim_brands = 0;
+  BrandNode *brand = other->brands;
+  while (brand != NULL && user->brands != NULL)
+  {
+    if (in_brand_list(user->brands, brand->brand_name))
+    {
+      sim_brands++;
+    }
+    brand = brand->next;
+  }
+  return sim_brands;
+}
+
+// Sparse per-user counters for one query, stamped the same way as
+// BfsEngine visits so that starting a new query is O(1). Every user whose
+// counter was touched is listed in touched[0 .. num_touched).
+typedef struct user_counter_struct
+{
+  unsigned int *stamp;
+  int *count;
+  User **touched;
+  int num_touched;
+  int cap;
+  unsigned int epoch;
+} UserCounter;
+
+#define COUNTER_EXCLUDED (INT32_MIN / 2) // Far below any count a query adds up
+
+_Thread_local UserCounter suggest_counter;
+
+/**
+ * Clears all counters (in O(1)) and makes room for every user id. Returns
+ * -1 if memory could not be allocated.
+ **/
+int counter_begin(UserCounter *c)
+{
+  if (c->cap < user_table_size)
+  {
+    int cap = c->cap == 0 ? 64 : c->cap;
+    while (cap < user_table_size)
+      cap *= 2;
+    unsigned int *stamp = realloc(c->stamp, cap * sizeof(unsigned int));
+    if (stamp != NULL)
+      c->stamp = stamp;
+    int *count = realloc(c->count, cap * sizeof(int));
+    if (count != NULL)
+      c->count = count;
+    User **touched = realloc(c->touched, cap * sizeof(User *));
+    if (touched != NULL)
+      c->touched = touched;
+    if (stamp == NULL || count == NULL || touched == NULL)
+      return -1;
+    memset(c->stamp + c->cap, 0, (cap - c->cap) * sizeof(unsigned int));
+    c->cap = cap;
+  }
+  if (++c->epoch == 0)
+  {
+    memset(c->stamp, 0, c->cap * sizeof(unsigned int));
+    c->epoch = 1;
+  }
+  c->num_touched = 0;
+  return 0;
+}
+
+void counter_add(UserCounter *c, User *user, int delta)
+{
+  if (c->stamp[user->id] != c->epoch)
+  {
+    c->stamp[user->id] = c->epoch;
+    c->count[user->id] = 0;
+    c->touched[c->num_touched++] = user;
+  }
+  c->count[user->id] += delta;
+}
+
+int counter_get(UserCounter *c, User *user)
+{
+  return c->stamp[user->id] == c->epoch ? c->count[user->id] : 0;
+}
+
+// A user (by id) or brand (by index) with a score, for top-k rankings
+typedef struct scored_struct
+{
+  int id;
+  int score;
+  const char *name;
+  double tie; // Breaks equal scores before the name does (0 unless set)
+} Scored;
+
+/**
+ * True if a ranks ahead of b: higher score first, then higher tie, then
+ * the name that sorts last.
+ **/
+bool ranks_before(Scored a, Scored b)
+{
+  if (a.score != b.score)
+    return a.score > b.score;
+  if (a.tie != b.tie)
+    return a.tie > b.tie;
+  return strcmp(a.name, b.name) > 0;
+}
+
+// How suggestions with equal scores are ordered: by name (the name that
+// sorts last first) or by influence, then name.
+#define TIE_BREAK_NAME 0
+#define TIE_BREAK_INFLUENCE 1
+
+int suggest_tie_break = TIE_BREAK_NAME;
+
+/**
+ * The influence of a user, for callers holding influence_lock.
+ **/
+double influence_of(User *user)
+{
+  return user->id < influence_size ? influence[user->id] : 0.0;
+}
+
+/**
+ * The tie value for ranking user under suggest_tie_break, for callers
+ * holding influence_lock.
+ **/
+double suggestion_tie(User *user)
+{
+  return suggest_tie_break == TIE_BREAK_INFLUENCE ? influence_of(user) : 0.0;
+}
+
+void topk_sift_down(Scored *heap, int size, int i)
+{
+  for (;;)
+  {
+    int worst = i;
+    int l = 2 * i + 1, r = 2 * i + 2;
+    if (l < size && ranks_before(heap[worst], heap[l]))
+      worst = l;
+    if (r < size && ranks_before(heap[worst], heap[r]))
+      worst = r;
+    if (worst == i)
+      return;
+    Scored t = heap[i];
+    heap[i] = heap[worst];
+    heap[worst] = t;
+    i = worst;
+  }
+}
+
+/**
+ * Offers x to a bounded heap keeping the k best entries seen so far. The
+ * root is the worst of them, so most offers are rejected in O(1).
+ **/
+void topk_push(Scored *heap, int *size, int k, Scored x)
+{
+  if (*size < k)
+  {
+    int i = (*size)++;
+    heap[i] = x;
+    while (i > 0 && ranks_before(heap[(i - 1) / 2], heap[i]))
+    {
+      Scored t = heap[i];
+      heap[i] = heap[(i - 1) / 2];
+      heap[(i - 1) / 2] = t;
+      i = (i - 1) / 2;
+    }
+  }
+  else if (k > 0 && ranks_before(x, heap[0]))
+  {
+    heap[0] = x;
+    topk_sift_down(heap, *size, 0);
+  }
+}
+
+/**
+ * Heap-sorts a topk heap in place, best entry first.
+ **/
+void topk_sort(Scored *heap, int size)
+{
+  for (int end = size - 1; end > 0; end--)
+  {
+    Scored t = heap[0];
+    heap[0] = heap[end];
+    heap[end] = t;
+    topk_sift_down(heap, end, 0);
+  }
+}
+
+// How get_suggested_friend(s) rank candidates: by brands shared with the
+// user, or by mutual friends (plus suggest_brand_weight per shared brand).
+#define SUGGEST_BY_BRANDS 0
+#define SUGGEST_BY_MUTUAL_FRIENDS 1
+
+int suggest_mode = SUGGEST_BY_BRANDS;
+int suggest_brand_weight = 0;
+
+// Friends with more friends than this aren't expanded when counting mutual
+// friends: a celebrity makes everyone a friend of a friend and tells little.
+int fof_degree_cap = 1000;
+
+int friend_count(User *user)
+{
+  if (friend_index[user->id] != NULL)
+    return friend_index[user->id]->count;
+  int count = 0;
+  for (FriendNode *f = user->friends; f != NULL; f = f->next)
+    count++;
+  return count;
+}
+
+/**
+ * Finds up to k friends of friends of the user, ranked by mutual friends
+ * plus brand_weight times the brands they share with the user, ties going to
+ * the name that sorts last. Mutual friends with more than fof_degree_cap
+ * friends are skipped, so the work is bounded by the user's capped 2-hop
+ * neighbourhood, not the number of users. Writes the suggestions best first
+ * to out and, if mutual isn't NULL, their mutual friend counts to mutual.
+ * Returns how many there are.
+ **/
+int get_friend_of_friend_suggestions_unlocked(User *user, User **out, int *mutual, int k, int brand_weight)
+{
+  if (user == NULL || k <= 0)
+    return 0;
+  if (k > user_table_size)
+    k = user_table_size;
+  UserCounter *c = &suggest_counter;
+  Scored *heap = malloc(k * sizeof(Scored));
+  uint64_t *followed = brand_weight != 0 ? calloc(brand_row_words + 1, sizeof(uint64_t)) : NULL;
+  if (heap == NULL || (brand_weight != 0 && followed == NULL) || counter_begin(c) != 0)
+  {
+    free(heap);
+    free(followed);
+    return 0;
+  }
+  counter_add(c, user, COUNTER_EXCLUDED);
+  for (FriendNode *f = user->friends; f != NULL; f = f->next)
+    counter_add(c, f->user, COUNTER_EXCLUDED);
+  for (FriendNode *f = user->friends; f != NULL; f = f->next)
+  {
+    if (friend_count(f->user) > fof_degree_cap)
+      continue;
+    for (FriendNode *ff = f->user->friends; ff != NULL; ff = ff->next)
+      counter_add(c, ff->user, 1);
+  }
+  if (followed != NULL)
+  {
+    for (BrandNode *b = user->brands; b != NULL; b = b->next)
+    {
+      if (b->idx >= 0)
+        followed[b->idx / 64] |= (uint64_t)1 << (b->idx % 64);
+    }
+  }
+
+  int size = 0;
+  pthread_rwlock_rdlock(&influence_lock);
+  for (int i = 0; i < c->num_touched; i++)
+  {
+    User *other = c->touched[i];
+    int score = c->count[other->id];
+    if (score <= 0 || strcmp(other->name, user->name) == 0)
+      continue;
+    if (followed != NULL)
+    {
+      for (BrandNode *b = other->brands; b != NULL; b = b->next)
+      {
+        if (b->idx >= 0 && (followed[b->idx / 64] >> (b->idx % 64) & 1))
+          score += brand_weight;
+      }
+    }
+    topk_push(heap, &size, k, (Scored){other->id, score, other->name, suggestion_tie(other)});
+  }
+  pthread_rwlock_unlock(&influence_lock);
+  topk_sort(heap, size);
+  for (int i = 0; i < size; i++)
+  {
+    out[i] = user_table[heap[i].id];
+    if (mutual != NULL)
+      mutual[i] = c->count[heap[i].id];
+  }
+  free(heap);
+  free(followed);
+  return size;
+}
+
+int get_friend_of_friend_suggestions(User *user, User **out, int *mutual, int k, int brand_weight)
+{
+  long long start = stat_start();
+  graph_read_lock();
+  int result = get_friend_of_friend_suggestions_unlocked(user, out, mutual, k, brand_weight);
+  graph_unlock();
+  stat_record(STAT_FRIEND_OF_FRIEND, start);
+  return result;
+}
+
+/**
+ * Finds up to k suggested friends for the user. In SUGGEST_BY_MUTUAL_FRIENDS
+ * mode these are get_friend_of_friend_suggestions(); otherwise they are the
+ * non-friends sharing the most brands with them, ties going to the name
+ * that sorts last. The candidates are found through the brand follower
+ * index, so only users sharing at least one brand are counted, and like
+ * the baseline walk of allUsers only listed users qualify. Users sharing
+ * none are only considered (in reverse name order) when fewer than k share
+ * a brand.
+ * Writes the suggestions best first to out and returns how many there are.
+ **/
+int get_suggested_friends_unlocked(User *user, User **out, int k)
+{
+  if (suggest_mode == SUGGEST_BY_MUTUAL_FRIENDS)
+    return get_friend_of_friend_suggestions_unlocked(user, out, NULL, k, suggest_brand_weight);
+  if (user == NULL || k <= 0)
+    return 0;
+  if (k > user_table_size)
+    k = user_table_size;
+  UserCounter *c = &suggest_counter;
+  Scored *heap = malloc(k * sizeof(Scored));
+  if (heap == NULL || counter_begin(c) != 0)
+  {
+    free(heap);
+    return 0;
+  }
+  long walked = 0, compares = 0;
+  counter_add(c, user, COUNTER_EXCLUDED);
+  for (FriendNode *f = user->friends; f != NULL; f = f->next, walked++)
+    counter_add(c, f->user, COUNTER_EXCLUDED);
+  for (BrandNode *b = user->brands; b != NULL; b = b->next, walked++)
+  {
+    if (b->idx < 0)
+      continue;
+    BrandFollowers *bf = &brand_followers[b->idx];
+    for (int i = 0; i < bf->count; i++)
+      counter_add(c, bf->nodes[i]->user, 1);
+    walked += bf->count;
+  }
+
+  int size = 0;
+  pthread_rwlock_rdlock(&influence_lock);
+  for (int i = 0; i < c->num_touched; i++)
+  {
+    User *other = c->touched[i];
+    int shared = c->count[other->id];
+    if (shared > 0 && other->listed && (compares++, strcmp(other->name, user->name) != 0))
+      topk_push(heap, &size, k, (Scored){other->id, shared, other->name, suggestion_tie(other)});
+  }
+  pthread_rwlock_unlock(&influence_lock);
+  topk_sort(heap, size);
+  for (int i = 0; i < size; i++)
+    out[i] = user_table[heap[i].id];
+  free(heap);
+
+  // Top up with users that share no brands, last names first
+  int need = k - size;
+  if (need > 0)
+  {
+    User **last = malloc(need * sizeof(User *));
+    int seen = 0;
+    for (FriendNode *cur = allUsers; cur != NULL && last != NULL; cur = cur->next, walked++)
+    {
+      if (counter_get(c, cur->user) == 0 && (compares++, strcmp(cur->user->name, user->name) != 0))
+        last[seen++ % need] = cur->user;
+    }
+    int fill = seen < need ? seen : need;
+    for (int i = 0; i < fill; i++)
+      out[size++] = last[(seen - 1 - i) % need];
+    free(last);
+  }
+  stat_count(STAT_LIST_NODES, walked);
+  stat_count(STAT_NAME_COMPARES, compares);
+  return size;
+}
+
+int get_suggested_friends(User *user, User **out, int k)
+{
+  long long start = stat_start();
+  graph_read_lock();
+  int result = get_suggested_friends_unlocked(user, out, k);
+  graph_unlock();
+  stat_record(STAT_SUGGESTED_FRIENDS, start);
+  return result;
+}
+
+User *get_suggested_friend(User *user)
+{
+  User *best = NULL;
+  get_suggested_friends(user, &best, 1);
+  return best;
+}
+
+// Adds a suggested friend based off of the number of similar brands shared
+//
+// Brand scores don't change as friends are added, so one top-n pass is
+// enough there. Mutual friend counts do (each new friend's friends become
+// two hops away), so in SUGGEST_BY_MUTUAL_FRIENDS the best candidate is
+// picked again after every add.
+int add_suggested_friends_unlocked(User *user, int n)
+{
+  if (user == NULL || n <= 0)
+  {
+    return 0;
+  }
+  if (n > user_table_size)
+  {
+    n = user_table_size;
+  }
+  if (suggest_mode == SUGGEST_BY_MUTUAL_FRIENDS)
+  {
+    int count = 0;
+    User *best = NULL;
+    while (count < n && get_suggested_friends_unlocked(user, &best, 1) == 1 &&
+           add_friend_unlocked(user, best) == 0)
+      count++;
+    return count;
+  }
+  User **toAdd = malloc(n * sizeof(User *));
+  if (toAdd == NULL)
+  {
+    return 0;
+  }
+  int found = get_suggested_friends_unlocked(user, toAdd, n);
+  int count = 0;
+  while (count < found)
+  {
+    add_friend_unlocked(user, toAdd[count]);
+    count++;
+  }
+  free(toAdd);
+  return count;
+}
+
+int add_suggested_friends(User *user, int n)
+{
+  long long start = stat_start();
+  graph_write_lock();
+  int result = add_suggested_friends_unlocked(user, n);
+  graph_unlock();
+  stat_record(STAT_ADD_SUGGESTED_FRIENDS, start);
+  return result;
+}
+
+int sim_brand_num(BrandNode *head, char *brand)
+{
+  if (head == NULL)
+  {
+    return 0;
+  };
+  int num = 0;
+  int brand_idx = get_brand_index(brand);
+  int u_brand_idx;
+  BrandNode *temp = head;
+  while (temp != NULL)
+  {
+    u_brand_idx = get_brand_index(temp->brand_name);
+    if (u_brand_idx >= 0 && brands_similar(u_brand_idx, brand_idx))
+    {
+      num++;
+    }
+    temp = temp->next;
+  };
+  return num;
+}
+
+// follows n suggested brands based off of the brands the user currently follows
+// performed in reverse-alphanumeric order
+//
+// A brand's score is the number of followed brands it is similar to. With
+// the followed brands as a bit vector f that is popcount(row_j AND f) for
+// each brand row j of the matrix, i.e. one word-parallel pass over the
+// matrix; a bounded heap then picks the n best unfollowed brands.
+int follow_suggested_brands_unlocked(User *user, int n)
+{
+  if (user == NULL || n <= 0)
+  {
+    return 0;
+  }
+  int k = n < num_brands ? n : num_brands;
+  size_t bytes = (size_t)(brand_row_words > 0 ? brand_row_words : (int)BRAND_ROW_WORD_ALIGN) * sizeof(uint64_t);
+  uint64_t *followed = aligned_alloc(BRAND_ROW_ALIGN, bytes);
+  Scored *heap = malloc((k > 0 ? k : 1) * sizeof(Scored));
+  if (followed == NULL || heap == NULL)
+  {
+    free(followed);
+    free(heap);
+    return 0;
+  }
+  memset(followed, 0, bytes);
+  for (BrandNode *b = user->brands; b != NULL; b = b->next)
+  {
+    if (b->idx >= 0)
+    {
+      followed[b->idx >> 6] |= (uint64_t)1 << (b->idx & 63);
+    }
+  }
+
+  int size = 0;
+  for (int j = 0; j < num_brands; j++)
+  {
+    if (((followed[j >> 6] >> (j & 63)) & 1) || brand_names[j][0] == '\0')
+    {
+      continue;
+    }
+    int score = bitset_and_popcount(brand_row(j), followed, brand_row_words);
+    topk_push(heap, &size, k, (Scored){j, score, brand_names[j], popular_brand_ties ? brand_popularity(j) : 0});
+  }
+  topk_sort(heap, size);
+
+  // Stop at the first follow that runs out of memory; a brand listed twice
+  // under one name is only followed once
+  int added = 0;
+  for (int count = 0; count < size; count++)
+  {
+    char *name = brand_names[heap[count].id];
+    if (in_brand_list(user->brands, name))
+    {
+      continue;
+    }
+    user->brands = insert_into_brand_list(user->brands, name);
+    BrandNode *node = find_brand_node(user->brands, name);
+    if (node == NULL)
+    {
+      break;
+    }
+    if (index_brand_follow(user, node) != 0)
+    {
+      user->brands = delete_from_brand_list(user->brands, name);
+      break;
+    }
+    journal_append(JOURNAL_FOLLOW_BRAND, user->name, name);
+    added++;
+  }
+  free(followed);
+  free(heap);
+  if (added > 0)
+    graph_version++;
+  return added;
+}
+
+int follow_suggested_brands(User *user, int n)
+{
+  long long start = stat_start();
+  graph_write_lock();
+  int result = follow_suggested_brands_unlocked(user, n);
+  graph_unlock();
+  stat_record(STAT_FOLLOW_SUGGESTED_BRANDS, start);
+  return result;
+}
+
+
+// Frozen, read-only copy of the friend graph in compressed sparse row form.
+// Users are renumbered to dense ids 0..num_users-1 (in name order, or one
+// of the locality orders below), so each neighbour list is a sorted run of
+// ints:
+//   friend_ids[friend_offsets[u] .. friend_offsets[u + 1]]
+// and likewise brand_ids holds each user's followed brand indices, sorted.
+// The linked lists stay the write path; a snapshot answers for the graph as
+// it was when frozen and is stale once version != graph_version.
+typedef struct csr_search_struct
+{
+  int *ring[2];
+  unsigned int *stamp;
+  int *dist;
+  int cap;
+  unsigned int epoch;
+  long explored;
+} CsrSearch;
+
+typedef struct graph_snapshot_struct
+{
+  unsigned long version;
+  int refs; // Readers holding the snapshot through acquire_graph_snapshot()
+  int num_users;
+  int num_listed; // Users that are in allUsers; the rest were left out of it
+  int order;      // SNAPSHOT_ORDER_* the dense ids were assigned in
+  char **names;   // dense id -> interned name; name_arena is never freed, so
+                  // these stay valid after the user is deleted
+  int *user_ids;  // dense id -> User id when frozen
+  int *dense_id;  // User id -> dense id, -1 if the user isn't in the snapshot
+  int dense_id_cap;
+  int *name_slots; // Open-addressed name -> dense id of a listed user, -1 if empty
+  int name_slot_mask;
+  int *friend_offsets;
+  int *friend_ids;
+  int *brand_offsets;
+  int *brand_ids;
+  // Users with at least hub_degree friends also get their neighbour set as
+  // a bitset row (hub_words words, row hub_row[u]) for fast intersections
+  int hub_degree;
+  int num_hubs;
+  int hub_words;
+  int *hub_row;
+  uint64_t *hub_bits;
+} GraphSnapshot;
+
+// Traversal scratch for snapshot queries, per thread like bfs_engine. It
+// grows to the largest snapshot the thread has queried.
+_Thread_local CsrSearch csr_search;
+
+int compare_ints(const void *a, const void *b)
+{
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+void free_graph_snapshot(GraphSnapshot *s)
+{
+  if (s == NULL)
+    return;
+  free(s->names);
+  free(s->user_ids);
+  free(s->dense_id);
+  free(s->name_slots);
+  free(s->friend_offsets);
+  free(s->friend_ids);
+  free(s->brand_offsets);
+  free(s->brand_ids);
+  free(s->hub_row);
+  free(s->hub_bits);
+  free(s);
+}
+
+// A neighbour bitset costs num_users bits against 32 per friend in
+// friend_ids, so it pays off once a user has ~num_users / 32 friends. The
+// total bitset memory is capped at MAX_HUB_BYTES.
+#define MIN_HUB_DEGREE 64
+#define MAX_HUB_BYTES (64 << 20)
+
+int snapshot_degree(GraphSnapshot *s, int u)
+{
+  return s->friend_offsets[u + 1] - s->friend_offsets[u];
+}
+
+uint64_t *snapshot_hub_bits(GraphSnapshot *s, int row)
+{
+  return s->hub_bits + (size_t)row * s->hub_words;
+}
+
+/**
+ * Picks the snapshot's hub users and fills in their neighbour bitsets.
+ * Returns -1 if memory runs out.
+ **/
+int build_snapshot_hubs(GraphSnapshot *s)
+{
+  int n = s->num_users;
+  s->hub_words = (n + 63) / 64;
+  s->hub_words = (s->hub_words + BRAND_ROW_WORD_ALIGN - 1) / BRAND_ROW_WORD_ALIGN * BRAND_ROW_WORD_ALIGN;
+  s->hub_degree = n / 32 > MIN_HUB_DEGREE ? n / 32 : MIN_HUB_DEGREE;
+  size_t row_bytes = (size_t)s->hub_words * sizeof(uint64_t);
+  int max_hubs = row_bytes > 0 ? (int)(MAX_HUB_BYTES / row_bytes) : 0;
+
+  // Raise the threshold until the hubs fit in the memory cap
+  s->num_hubs = 0;
+  for (int u = 0; u < n; u++)
+    s->num_hubs += snapshot_degree(s, u) >= s->hub_degree;
+  while (s->num_hubs > max_hubs)
+  {
+    s->hub_degree *= 2;
+    s->num_hubs = 0;
+    for (int u = 0; u < n; u++)
+      s->num_hubs += snapshot_degree(s, u) >= s->hub_degree;
+  }
+  if (s->num_hubs == 0)
+    return 0;
+
+  s->hub_row = malloc(n * sizeof(int));
+  s->hub_bits = aligned_alloc(BRAND_ROW_ALIGN, s->num_hubs * row_bytes);
+  if (s->hub_row == NULL || s->hub_bits == NULL)
+    return -1;
+  memset(s->hub_bits, 0, s->num_hubs * row_bytes);
+  int row = 0;
+  for (int u = 0; u < n; u++)
+  {
+    if (snapshot_degree(s, u) < s->hub_degree)
+    {
+      s->hub_row[u] = -1;
+      continue;
+    }
+    uint64_t *bits = snapshot_hub_bits(s, row);
+    for (int k = s->friend_offsets[u]; k < s->friend_offsets[u + 1]; k++)
+      bits[s->friend_ids[k] >> 6] |= (uint64_t)1 << (s->friend_ids[k] & 63);
+    s->hub_row[u] = row++;
+  }
+  return 0;
+}
+
+// Dense id orders for snapshots. Name order is what save_graph() stores.
+// The others give friends nearby ids, so BFS, intersections and the other
+// kernels touch fewer cache lines of the per-user arrays:
+//   SNAPSHOT_ORDER_BFS     breadth first from the biggest hub of each
+//                          component, friends in list order
+//   SNAPSHOT_ORDER_RCM     reverse Cuthill-McKee: breadth first from the
+//                          lowest-degree user, friends by rising degree,
+//                          the whole order then reversed
+//   SNAPSHOT_ORDER_DEGREE  by falling degree, so the hubs share cache lines
+// Users in allUsers still come before any left out of it in every order.
+enum
+{
+  SNAPSHOT_ORDER_NAME,
+  SNAPSHOT_ORDER_BFS,
+  SNAPSHOT_ORDER_RCM,
+  SNAPSHOT_ORDER_DEGREE
+};
+
+int snapshot_order = SNAPSHOT_ORDER_BFS; // Used by freeze_graph()
+
+/**
+ * Fills by_degree with the dense ids sorted by degree, rising or falling,
+ * ties in id order. Returns -1 if out of memory.
+ **/
+int sort_by_degree(GraphSnapshot *s, int *by_degree, bool falling)
+{
+  int n = s->num_users;
+  int max_degree = 0;
+  for (int u = 0; u < n; u++)
+  {
+    if (snapshot_degree(s, u) > max_degree)
+      max_degree = snapshot_degree(s, u);
+  }
+  int *bucket = calloc(max_degree + 2, sizeof(int));
+  if (bucket == NULL)
+    return -1;
+  for (int u = 0; u < n; u++)
+  {
+    int d = snapshot_degree(s, u);
+    bucket[(falling ? max_degree - d : d) + 1]++;
+  }
+  for (int d = 0; d <= max_degree; d++)
+    bucket[d + 1] += bucket[d];
+  for (int u = 0; u < n; u++)
+  {
+    int d = snapshot_degree(s, u);
+    by_degree[bucket[falling ? max_degree - d : d]++] = u;
+  }
+  free(bucket);
+  return 0;
+}
+
+/**
+ * Fills seq with the dense ids in breadth-first order, one component at a
+ * time, starting each from its highest-degree user (or lowest-degree for
+ * Cuthill-McKee, which also visits friends by rising degree). Returns -1 if
+ * out of memory.
+ **/
+int breadth_first_order(GraphSnapshot *s, int *seq, bool cuthill_mckee)
+{
+  int n = s->num_users;
+  int *starts = malloc((n + 1) * sizeof(int));
+  bool *seen = calloc(n + 1, sizeof(bool));
+  long long *keys = NULL;
+  int key_cap = 0;
+  if (starts == NULL || seen == NULL || sort_by_degree(s, starts, !cuthill_mckee) != 0)
+  {
+    free(starts);
+    free(seen);
+    return -1;
+  }
+  int head = 0, tail = 0;
+  for (int i = 0; i < n; i++)
+  {
+    if (seen[starts[i]])
+      continue;
+    seen[starts[i]] = true;
+    seq[tail++] = starts[i];
+    while (head < tail)
+    {
+      int u = seq[head++];
+      int first = tail;
+      for (int k = s->friend_offsets[u]; k < s->friend_offsets[u + 1]; k++)
+      {
+        int v = s->friend_ids[k];
+        if (!seen[v])
+        {
+          seen[v] = true;
+          seq[tail++] = v;
+        }
+      }
+      if (!cuthill_mckee || tail - first < 2)
+        continue;
+      // Order this level's new users by degree, packed as degree << 32 | id
+      if (tail - first > key_cap)
+      {
+        key_cap = tail - first;
+        free(keys);
+        keys = malloc(key_cap * sizeof(long long));
+        if (keys == NULL)
+        {
+          free(starts);
+          free(seen);
+          return -1;
+        }
+      }
+      for (int k = first; k < tail; k++)
+        keys[k - first] = (long long)snapshot_degree(s, seq[k]) << 32 | seq[k];
+      qsort(keys, tail - first, sizeof(long long), compare_longs);
+      for (int k = first; k < tail; k++)
+        seq[k] = (int)(keys[k - first] & 0xffffffff);
+    }
+  }
+  if (cuthill_mckee)
+  {
+    for (int i = 0, j = n - 1; i < j; i++, j--)
+    {
+      int t = seq[i];
+      seq[i] = seq[j];
+      seq[j] = t;
+    }
+  }
+  free(keys);
+  free(starts);
+  free(seen);
+  return 0;
+}
+
+/**
+ * Renumbers a snapshot (before its hubs are built) so that
+ * seq[i] becomes dense id i. Friendships are symmetric, so friend lists are
+ * rebuilt by taking users in their new order and appending each to its
+ * friends' lists, which leaves every list sorted without sorting it.
+ * Returns -1 if out of memory.
+ **/
+int relabel_snapshot(GraphSnapshot *s, const int *seq)
+{
+  int n = s->num_users;
+  int *new_id = malloc((n + 1) * sizeof(int));
+  char **names = malloc((n + 1) * sizeof(char *));
+  int *user_ids = malloc((n + 1) * sizeof(int));
+  int *friend_offsets = calloc(n + 1, sizeof(int));
+  int *friend_ids = malloc((s->friend_offsets[n] + 1) * sizeof(int));
+  int *brand_offsets = malloc((n + 1) * sizeof(int));
+  int *brand_ids = malloc((s->brand_offsets[n] + 1) * sizeof(int));
+  if (new_id == NULL || names == NULL || user_ids == NULL || friend_offsets == NULL || friend_ids == NULL ||
+      brand_offsets == NULL || brand_ids == NULL)
+  {
+    free(new_id);
+    free(names);
+    free(user_ids);
+    free(friend_offsets);
+    free(friend_ids);
+    free(brand_offsets);
+    free(brand_ids);
+    return -1;
+  }
+  for (int i = 0; i < n; i++)
+    new_id[seq[i]] = i;
+  brand_offsets[0] = 0;
+  for (int i = 0; i < n; i++)
+  {
+    int u = seq[i];
+    names[i] = s->names[u];
+    user_ids[i] = s->user_ids[u];
+    s->dense_id[user_ids[i]] = i;
+    int len = s->brand_offsets[u + 1] - s->brand_offsets[u];
+    memcpy(brand_ids + brand_offsets[i], s->brand_ids + s->brand_offsets[u], len * sizeof(int));
+    brand_offsets[i + 1] = brand_offsets[i] + len;
+  }
+  // Count each user's appearances in friend lists, then fill in new order
+  for (int k = 0; k < s->friend_offsets[n]; k++)
+    friend_offsets[new_id[s->friend_ids[k]] + 1]++;
+  for (int i = 0; i < n; i++)
+    friend_offsets[i + 1] += friend_offsets[i];
+  for (int k = 0; k < s->friend_offsets[n]; k++)
+    s->friend_ids[k] = new_id[s->friend_ids[k]];
+  int *fill = new_id; // Reused, as new_id isn't needed once friend ids are mapped
+  for (int i = 0; i < n; i++)
+    fill[i] = friend_offsets[i];
+  for (int i = 0; i < n; i++)
+  {
+    int u = seq[i];
+    for (int k = s->friend_offsets[u]; k < s->friend_offsets[u + 1]; k++)
+      friend_ids[fill[s->friend_ids[k]]++] = i;
+  }
+  free(new_id);
+  free(s->names);
+  free(s->user_ids);
+  free(s->friend_offsets);
+  free(s->friend_ids);
+  free(s->brand_offsets);
+  free(s->brand_ids);
+  s->names = names;
+  s->user_ids = user_ids;
+  s->friend_offsets = friend_offsets;
+  s->friend_ids = friend_ids;
+  s->brand_offsets = brand_offsets;
+  s->brand_ids = brand_ids;
+  return 0;
+}
+
+/**
+ * Indexes the listed users of a snapshot by name, so readers can find them
+ * without a User. Returns -1 if out of memory.
+ **/
+int build_snapshot_names(GraphSnapshot *s)
+{
+  int cap = 16;
+  while (cap < 2 * s->num_listed)
+    cap *= 2;
+  s->name_slots = malloc(cap * sizeof(int));
+  if (s->name_slots == NULL)
+    return -1;
+  s->name_slot_mask = cap - 1;
+  for (int i = 0; i < cap; i++)
+    s->name_slots[i] = -1;
+  for (int u = 0; u < s->num_listed; u++)
+  {
+    int i = hash_string(s->names[u]) & s->name_slot_mask;
+    while (s->name_slots[i] >= 0)
+      i = (i + 1) & s->name_slot_mask;
+    s->name_slots[i] = u;
+  }
+  return 0;
+}
+
+/**
+ * Renumbers a snapshot into the given SNAPSHOT_ORDER_*.
+ * Returns -1 if out of memory.
+ **/
+int reorder_snapshot(GraphSnapshot *s, int order)
+{
+  int n = s->num_users;
+  if (order == SNAPSHOT_ORDER_NAME || n == 0)
+    return 0;
+  int *seq = malloc((n + 1) * sizeof(int));
+  int *listed_first = malloc((n + 1) * sizeof(int));
+  int result = -1;
+  if (seq != NULL && listed_first != NULL &&
+      (order == SNAPSHOT_ORDER_DEGREE ? sort_by_degree(s, seq, true) : breadth_first_order(s, seq, order == SNAPSHOT_ORDER_RCM)) == 0)
+  {
+    int i = 0;
+    for (int k = 0; k < n; k++)
+    {
+      if (seq[k] < s->num_listed)
+        listed_first[i++] = seq[k];
+    }
+    for (int k = 0; k < n; k++)
+    {
+      if (seq[k] >= s->num_listed)
+        listed_first[i++] = seq[k];
+    }
+    result = relabel_snapshot(s, listed_first);
+  }
+  free(seq);
+  free(listed_first);
+  return result;
+}
+
+/**
+ * Freezes the current friend graph and brand follows into a GraphSnapshot
+ * with dense ids in the given SNAPSHOT_ORDER_*. Returns NULL if memory runs
+ * out.
+ **/
+GraphSnapshot *freeze_graph_ordered_unlocked(int order)
+{
+  GraphSnapshot *s = calloc(1, sizeof(GraphSnapshot));
+  if (s == NULL)
+    return NULL;
+  s->version = graph_version;
+  s->dense_id_cap = user_table_size;
+  s->dense_id = malloc((user_table_size + 1) * sizeof(int));
+  s->names = malloc((user_table_size + 1) * sizeof(char *));
+  s->user_ids = malloc((user_table_size + 1) * sizeof(int));
+  if (s->dense_id == NULL || s->names == NULL || s->user_ids == NULL)
+  {
+    free_graph_snapshot(s);
+    return NULL;
+  }
+  for (int i = 0; i < user_table_size; i++)
+    s->dense_id[i] = -1;
+
+  // Number users in name order, then any left out of allUsers
+  int n = 0;
+  for (FriendNode *cur = allUsers; cur != NULL; cur = cur->next)
+  {
+    s->dense_id[cur->user->id] = n;
+    s->names[n] = cur->user->name;
+    s->user_ids[n++] = cur->user->id;
+  }
+  s->num_listed = n;
+  for (int i = 0; i < user_table_size; i++)
+  {
+    if (user_table[i] != NULL && s->dense_id[i] < 0)
+    {
+      s->dense_id[i] = n;
+      s->names[n] = user_table[i]->name;
+      s->user_ids[n++] = i;
+    }
+  }
+  s->num_users = n;
+
+  // Count, then fill, both adjacency arrays
+  s->friend_offsets = malloc((n + 1) * sizeof(int));
+  s->brand_offsets = malloc((n + 1) * sizeof(int));
+  if (s->friend_offsets == NULL || s->brand_offsets == NULL)
+  {
+    free_graph_snapshot(s);
+    return NULL;
+  }
+  s->friend_offsets[0] = 0;
+  s->brand_offsets[0] = 0;
+  for (int u = 0; u < n; u++)
+  {
+    int friends = 0, brands = 0;
+    User *user = user_table[s->user_ids[u]]; // Live while the graph is locked
+    for (FriendNode *f = user->friends; f != NULL; f = f->next)
+      friends++;
+    for (BrandNode *b = user->brands; b != NULL; b = b->next)
+      brands++;
+    s->friend_offsets[u + 1] = s->friend_offsets[u] + friends;
+    s->brand_offsets[u + 1] = s->brand_offsets[u] + brands;
+  }
+  s->friend_ids = malloc((s->friend_offsets[n] + 1) * sizeof(int));
+  s->brand_ids = malloc((s->brand_offsets[n] + 1) * sizeof(int));
+  if (s->friend_ids == NULL || s->brand_ids == NULL)
+  {
+    free_graph_snapshot(s);
+    return NULL;
+  }
+  for (int u = 0; u < n; u++)
+  {
+    User *user = user_table[s->user_ids[u]];
+    int *out = s->friend_ids + s->friend_offsets[u];
+    int len = 0;
+    bool sorted = true;
+    for (FriendNode *f = user->friends; f != NULL; f = f->next, len++)
+    {
+      out[len] = s->dense_id[f->user->id];
+      sorted = sorted && (len == 0 || out[len - 1] < out[len]);
+    }
+    if (!sorted)
+      qsort(out, len, sizeof(int), compare_ints);
+
+    int *brands = s->brand_ids + s->brand_offsets[u];
+    len = 0;
+    for (BrandNode *b = user->brands; b != NULL; b = b->next)
+    {
+      if (b->idx >= 0)
+        brands[len++] = b->idx;
+    }
+    qsort(brands, len, sizeof(int), compare_ints);
+    // Brands that no longer exist leave unused slots at the end of the run
+    for (int k = len; k < s->brand_offsets[u + 1] - s->brand_offsets[u]; k++)
+      brands[k] = -1;
+  }
+  int kept = 0;
+  for (int u = 0; u < n; u++)
+  {
+    int start = s->brand_offsets[u];
+    s->brand_offsets[u] = kept;
+    for (int k = start; k < s->brand_offsets[u + 1] && s->brand_ids[k] >= 0; k++)
+      s->brand_ids[kept++] = s->brand_ids[k];
+  }
+  s->brand_offsets[n] = kept;
+  s->order = order;
+  if (reorder_snapshot(s, order) != 0 || build_snapshot_names(s) != 0 || build_snapshot_hubs(s) != 0)
+  {
+    free_graph_snapshot(s);
+    return NULL;
+  }
+  return s;
+}
+
+/**
+ * Freezes the current friend graph and brand follows into a GraphSnapshot,
+ * in snapshot_order. Returns NULL if memory runs out.
+ **/
+GraphSnapshot *freeze_graph_unlocked()
+{
+  return freeze_graph_ordered_unlocked(snapshot_order);
+}
+
+GraphSnapshot *freeze_graph()
+{
+  graph_read_lock();
+  GraphSnapshot *result = freeze_graph_unlocked();
+  graph_unlock();
+  return result;
+}
+
+// RCU-style publication for read-mostly workloads: a writer (or a
+// background thread) periodically freezes the graph and publishes the
+// snapshot; readers acquire whatever is published and query it without
+// touching graph_lock. A replaced snapshot is freed when its last reader
+// releases it. Users can be deleted under a reader at any time, so readers
+// name users through snapshot_find_user() and the dense-id queries, never
+// through a User *.
+GraphSnapshot *published_snapshot;
+pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Returns the published snapshot with a reference taken, or NULL if none
+ * has been published. Pair with release_graph_snapshot().
+ **/
+GraphSnapshot *acquire_graph_snapshot()
+{
+  pthread_mutex_lock(&publish_lock);
+  GraphSnapshot *s = published_snapshot;
+  if (s != NULL)
+    s->refs++;
+  pthread_mutex_unlock(&publish_lock);
+  return s;
+}
+
+void release_graph_snapshot(GraphSnapshot *s)
+{
+  if (s == NULL)
+    return;
+  pthread_mutex_lock(&publish_lock);
+  bool last = --s->refs == 0;
+  pthread_mutex_unlock(&publish_lock);
+  if (last)
+    free_graph_snapshot(s);
+}
+
+/**
+ * Freezes the current graph and makes it the published snapshot, unless
+ * the published one is still current. Returns -1 if memory runs out.
+ **/
+int publish_graph_snapshot()
+{
+  GraphSnapshot *old = acquire_graph_snapshot();
+  graph_read_lock();
+  bool current = old != NULL && old->version == graph_version;
+  GraphSnapshot *s = current ? NULL : freeze_graph_unlocked();
+  graph_unlock();
+  release_graph_snapshot(old);
+  if (current)
+    return 0;
+  if (s == NULL)
+    return -1;
+  s->refs = 1; // The publication's own reference
+  pthread_mutex_lock(&publish_lock);
+  old = published_snapshot;
+  published_snapshot = s;
+  pthread_mutex_unlock(&publish_lock);
+  release_graph_snapshot(old);
+  return 0;
+}
+
+/**
+ * Frees the calling thread's traversal state and retires its stats.
+ * Threads that ran queries call this before exiting.
+ **/
+void free_query_context()
+{
+  retire_thread_stats();
+  free(bfs_engine.ring);
+  free(bfs_engine.ring_back);
+  free(bfs_engine.stamp);
+  free(bfs_engine.dist);
+  memset(&bfs_engine, 0, sizeof(bfs_engine));
+  free(suggest_counter.stamp);
+  free(suggest_counter.count);
+  free(suggest_counter.touched);
+  memset(&suggest_counter, 0, sizeof(suggest_counter));
+  free(csr_search.ring[0]);
+  free(csr_search.ring[1]);
+  free(csr_search.stamp);
+  free(csr_search.dist);
+  memset(&csr_search, 0, sizeof(csr_search));
+  free(ms_bfs.seen);
+  free(ms_bfs.visit);
+  free(ms_bfs.visit_next);
+  free(ms_bfs.mark);
+  free(ms_bfs.slot);
+  free(ms_bfs.frontier);
+  free(ms_bfs.next_frontier);
+  free(ms_bfs.touched);
+  memset(&ms_bfs, 0, sizeof(ms_bfs));
+}
+
+/**
+ * Returns the dense id of a user in the snapshot, or -1 if the user wasn't
+ * part of the graph when it was frozen. The User is dereferenced, so the
+ * caller keeps it alive; lock-free readers use snapshot_find_user().
+ **/
+int snapshot_user_index(GraphSnapshot *s, User *user)
+{
+  if (s == NULL || user == NULL || user->id >= s->dense_id_cap)
+    return -1;
+  int d = s->dense_id[user->id];
+  if (d < 0 || s->names[d] != user->name) // Names are interned, so this spots a reused id
+    return -1;
+  return d;
+}
+
+/**
+ * Returns the dense id of the listed user with this name in the snapshot,
+ * or -1 if there was none when it was frozen. Needs no lock.
+ **/
+int snapshot_find_user(GraphSnapshot *s, const char *name)
+{
+  if (s == NULL || name == NULL)
+    return -1;
+  for (int i = hash_string(name) & s->name_slot_mask; s->name_slots[i] >= 0; i = (i + 1) & s->name_slot_mask)
+  {
+    if (strcmp(s->names[s->name_slots[i]], name) == 0)
+      return s->name_slots[i];
+  }
+  return -1;
+}
+
+/**
+ * Counts the values common to two sorted int arrays by merging them.
+ * O(len_a + len_b).
+ **/
+int intersect_sorted(const int *a, int len_a, const int *b, int len_b)
+{
+  int count = 0;
+  int i = 0, j = 0;
+  while (i < len_a && j < len_b)
+  {
+    if (a[i] < b[j])
+      i++;
+    else if (a[i] > b[j])
+      j++;
+    else
+    {
+      count++;
+      i++;
+      j++;
+    }
+  }
+  return count;
+}
+
+/**
+ * Counts the values common to a short sorted array and a much longer one by
+ * galloping: each value of small is located in large with an exponential
+ * then binary search starting where the previous value was found.
+ * O(len_small * log(len_large / len_small)).
+ **/
+int intersect_galloping(const int *small, int len_small, const int *large, int len_large)
+{
+  int count = 0;
+  int lo = 0;
+  for (int i = 0; i < len_small && lo < len_large; i++)
+  {
+    int x = small[i];
+    // Find a window (lo, hi] with large[hi] >= x
+    int step = 1;
+    int hi = lo;
+    while (hi < len_large && large[hi] < x)
+    {
+      lo = hi + 1;
+      hi += step;
+      step *= 2;
+    }
+    if (hi >= len_large)
+      hi = len_large - 1;
+    // First index in [lo, hi] with large[idx] >= x
+    while (lo < hi)
+    {
+      int mid = lo + (hi - lo) / 2;
+      if (large[mid] < x)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo < len_large && large[lo] == x)
+    {
+      count++;
+      lo++;
+    }
+  }
+  return count;
+}
+
+/**
+ * Counts the values common to two sorted int arrays, galloping through the
+ * longer one when their sizes are skewed by more than GALLOP_RATIO.
+ **/
+#define GALLOP_RATIO 32
+
+int intersect_count(const int *a, int len_a, const int *b, int len_b)
+{
+  if (len_a > len_b)
+  {
+    const int *t = a;
+    a = b;
+    b = t;
+    int tl = len_a;
+    len_a = len_b;
+    len_b = tl;
+  }
+  if (len_a == 0)
+    return 0;
+  if ((long)len_a * GALLOP_RATIO < len_b)
+    return intersect_galloping(a, len_a, b, len_b);
+  return intersect_sorted(a, len_a, b, len_b);
+}
+
+/**
+ * Counts the values of a sorted array whose bit is set in the bitset.
+ **/
+int intersect_bitset(const int *a, int len_a, const uint64_t *bits)
+{
+  int count = 0;
+  for (int i = 0; i < len_a; i++)
+  {
+    count += (bits[a[i] >> 6] >> (a[i] & 63)) & 1;
+  }
+  return count;
+}
+
+/**
+ * Number of friends dense users u and v have in common. Two hubs are
+ * intersected with AND + popcount over their neighbour bitsets, a hub and
+ * a non-hub by probing the hub's bitset, and anyone else with
+ * intersect_count().
+ **/
+int snapshot_intersect(GraphSnapshot *s, int u, int v)
+{
+  const int *nu = s->friend_ids + s->friend_offsets[u];
+  const int *nv = s->friend_ids + s->friend_offsets[v];
+  int du = snapshot_degree(s, u);
+  int dv = snapshot_degree(s, v);
+  int hu = s->hub_row != NULL ? s->hub_row[u] : -1;
+  int hv = s->hub_row != NULL ? s->hub_row[v] : -1;
+  if (hu >= 0 && hv >= 0)
+    return bitset_and_popcount(snapshot_hub_bits(s, hu), snapshot_hub_bits(s, hv), s->hub_words);
+  if (hu >= 0)
+    return intersect_bitset(nv, dv, snapshot_hub_bits(s, hu));
+  if (hv >= 0)
+    return intersect_bitset(nu, du, snapshot_hub_bits(s, hv));
+  return intersect_count(nu, du, nv, dv);
+}
+
+/**
+ * Prepares the thread's search scratch space for the snapshot and reserves `epochs` fresh
+ * stamp values, the last of which is csr_search.epoch.
+ **/
+int csr_search_begin(GraphSnapshot *s, unsigned int epochs)
+{
+  CsrSearch *c = &csr_search;
+  if (c->cap < s->num_users)
+  {
+    int cap = c->cap == 0 ? 64 : c->cap;
+    while (cap < s->num_users)
+      cap *= 2;
+    unsigned int *stamp = realloc(c->stamp, cap * sizeof(unsigned int));
+    if (stamp != NULL)
+      c->stamp = stamp;
+    int *dist = realloc(c->dist, cap * sizeof(int));
+    if (dist != NULL)
+      c->dist = dist;
+    int *ring0 = realloc(c->ring[0], cap * sizeof(int));
+    if (ring0 != NULL)
+      c->ring[0] = ring0;
+    int *ring1 = realloc(c->ring[1], cap * sizeof(int));
+    if (ring1 != NULL)
+      c->ring[1] = ring1;
+    if (stamp == NULL || dist == NULL || ring0 == NULL || ring1 == NULL)
+      return -1;
+    memset(c->stamp + c->cap, 0, (cap - c->cap) * sizeof(unsigned int));
+    c->cap = cap;
+  }
+  if (c->epoch > UINT32_MAX - epochs)
+  {
+    memset(c->stamp, 0, c->cap * sizeof(unsigned int));
+    c->epoch = 0;
+  }
+  c->epoch += epochs;
+  c->explored = 0;
+  return 0;
+}
+
+/**
+ * Bidirectional BFS between dense ids a and b over the CSR arrays. Same
+ * algorithm as bfs_distance_bidirectional(); each user enters one of the
+ * two queues at most once, so plain arrays are enough for the frontiers.
+ **/
+int csr_distance(GraphSnapshot *s, int a, int b)
+{
+  if (csr_search_begin(s, 2) != 0)
+    return -1;
+  if (a == b)
+    return 0;
+  CsrSearch *c = &csr_search;
+  unsigned int mark[2] = {c->epoch - 1, c->epoch};
+  int head[2] = {0, 0};
+  int tail[2] = {0, 0};
+  int depth[2] = {0, 0};
+  int ends[2] = {a, b};
+  for (int side = 0; side < 2; side++)
+  {
+    c->stamp[ends[side]] = mark[side];
+    c->dist[ends[side]] = 0;
+    c->ring[side][tail[side]++] = ends[side];
+  }
+
+  while (head[0] != tail[0] && head[1] != tail[1])
+  {
+    int side = tail[0] - head[0] <= tail[1] - head[1] ? 0 : 1;
+    int best = -1;
+    for (int level_end = tail[side]; head[side] != level_end; head[side]++)
+    {
+      int u = c->ring[side][head[side]];
+      c->explored++;
+      for (int k = s->friend_offsets[u]; k < s->friend_offsets[u + 1]; k++)
+      {
+        int v = s->friend_ids[k];
+        if (c->stamp[v] == mark[1 - side])
+        {
+          int total = depth[side] + 1 + c->dist[v];
+          if (best < 0 || total < best)
+            best = total;
+        }
+        else if (c->stamp[v] != mark[side])
+        {
+          c->stamp[v] = mark[side];
+          c->dist[v] = depth[side] + 1;
+          c->ring[side][tail[side]++] = v;
+        }
+      }
+    }
+    if (best >= 0)
+      return best;
+    depth[side]++;
+  }
+  return -1;
+}
+
+/**
+ * get_degrees_of_connection() answered from a snapshot for dense ids da
+ * and db (-1 for a user not in it). Needs no lock.
+ **/
+int snapshot_degrees_between(GraphSnapshot *s, int da, int db)
+{
+  if (da < 0 || db < 0 || snapshot_degree(s, da) == 0 || snapshot_degree(s, db) == 0)
+    return -1;
+  if (da == db || s->names[da] == s->names[db])
+    return 0;
+  return csr_distance(s, da, db);
+}
+
+/**
+ * get_degrees_of_connection() answered from a snapshot. The caller keeps
+ * a and b alive (holds graph_lock); lock-free readers use
+ * snapshot_degrees_between().
+ **/
+int snapshot_degrees_of_connection(GraphSnapshot *s, User *a, User *b)
+{
+  return snapshot_degrees_between(s, snapshot_user_index(s, a), snapshot_user_index(s, b));
+}
+
+/**
+ * get_mutual_friends() answered from a snapshot for dense ids da and db
+ * (-1 for a user not in it). Needs no lock.
+ **/
+int snapshot_mutual_between(GraphSnapshot *s, int da, int db)
+{
+  if (da < 0 || db < 0)
+    return 0;
+  return snapshot_intersect(s, da, db);
+}
+
+/**
+ * get_mutual_friends() answered from a snapshot. The caller keeps a and b
+ * alive (holds graph_lock); lock-free readers use snapshot_mutual_between().
+ **/
+int snapshot_mutual_friends(GraphSnapshot *s, User *a, User *b)
+{
+  return snapshot_mutual_between(s, snapshot_user_index(s, a), snapshot_user_index(s, b));
+}
+
+/**
+ * Mutual friend counts for n pairs (as[i], bs[i]) at once, written to
+ * out[i]. Pairs are grouped by their first user; within a group that
+ * user's friends are stamped once (or its hub bitset is used) and each
+ * partner's friend list is checked against the marks, so a group of k
+ * pairs costs O(d_a + sum of d_b) instead of k merges. The caller keeps
+ * the users alive (holds graph_lock).
+ **/
+void snapshot_mutual_friends_batch(GraphSnapshot *s, User **as, User **bs, int n, int *out)
+{
+  int *src = malloc((n + 1) * sizeof(int));
+  int *order = malloc((n + 1) * sizeof(int));
+  long long *keys = malloc((n + 1) * sizeof(long long));
+  if (src == NULL || order == NULL || keys == NULL || csr_search_begin(s, 0) != 0)
+  {
+    // Fall back to answering the pairs one at a time
+    for (int i = 0; i < n; i++)
+      out[i] = snapshot_mutual_friends(s, as[i], bs[i]);
+    free(src);
+    free(order);
+    free(keys);
+    return;
+  }
+  // Sort pair indices by source, packed as (source + 1) << 32 | index
+  for (int i = 0; i < n; i++)
+  {
+    src[i] = snapshot_user_index(s, as[i]);
+    keys[i] = ((long long)(src[i] + 1) << 32) | i;
+  }
+  qsort(keys, n, sizeof(long long), compare_longs);
+  for (int i = 0; i < n; i++)
+    order[i] = (int)(keys[i] & 0xffffffff);
+  free(keys);
+
+  CsrSearch *c = &csr_search;
+  for (int g = 0; g < n;)
+  {
+    int a = src[order[g]];
+    int end = g;
+    while (end < n && src[order[end]] == a)
+      end++;
+    if (a < 0)
+    {
+      for (; g < end; g++)
+        out[order[g]] = 0;
+      continue;
+    }
+    bool use_hub = s->hub_row != NULL && s->hub_row[a] >= 0;
+    if (!use_hub)
+    {
+      csr_search_begin(s, 1);
+      for (int k = s->friend_offsets[a]; k < s->friend_offsets[a + 1]; k++)
+        c->stamp[s->friend_ids[k]] = c->epoch;
+    }
+    for (; g < end; g++)
+    {
+      int b = snapshot_user_index(s, bs[order[g]]);
+      if (b < 0)
+      {
+        out[order[g]] = 0;
+        continue;
+      }
+      const int *nb = s->friend_ids + s->friend_offsets[b];
+      int db = snapshot_degree(s, b);
+      if (use_hub)
+      {
+        out[order[g]] = snapshot_intersect(s, a, b);
+        continue;
+      }
+      int count = 0;
+      for (int k = 0; k < db; k++)
+        count += c->stamp[nb[k]] == c->epoch;
+      out[order[g]] = count;
+    }
+  }
+  free(src);
+  free(order);
+}
+
+/**
+ * get_suggested_friend() answered from a snapshot for dense id du: the
+ * dense id of the non-friend sharing the most brands with them, ties going
+ * to the name that sorts last, or -1 if there is none.
+ **/
+int snapshot_suggested_index(GraphSnapshot *s, int du)
+{
+  if (du < 0 || du >= s->num_users || csr_search_begin(s, 1) != 0)
+    return -1;
+  CsrSearch *c = &csr_search;
+  for (int k = s->friend_offsets[du]; k < s->friend_offsets[du + 1]; k++)
+    c->stamp[s->friend_ids[k]] = c->epoch;
+
+  const int *mine = s->brand_ids + s->brand_offsets[du];
+  int my_len = s->brand_offsets[du + 1] - s->brand_offsets[du];
+  int best = -1, best_shared = 0;
+  for (int v = 0; v < s->num_listed; v++)
+  {
+    if (v == du || c->stamp[v] == c->epoch || s->names[v] == s->names[du])
+      continue;
+    int shared = intersect_sorted(mine, my_len, s->brand_ids + s->brand_offsets[v],
+                                  s->brand_offsets[v + 1] - s->brand_offsets[v]);
+    // In name order >= alone hands ties to the later name
+    if (shared > best_shared || (shared == best_shared && (best < 0 || s->order == SNAPSHOT_ORDER_NAME ||
+                                                           strcmp(s->names[v], s->names[best]) > 0)))
+    {
+      best = v;
+      best_shared = shared;
+    }
+  }
+  return best;
+}
+
+/**
+ * get_suggested_friend() answered from a snapshot. The answer is a live
+ * User, or NULL if they have been deleted since the freeze, so the caller
+ * must hold graph_lock (snapshot_suggested_index() needs no lock).
+ **/
+User *snapshot_suggested_friend(GraphSnapshot *s, User *user)
+{
+  int best = snapshot_suggested_index(s, snapshot_user_index(s, user));
+  if (best < 0 || s->user_ids[best] >= user_table_size)
+    return NULL;
+  User *found = user_table[s->user_ids[best]];
+  return found != NULL && found->name == s->names[best] ? found : NULL;
+}
+
+
+// Triangle counting on a snapshot. Users are ranked by (degree, dense id)
+// and every friendship is kept only in the forward list of its lower-ranked
+// end, so each triangle r < v < w is found exactly once, as w in both
+// forward(r) and forward(v). Forward lists hold ranks, ascending, and
+// degree ordering keeps them short even around hubs (O(sqrt(E)) each).
+typedef struct triangle_work_struct
+{
+  const int *offsets; // Forward adjacency by rank
+  const int *ids;
+  int n;
+  int next_chunk;      // Next TRIANGLE_CHUNK of ranks to claim, taken atomically
+  long long *per_rank; // Triangles through each rank, NULL if not wanted
+} TriangleWork;
+
+typedef struct triangle_job_struct
+{
+  TriangleWork *work;
+  long long total;
+  pthread_t thread;
+} TriangleJob;
+
+#define TRIANGLE_CHUNK 256
+
+void *count_triangles_worker(void *arg)
+{
+  TriangleJob *job = arg;
+  TriangleWork *w = job->work;
+  // mark[x] == r + 1 iff x is in forward(r), for the r being processed
+  int *mark = calloc(w->n + 1, sizeof(int));
+  if (mark == NULL)
+  {
+    job->total = -1;
+    return NULL;
+  }
+  long long total = 0;
+  for (;;)
+  {
+    int start = __atomic_fetch_add(&w->next_chunk, TRIANGLE_CHUNK, __ATOMIC_RELAXED);
+    if (start >= w->n)
+      break;
+    int end = start + TRIANGLE_CHUNK < w->n ? start + TRIANGLE_CHUNK : w->n;
+    for (int r = start; r < end; r++)
+    {
+      const int *nr = w->ids + w->offsets[r];
+      int len_r = w->offsets[r + 1] - w->offsets[r];
+      if (len_r < 2)
+        continue;
+      for (int k = 0; k < len_r; k++)
+        mark[nr[k]] = r + 1;
+      long long through_r = 0;
+      for (int k = 0; k < len_r; k++)
+      {
+        // Third corners are in forward(v), so they already rank above v
+        int v = nr[k];
+        long long found = 0;
+        for (int j = w->offsets[v]; j < w->offsets[v + 1]; j++)
+        {
+          if (mark[w->ids[j]] != r + 1)
+            continue;
+          found++;
+          if (w->per_rank != NULL)
+            __atomic_fetch_add(&w->per_rank[w->ids[j]], 1, __ATOMIC_RELAXED);
+        }
+        if (found > 0 && w->per_rank != NULL)
+          __atomic_fetch_add(&w->per_rank[v], found, __ATOMIC_RELAXED);
+        through_r += found;
+      }
+      if (through_r > 0 && w->per_rank != NULL)
+        __atomic_fetch_add(&w->per_rank[r], through_r, __ATOMIC_RELAXED);
+      total += through_r;
+    }
+  }
+  free(mark);
+  job->total = total;
+  return NULL;
+}
+
+/**
+ * Counts the triangles in the snapshot's friend graph with num_threads
+ * threads (one per online CPU if num_threads <= 0). If per_user isn't NULL
+ * it receives, by dense id, the number of triangles each user is part of.
+ * Returns the number of triangles, or -1 if memory runs out.
+ **/
+long long snapshot_count_triangles(GraphSnapshot *s, long long *per_user, int num_threads)
+{
+  int n = s->num_users;
+  int max_degree = 0;
+  for (int u = 0; u < n; u++)
+  {
+    if (snapshot_degree(s, u) > max_degree)
+      max_degree = snapshot_degree(s, u);
+  }
+  int *rank = malloc((n + 1) * sizeof(int));
+  int *by_rank = malloc((n + 1) * sizeof(int));
+  int *offsets = calloc(n + 2 + max_degree, sizeof(int));
+  long long *per_rank = per_user != NULL ? calloc(n + 1, sizeof(long long)) : NULL;
+  if (rank == NULL || by_rank == NULL || offsets == NULL || (per_user != NULL && per_rank == NULL))
+  {
+    free(rank);
+    free(by_rank);
+    free(offsets);
+    free(per_rank);
+    return -1;
+  }
+
+  // Rank by degree with a counting sort (stable, so ties go by dense id)
+  int *bucket = offsets;
+  for (int u = 0; u < n; u++)
+    bucket[snapshot_degree(s, u) + 1]++;
+  for (int d = 0; d < max_degree; d++)
+    bucket[d + 1] += bucket[d];
+  for (int u = 0; u < n; u++)
+  {
+    rank[u] = bucket[snapshot_degree(s, u)]++;
+    by_rank[rank[u]] = u;
+  }
+  memset(offsets, 0, (n + 2) * sizeof(int));
+
+  // Forward lists, filled in increasing order of their entries so each
+  // comes out sorted without a sort
+  for (int u = 0; u < n; u++)
+  {
+    for (int k = s->friend_offsets[u]; k < s->friend_offsets[u + 1]; k++)
+    {
+      if (rank[s->friend_ids[k]] > rank[u])
+        offsets[rank[u] + 1]++;
+    }
+  }
+  for (int r = 0; r < n; r++)
+    offsets[r + 1] += offsets[r];
+  int *ids = malloc((offsets[n] + 1) * sizeof(int));
+  int *fill = malloc((n + 1) * sizeof(int));
+  if (ids == NULL || fill == NULL)
+  {
+    free(rank);
+    free(by_rank);
+    free(offsets);
+    free(per_rank);
+    free(ids);
+    free(fill);
+    return -1;
+  }
+  memcpy(fill, offsets, n * sizeof(int));
+  for (int r = 0; r < n; r++)
+  {
+    int u = by_rank[r];
+    for (int k = s->friend_offsets[u]; k < s->friend_offsets[u + 1]; k++)
+    {
+      int lower = rank[s->friend_ids[k]];
+      if (lower < r)
+        ids[fill[lower]++] = r;
+    }
+  }
+  free(fill);
+
+  if (num_threads <= 0)
+    num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads <= 0)
+    num_threads = 1;
+  TriangleWork work = {.offsets = offsets, .ids = ids, .n = n, .per_rank = per_rank};
+  TriangleJob *jobs = calloc(num_threads, sizeof(TriangleJob));
+  long long total = 0;
+  if (jobs == NULL)
+  {
+    TriangleJob job = {.work = &work};
+    count_triangles_worker(&job);
+    total = job.total;
+  }
+  else
+  {
+    // Thread 0 is this one; any thread that can't be started is skipped
+    int started = 1;
+    for (int t = 1; t < num_threads; t++)
+    {
+      jobs[started].work = &work;
+      if (pthread_create(&jobs[started].thread, NULL, count_triangles_worker, &jobs[started]) == 0)
+        started++;
+    }
+    jobs[0].work = &work;
+    count_triangles_worker(&jobs[0]);
+    for (int t = 1; t < started; t++)
+      pthread_join(jobs[t].thread, NULL);
+    for (int t = 0; t < started && total >= 0; t++)
+      total = jobs[t].total < 0 ? -1 : total + jobs[t].total;
+    free(jobs);
+  }
+
+  if (per_user != NULL && total >= 0)
+  {
+    for (int u = 0; u < n; u++)
+      per_user[u] = per_rank[rank[u]];
+  }
+  free(rank);
+  free(by_rank);
+  free(offsets);
+  free(ids);
+  free(per_rank);
+  return total;
+}
+
+/**
+ * Local clustering coefficient of dense user u: the fraction of pairs of
+ * their friends who are friends themselves, from the per-user triangle
+ * counts of snapshot_count_triangles(). 0 for users with under 2 friends.
+ **/
+double snapshot_clustering_coefficient(GraphSnapshot *s, const long long *triangles, int u)
+{
+  long long d = snapshot_degree(s, u);
+  return d < 2 ? 0.0 : 2.0 * triangles[u] / (d * (d - 1));
+}
+
+/**
+ * Mean of the local clustering coefficients over all users.
+ **/
+double snapshot_average_clustering(GraphSnapshot *s, const long long *triangles)
+{
+  double sum = 0;
+  for (int u = 0; u < s->num_users; u++)
+    sum += snapshot_clustering_coefficient(s, triangles, u);
+  return s->num_users > 0 ? sum / s->num_users : 0.0;
+}
+
+/**
+ * Global clustering coefficient (transitivity): 3 * triangles over the
+ * number of pairs of friends sharing a user.
+ **/
+double snapshot_global_clustering(GraphSnapshot *s, long long triangles)
+{
+  double triples = 0;
+  for (int u = 0; u < s->num_users; u++)
+  {
+    double d = snapshot_degree(s, u);
+    triples += d * (d - 1) / 2;
+  }
+  return triples > 0 ? 3.0 * triangles / triples : 0.0;
+}
+
+/**
+ * Local clustering coefficient of one user on the live graph: their friends
+ * are marked, then each friend's list is checked against the marks, so it
+ * costs the sum of their friends' degrees.
+ **/
+double get_clustering_coefficient_unlocked(User *user)
+{
+  UserCounter *c = &suggest_counter;
+  if (user == NULL || counter_begin(c) != 0)
+    return 0.0;
+  long long d = 0;
+  for (FriendNode *f = user->friends; f != NULL; f = f->next, d++)
+    counter_add(c, f->user, 1);
+  if (d < 2)
+    return 0.0;
+  long long links = 0; // Each friendship among the friends, seen from both ends
+  for (FriendNode *f = user->friends; f != NULL; f = f->next)
+  {
+    for (FriendNode *ff = f->user->friends; ff != NULL; ff = ff->next)
+      links += counter_get(c, ff->user) > 0;
+  }
+  return (double)links / (d * (d - 1));
+}
+
+double get_clustering_coefficient(User *user)
+{
+  graph_read_lock();
+  double result = get_clustering_coefficient_unlocked(user);
+  graph_unlock();
+  return result;
+}
+
+// PageRank over a snapshot's friend graph, pull based: each iteration every
+// user publishes rank / degree, then sums what their friends published, a
+// sequential pass over the contiguous friend_ids. Threads own contiguous
+// ranges of users holding about the same number of friend entries, and meet
+// at a barrier after each half. Per-thread sums are combined in thread
+// order, so every thread sees the same totals and stops together.
+#define PAGERANK_DAMPING 0.85
+#define PAGERANK_TOLERANCE 1e-9 // Stop when the L1 change per user drops below this
+#define PAGERANK_MAX_ITERATIONS 100
+
+typedef struct pagerank_work_struct
+{
+  GraphSnapshot *s;
+  double *rank;
+  double *next;
+  double *contrib;
+  int *bounds; // Thread t owns dense users [bounds[t], bounds[t + 1])
+  int num_threads;
+  double *dangling; // Per thread: rank held by users without friends
+  double *delta;    // Per thread: L1 change of the last iteration
+  int iterations;
+  pthread_barrier_t barrier;
+  // Workers wait here until the main thread knows how many started
+  pthread_mutex_t gate_lock;
+  pthread_cond_t gate;
+  bool open;
+} PageRankWork;
+
+typedef struct pagerank_job_struct
+{
+  PageRankWork *work;
+  int index;
+  pthread_t thread;
+} PageRankJob;
+
+double sum_per_thread(const double *values, int num_threads)
+{
+  double sum = 0;
+  for (int t = 0; t < num_threads; t++)
+    sum += values[t];
+  return sum;
+}
+
+void *pagerank_worker(void *arg)
+{
+  PageRankJob *job = arg;
+  PageRankWork *w = job->work;
+  pthread_mutex_lock(&w->gate_lock);
+  while (!w->open)
+    pthread_cond_wait(&w->gate, &w->gate_lock);
+  pthread_mutex_unlock(&w->gate_lock);
+
+  GraphSnapshot *s = w->s;
+  int n = s->num_users;
+  int lo = w->bounds[job->index], hi = w->bounds[job->index + 1];
+  double *rank = w->rank, *next = w->next;
+  int iteration = 0;
+  while (iteration < PAGERANK_MAX_ITERATIONS)
+  {
+    double dangling = 0;
+    for (int u = lo; u < hi; u++)
+    {
+      int d = snapshot_degree(s, u);
+      if (d > 0)
+        w->contrib[u] = rank[u] / d;
+      else
+      {
+        w->contrib[u] = 0;
+        dangling += rank[u];
+      }
+    }
+    w->dangling[job->index] = dangling;
+    pthread_barrier_wait(&w->barrier);
+
+    // Rank held by users without friends is spread over everyone
+    double base = (1 - PAGERANK_DAMPING) / n + PAGERANK_DAMPING * sum_per_thread(w->dangling, w->num_threads) / n;
+    double delta = 0;
+    for (int u = lo; u < hi; u++)
+    {
+      double sum = 0;
+      for (int k = s->friend_offsets[u]; k < s->friend_offsets[u + 1]; k++)
+        sum += w->contrib[s->friend_ids[k]];
+      next[u] = base + PAGERANK_DAMPING * sum;
+      delta += next[u] > rank[u] ? next[u] - rank[u] : rank[u] - next[u];
+    }
+    w->delta[job->index] = delta;
+    pthread_barrier_wait(&w->barrier);
+
+    double *t = rank;
+    rank = next;
+    next = t;
+    iteration++;
+    if (sum_per_thread(w->delta, w->num_threads) < PAGERANK_TOLERANCE * n)
+      break;
+  }
+  if (job->index == 0)
+  {
+    w->rank = rank;
+    w->next = next;
+    w->iterations = iteration;
+  }
+  return NULL;
+}
+
+/**
+ * Runs PageRank on the snapshot with num_threads threads (one per online
+ * CPU if num_threads <= 0), starting from rank (by dense id, summing to 1)
+ * and leaving the result there. A start close to the answer, such as the
+ * scores from before a few edge changes, converges in a few iterations.
+ * Returns the number of iterations, or -1 if memory runs out.
+ **/
+int snapshot_pagerank(GraphSnapshot *s, double *rank, int num_threads)
+{
+  int n = s->num_users;
+  if (n == 0)
+    return 0;
+  if (num_threads <= 0)
+    num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads <= 0)
+    num_threads = 1;
+  if (num_threads > n)
+    num_threads = n;
+  PageRankWork w = {0};
+  w.s = s;
+  w.rank = rank;
+  w.next = malloc(n * sizeof(double));
+  w.contrib = malloc(n * sizeof(double));
+  w.bounds = malloc((num_threads + 1) * sizeof(int));
+  w.dangling = calloc(num_threads, sizeof(double));
+  w.delta = calloc(num_threads, sizeof(double));
+  PageRankJob *jobs = calloc(num_threads, sizeof(PageRankJob));
+  if (w.next == NULL || w.contrib == NULL || w.bounds == NULL || w.dangling == NULL || w.delta == NULL || jobs == NULL)
+  {
+    free(w.next);
+    free(w.contrib);
+    free(w.bounds);
+    free(w.dangling);
+    free(w.delta);
+    free(jobs);
+    return -1;
+  }
+  pthread_mutex_init(&w.gate_lock, NULL);
+  pthread_cond_init(&w.gate, NULL);
+
+  // Thread 0 is this one; stop at the first thread that can't be started
+  int started = 1;
+  for (; started < num_threads; started++)
+  {
+    jobs[started] = (PageRankJob){.work = &w, .index = started};
+    if (pthread_create(&jobs[started].thread, NULL, pagerank_worker, &jobs[started]) != 0)
+      break;
+  }
+  jobs[0] = (PageRankJob){.work = &w, .index = 0};
+  // Split users so each thread gets about the same users + friend entries
+  long total = (long)n + s->friend_offsets[n];
+  w.bounds[0] = 0;
+  for (int t = 1, u = 0; t <= started; t++)
+  {
+    long target = total * t / started;
+    while (u < n && (long)u + s->friend_offsets[u] < target)
+      u++;
+    w.bounds[t] = t == started ? n : u;
+  }
+  w.num_threads = started;
+  pthread_barrier_init(&w.barrier, NULL, started);
+  pthread_mutex_lock(&w.gate_lock);
+  w.open = true;
+  pthread_cond_broadcast(&w.gate);
+  pthread_mutex_unlock(&w.gate_lock);
+
+  pagerank_worker(&jobs[0]);
+  for (int t = 1; t < started; t++)
+    pthread_join(jobs[t].thread, NULL);
+  if (w.rank != rank)
+    memcpy(rank, w.rank, n * sizeof(double));
+  free(w.rank == rank ? w.next : w.rank);
+
+  pthread_barrier_destroy(&w.barrier);
+  pthread_cond_destroy(&w.gate);
+  pthread_mutex_destroy(&w.gate_lock);
+  free(w.contrib);
+  free(w.bounds);
+  free(w.dangling);
+  free(w.delta);
+  free(jobs);
+  return w.iterations;
+}
+
+/**
+ * Computes every user's influence (PageRank over the friend graph) and
+ * publishes it for get_influence() and TIE_BREAK_INFLUENCE. The previous
+ * scores are the starting point, so after a few edge changes it converges
+ * in a few iterations; nothing is done if the graph hasn't changed since.
+ * Returns the number of iterations, or -1 if memory runs out.
+ **/
+int compute_influence_unlocked(int num_threads)
+{
+  pthread_rwlock_rdlock(&influence_lock);
+  bool current = influence != NULL && influence_version == graph_version;
+  pthread_rwlock_unlock(&influence_lock);
+  if (current)
+    return 0;
+  GraphSnapshot *s = freeze_graph_unlocked();
+  if (s == NULL)
+    return -1;
+  int n = s->num_users;
+  double *rank = malloc((n + 1) * sizeof(double));
+  double *scores = calloc(user_table_size + 1, sizeof(double));
+  if (rank == NULL || scores == NULL)
+  {
+    free(rank);
+    free(scores);
+    free_graph_snapshot(s);
+    return -1;
+  }
+
+  // Warm start from the published scores; new users start at the mean
+  pthread_rwlock_rdlock(&influence_lock);
+  double sum = 0;
+  for (int u = 0; u < n; u++)
+  {
+    rank[u] = s->user_ids[u] < influence_size ? influence[s->user_ids[u]] : 0.0;
+    if (rank[u] <= 0)
+      rank[u] = 1.0 / n;
+    sum += rank[u];
+  }
+  pthread_rwlock_unlock(&influence_lock);
+  for (int u = 0; u < n; u++)
+    rank[u] /= sum;
+
+  int iterations = snapshot_pagerank(s, rank, num_threads);
+  if (iterations >= 0)
+  {
+    for (int u = 0; u < n; u++)
+      scores[s->user_ids[u]] = rank[u];
+    pthread_rwlock_wrlock(&influence_lock);
+    double *old = influence;
+    influence = scores;
+    influence_size = user_table_size;
+    influence_version = s->version;
+    pthread_rwlock_unlock(&influence_lock);
+    free(old);
+  }
+  else
+    free(scores);
+  free(rank);
+  free_graph_snapshot(s);
+  return iterations;
+}
+
+int compute_influence(int num_threads)
+{
+  graph_read_lock();
+  int result = compute_influence_unlocked(num_threads);
+  graph_unlock();
+  return result;
+}
+
+/**
+ * The user's influence from the last compute_influence(): their PageRank,
+ * where all users' scores sum to 1. 0 if it hasn't been computed for them.
+ **/
+double get_influence(User *user)
+{
+  if (user == NULL)
+    return 0.0;
+  graph_read_lock();
+  pthread_rwlock_rdlock(&influence_lock);
+  double result = influence_of(user);
+  pthread_rwlock_unlock(&influence_lock);
+  graph_unlock();
+  return result;
+}
+
+// Bulk loading. Input files are mapped into memory (or read into one buffer
+// where mmap isn't available) and split into lines and fields in place.
+// Users:        one name per line
+// Friendships:  nameA,nameB per line
+// Follows:      name,brand per line
+// Brand edges:  brandA,brandB per line (or a lone brand with no similar ones)
+// Fields may also be tab separated; blank lines and lines starting with '#'
+// are skipped. Users named in friendship or follow files that don't exist
+// yet are created. New edges are gathered, radix sorted and deduplicated,
+// then merged into each user's sorted list in a single pass, instead of one
+// O(degree) sorted insert per edge. Dense brand matrix files (see
+// populate_brand_matrix) are parsed separately.
+typedef struct mapped_file_struct
+{
+  char *data;
+  size_t size;
+  bool mapped; // false if data was read into a malloc'd buffer
+} MappedFile;
+
+int map_file(const char *file_name, MappedFile *mf)
+{
+  mf->data = NULL;
+  mf->size = 0;
+  mf->mapped = false;
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  mf->size = st.st_size;
+  if (mf->size == 0)
+  {
+    close(fd);
+    return 0;
+  }
+  void *data = mmap(NULL, mf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data != MAP_FAILED)
+  {
+    madvise(data, mf->size, MADV_SEQUENTIAL);
+    mf->data = data;
+    mf->mapped = true;
+    close(fd);
+    return 0;
+  }
+  mf->data = malloc(mf->size);
+  size_t got = 0;
+  while (mf->data != NULL && got < mf->size)
+  {
+    ssize_t r = read(fd, mf->data + got, mf->size - got);
+    if (r <= 0)
+      break;
+    got += r;
+  }
+  close(fd);
+  if (mf->data == NULL || got < mf->size)
+  {
+    free(mf->data);
+    mf->data = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void unmap_file(MappedFile *mf)
+{
+  if (mf->mapped)
+    munmap(mf->data, mf->size);
+  else
+    free(mf->data);
+  mf->data = NULL;
+}
+
+typedef struct line_reader_struct
+{
+  const char *p;
+  const char *end;
+} LineReader;
+
+/**
+ * Finds the next non-empty, non-comment line, setting *line to its start
+ * and *stop to its end (before any "\r\n"). Returns false at the end of the
+ * input.
+ **/
+bool next_line(LineReader *r, const char **line, const char **stop)
+{
+  while (r->p < r->end)
+  {
+    const char *start = r->p;
+    const char *eol = memchr(start, '\n', r->end - start);
+    if (eol == NULL)
+      eol = r->end;
+    r->p = eol + 1;
+    if (eol > start && eol[-1] == '\r')
+      eol--;
+    if (eol == start || *start == '#')
+      continue;
+    *line = start;
+    *stop = eol;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Splits the next non-empty, non-comment line into up to max fields,
+ * copying each into fields[i] (names longer than MAX_STR_LEN - 1 are cut).
+ * Returns the number of fields, or -1 at the end of the input.
+ **/
+int next_record(LineReader *r, char fields[][MAX_STR_LEN], int max)
+{
+  const char *field, *stop;
+  if (!next_line(r, &field, &stop))
+    return -1;
+  int n = 0;
+  while (n < max)
+  {
+    const char *sep = field;
+    while (sep < stop && *sep != ',' && *sep != '\t')
+      sep++;
+    size_t len = sep - field;
+    if (len > MAX_STR_LEN - 1)
+      len = MAX_STR_LEN - 1;
+    memcpy(fields[n], field, len);
+    fields[n++][len] = '\0';
+    if (sep >= stop)
+      break;
+    field = sep + 1;
+  }
+  return n;
+}
+
+// A field of a mapped file, in place (not '\0' terminated)
+typedef struct field_struct
+{
+  const char *start;
+  int len;
+} Field;
+
+/**
+ * next_record() without the copies: fields[i] points into the input.
+ **/
+int next_fields(LineReader *r, Field *fields, int max)
+{
+  const char *field, *stop;
+  if (!next_line(r, &field, &stop))
+    return -1;
+  int n = 0;
+  while (n < max)
+  {
+    const char *sep = field;
+    while (sep < stop && *sep != ',' && *sep != '\t')
+      sep++;
+    fields[n].start = field;
+    fields[n++].len = sep - field;
+    if (sep >= stop)
+      break;
+    field = sep + 1;
+  }
+  return n;
+}
+
+int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Sorts 64-bit keys with four stable 16-bit counting passes; tmp must hold
+ * n keys. The result ends up back in keys.
+ **/
+void radix_sort_u64(uint64_t *keys, uint64_t *tmp, size_t n)
+{
+  size_t *counts = malloc(65536 * sizeof(size_t));
+  if (counts == NULL)
+  {
+    qsort(keys, n, sizeof(uint64_t), compare_u64);
+    return;
+  }
+  for (int shift = 0; shift < 64; shift += 16)
+  {
+    memset(counts, 0, 65536 * sizeof(size_t));
+    for (size_t i = 0; i < n; i++)
+      counts[(keys[i] >> shift) & 0xffff]++;
+    if (counts[(keys[0] >> shift) & 0xffff] == n)
+      continue; // Every key has the same digit, nothing to move
+    size_t sum = 0;
+    for (int d = 0; d < 65536; d++)
+    {
+      size_t c = counts[d];
+      counts[d] = sum;
+      sum += c;
+    }
+    for (size_t i = 0; i < n; i++)
+      tmp[counts[(keys[i] >> shift) & 0xffff]++] = keys[i];
+    memcpy(keys, tmp, n * sizeof(uint64_t));
+  }
+  free(counts);
+}
+
+typedef struct key_buffer_struct
+{
+  uint64_t *keys;
+  size_t count;
+  size_t cap;
+} KeyBuffer;
+
+int push_key(KeyBuffer *kb, uint64_t key)
+{
+  if (kb->count == kb->cap)
+  {
+    size_t cap = kb->cap == 0 ? 4096 : kb->cap * 2;
+    uint64_t *keys = realloc(kb->keys, cap * sizeof(uint64_t));
+    if (keys == NULL)
+      return -1;
+    kb->keys = keys;
+    kb->cap = cap;
+  }
+  kb->keys[kb->count++] = key;
+  return 0;
+}
+
+/**
+ * Sorts the buffer and drops duplicate keys.
+ **/
+int sort_unique_keys(KeyBuffer *kb)
+{
+  if (kb->count == 0)
+    return 0;
+  uint64_t *tmp = malloc(kb->count * sizeof(uint64_t));
+  if (tmp == NULL)
+    return -1;
+  radix_sort_u64(kb->keys, tmp, kb->count);
+  free(tmp);
+  size_t kept = 1;
+  for (size_t i = 1; i < kb->count; i++)
+  {
+    if (kb->keys[i] != kb->keys[kept - 1])
+      kb->keys[kept++] = kb->keys[i];
+  }
+  kb->count = kept;
+  return 0;
+}
+
+// Users created during one bulk load, linked into allUsers all at once
+typedef struct bulk_users_struct
+{
+  User **users;
+  int count;
+  int cap;
+} BulkUsers;
+
+/**
+ * Returns the user with the given name, creating it (outside allUsers, see
+ * link_bulk_users()) if there is none. Returns NULL for invalid names.
+ **/
+User *bulk_find_or_create(BulkUsers *bu, const char *name)
+{
+  User *user = find_user_unlocked(name);
+  if (user != NULL || *name == '\0')
+    return user;
+  if (bu->count == bu->cap)
+  {
+    int cap = bu->cap == 0 ? 1024 : bu->cap * 2;
+    User **users = realloc(bu->users, cap * sizeof(User *));
+    if (users == NULL)
+      return NULL;
+    bu->users = users;
+    bu->cap = cap;
+  }
+  user = slab_alloc(&user_slab);
+  if (user == NULL)
+    return NULL;
+  user->name = intern_string(&name_arena, name);
+  if (user->name == NULL || register_user(user) != 0 || index_user_name(user) != 0)
+  {
+    if (user->name != NULL && user_table[user->id] == user)
+      unregister_user(user);
+    slab_free(&user_slab, user);
+    return NULL;
+  }
+  component_add_user(user);
+  bu->users[bu->count++] = user;
+  return user;
+}
+
+int compare_user_names(const void *a, const void *b)
+{
+  return strcmp((*(User *const *)a)->name, (*(User *const *)b)->name);
+}
+
+/**
+ * Sorts the users created by a bulk load and merges them into allUsers in
+ * one pass.
+ **/
+void link_bulk_users(BulkUsers *bu)
+{
+  if (bu->count == 0)
+    return;
+  qsort(bu->users, bu->count, sizeof(User *), compare_user_names);
+  FriendNode *prev = NULL;
+  FriendNode *cur = allUsers;
+  for (int i = 0; i < bu->count; i++)
+  {
+    while (cur != NULL && strcmp(cur->user->name, bu->users[i]->name) < 0)
+    {
+      prev = cur;
+      cur = cur->next;
+    }
+    FriendNode *fn = slab_alloc(&friend_node_slab);
+    if (fn == NULL)
+      break;
+    fn->user = bu->users[i];
+    fn->user->listed = true;
+    fn->next = cur;
+    if (prev == NULL)
+      allUsers = fn;
+    else
+      prev->next = fn;
+    prev = fn;
+  }
+  reindex_friend_list(&allUsers, &all_users_index);
+  free(bu->users);
+  bu->users = NULL;
+  bu->count = bu->cap = 0;
+  journal_mark_unlogged();
+  graph_version++;
+}
+
+/**
+ * Ranks every user in allUsers by name: rank[user->id] is the user's
+ * position in allUsers (-1 for users not in it), and by_rank is the reverse.
+ * Friend lists are name sorted, so they are sorted by rank too.
+ **/
+int rank_users(int **rank, User ***by_rank)
+{
+  *rank = malloc((user_table_size + 1) * sizeof(int));
+  *by_rank = malloc((user_table_size + 1) * sizeof(User *));
+  if (*rank == NULL || *by_rank == NULL)
+  {
+    free(*rank);
+    free(*by_rank);
+    return -1;
+  }
+  for (int i = 0; i < user_table_size; i++)
+    (*rank)[i] = -1;
+  int r = 0;
+  for (FriendNode *cur = allUsers; cur != NULL; cur = cur->next, r++)
+  {
+    (*rank)[cur->user->id] = r;
+    (*by_rank)[r] = cur->user;
+  }
+  return 0;
+}
+
+/**
+ * Loads users from a file, one name per line. Returns the number of users
+ * created, or -1 if the file can't be read.
+ **/
+long load_users_unlocked(char *file_name)
+{
+  MappedFile mf;
+  if (map_file(file_name, &mf) != 0)
+  {
+    printf("Could not open '%s'\n", file_name);
+    return -1;
+  }
+  char fields[1][MAX_STR_LEN];
+  LineReader r = {mf.data, mf.data + mf.size};
+  BulkUsers bu = {0};
+  while (next_record(&r, fields, 1) >= 0)
+    bulk_find_or_create(&bu, fields[0]);
+  long created = bu.count;
+  link_bulk_users(&bu);
+  unmap_file(&mf);
+  return created;
+}
+
+long load_users(char *file_name)
+{
+  graph_write_lock();
+  long result = load_users_unlocked(file_name);
+  graph_unlock();
+  return result;
+}
+
+/**
+ * Adds the friendships in pairs (user id << 32 | user id, both users in
+ * allUsers and distinct) with one sorted merge per user, then empties the
+ * buffer. Returns the number of new friendships, or -1 if out of memory.
+ **/
+long merge_friend_pairs(KeyBuffer *pairs)
+{
+  // Turn the id pairs into (rank, rank) keys in both directions
+  int *rank;
+  User **by_rank;
+  KeyBuffer edges = {0};
+  if (rank_users(&rank, &by_rank) != 0)
+  {
+    free(pairs->keys);
+    *pairs = (KeyBuffer){0};
+    return -1;
+  }
+  for (size_t i = 0; i < pairs->count; i++)
+  {
+    int ra = rank[pairs->keys[i] >> 32];
+    int rb = rank[pairs->keys[i] & 0xffffffff];
+    if (ra < 0 || rb < 0)
+      continue;
+    push_key(&edges, (uint64_t)ra << 32 | (uint32_t)rb);
+    push_key(&edges, (uint64_t)rb << 32 | (uint32_t)ra);
+  }
+  free(pairs->keys);
+  *pairs = (KeyBuffer){0};
+  sort_unique_keys(&edges);
+
+  // Merge each user's run of new friends into their friend list
+  long added = 0;
+  for (size_t i = 0; i < edges.count;)
+  {
+    int ru = edges.keys[i] >> 32;
+    User *user = by_rank[ru];
+    FriendNode *prev = NULL;
+    FriendNode *cur = user->friends;
+    for (; i < edges.count && (int)(edges.keys[i] >> 32) == ru; i++)
+    {
+      int rv = edges.keys[i] & 0xffffffff;
+      while (cur != NULL && rank[cur->user->id] < rv)
+      {
+        prev = cur;
+        cur = cur->next;
+      }
+      if (cur != NULL && rank[cur->user->id] == rv)
+        continue; // Already friends
+      FriendNode *fn = slab_alloc(&friend_node_slab);
+      if (fn == NULL)
+        continue;
+      fn->user = by_rank[rv];
+      fn->next = cur;
+      if (prev == NULL)
+        user->friends = fn;
+      else
+        prev->next = fn;
+      prev = fn;
+      added++;
+    }
+    reindex_friend_list(&user->friends, &friend_index[user->id]);
+  }
+  free(edges.keys);
+  free(rank);
+  free(by_rank);
+  invalidate_components();
+  journal_mark_unlogged();
+  graph_version++;
+  return added / 2;
+}
+
+/**
+ * Loads friendships from an edge list, one nameA,nameB pair per line.
+ * Self loops, repeated pairs and existing friendships are skipped. Returns
+ * the number of new friendships, or -1 if the file can't be read.
+ **/
+long load_friendships_unlocked(char *file_name)
+{
+  MappedFile mf;
+  if (map_file(file_name, &mf) != 0)
+  {
+    printf("Could not open '%s'\n", file_name);
+    return -1;
+  }
+  char fields[2][MAX_STR_LEN];
+  LineReader r = {mf.data, mf.data + mf.size};
+  BulkUsers bu = {0};
+  KeyBuffer pairs = {0};
+  while (true)
+  {
+    int n = next_record(&r, fields, 2);
+    if (n < 0)
+      break;
+    if (n < 2)
+      continue;
+    User *a = bulk_find_or_create(&bu, fields[0]);
+    User *b = bulk_find_or_create(&bu, fields[1]);
+    if (a == NULL || b == NULL || a == b)
+      continue;
+    push_key(&pairs, (uint64_t)a->id << 32 | (uint32_t)b->id);
+  }
+  unmap_file(&mf);
+  link_bulk_users(&bu);
+  return merge_friend_pairs(&pairs);
+}
+
+long load_friendships(char *file_name)
+{
+  graph_write_lock();
+  long result = load_friendships_unlocked(file_name);
+  graph_unlock();
+  return result;
+}
+
+/**
+ * Adds the follows in follows (user id << 32 | brand index) with one sorted
+ * merge per user, then empties the buffer. Returns the number of new
+ * follows, or -1 if out of memory.
+ **/
+long merge_brand_follows(KeyBuffer *follows)
+{
+  // Brands ranked by name, since brand lists are kept in name order
+  int *brand_rank = malloc((num_brands + 1) * sizeof(int));
+  int *by_brand_rank = malloc((num_brands + 1) * sizeof(int));
+  if (brand_rank == NULL || by_brand_rank == NULL)
+  {
+    free(brand_rank);
+    free(by_brand_rank);
+    free(follows->keys);
+    *follows = (KeyBuffer){0};
+    return -1;
+  }
+  for (int i = 0; i < num_brands; i++)
+    by_brand_rank[i] = i;
+  for (int i = 1; i < num_brands; i++)
+  {
+    // Insertion sort is fine for a one-off; brand files are small next to edges
+    int b = by_brand_rank[i];
+    int j = i;
+    for (; j > 0 && strcmp(brand_names[by_brand_rank[j - 1]], brand_names[b]) > 0; j--)
+      by_brand_rank[j] = by_brand_rank[j - 1];
+    by_brand_rank[j] = b;
+  }
+  for (int r = 0; r < num_brands; r++)
+    brand_rank[by_brand_rank[r]] = r;
+  for (size_t i = 0; i < follows->count; i++)
+    follows->keys[i] = (follows->keys[i] & ~(uint64_t)0xffffffff) | (uint32_t)brand_rank[follows->keys[i] & 0xffffffff];
+  sort_unique_keys(follows);
+
+  long added = 0;
+  for (size_t i = 0; i < follows->count;)
+  {
+    User *user = user_table[follows->keys[i] >> 32];
+    BrandNode *prev = NULL;
+    BrandNode *cur = user->brands;
+    for (; i < follows->count && user_table[follows->keys[i] >> 32] == user; i++)
+    {
+      char *name = brand_names[by_brand_rank[follows->keys[i] & 0xffffffff]];
+      int cmp = 1;
+      while (cur != NULL && (cmp = strcmp(cur->brand_name, name)) < 0)
+      {
+        prev = cur;
+        cur = cur->next;
+      }
+      if (cur != NULL && cmp == 0)
+        continue; // Already followed
+      BrandNode *bn = slab_alloc(&brand_node_slab);
+      if (bn == NULL)
+        continue;
+      bn->brand_name = name; // Already interned
+      if (index_brand_follow(user, bn) != 0)
+      {
+        slab_free(&brand_node_slab, bn);
+        continue;
+      }
+      bn->next = cur;
+      if (prev == NULL)
+        user->brands = bn;
+      else
+        prev->next = bn;
+      prev = bn;
+      added++;
+    }
+  }
+  free(follows->keys);
+  *follows = (KeyBuffer){0};
+  free(brand_rank);
+  free(by_brand_rank);
+  journal_mark_unlogged();
+  graph_version++;
+  return added;
+}
+
+/**
+ * Loads brand follows, one name,brand pair per line. Brands that aren't
+ * loaded are skipped. Returns the number of new follows, or -1 if the file
+ * can't be read.
+ **/
+long load_follows_unlocked(char *file_name)
+{
+  MappedFile mf;
+  if (map_file(file_name, &mf) != 0)
+  {
+    printf("Could not open '%s'\n", file_name);
+    return -1;
+  }
+  char fields[2][MAX_STR_LEN];
+  LineReader r = {mf.data, mf.data + mf.size};
+  BulkUsers bu = {0};
+  KeyBuffer follows = {0};
+  while (true)
+  {
+    int n = next_record(&r, fields, 2);
+    if (n < 0)
+      break;
+    if (n < 2)
+      continue;
+    int brand = find_brand_index(fields[1]);
+    User *user = brand < 0 ? NULL : bulk_find_or_create(&bu, fields[0]);
+    if (user != NULL)
+      push_key(&follows, (uint64_t)user->id << 32 | (uint32_t)brand);
+  }
+  unmap_file(&mf);
+  link_bulk_users(&bu);
+  return merge_brand_follows(&follows);
+}
+
+long load_follows(char *file_name)
+{
+  graph_write_lock();
+  long result = load_follows_unlocked(file_name);
+  graph_unlock();
+  return result;
+}
+
+// Brand similarity files, in one of two formats:
+//   Dense:  a header line of comma separated brand names, then one row of
+//           comma separated cells per brand, in header order
+//   Sparse: brandA,brandB per line, as for friendships; a line holding a
+//           lone brand declares it without any similar brands
+// Either way the file is mapped and split into chunks at line boundaries,
+// and each chunk is parsed by its own thread.
+#define PARSE_CHUNK_MIN (1 << 20)
+
+typedef void *(*ParseJobFn)(void *job);
+
+/**
+ * The number of threads to parse size bytes with: one per CPU, but no more
+ * than one per PARSE_CHUNK_MIN bytes, as small files aren't worth it.
+ **/
+int parse_threads(size_t size)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t chunks = size / PARSE_CHUNK_MIN;
+  if (cpus <= 0)
+    cpus = 1;
+  if (chunks < (size_t)cpus)
+    cpus = chunks > 0 ? chunks : 1;
+  return (int)cpus;
+}
+
+/**
+ * Splits [data, data + size) into count chunks, chunk i running from
+ * bounds[i] to bounds[i + 1]. Every chunk starts at the start of a line, so
+ * no line is split between two of them (some chunks may be empty).
+ **/
+void split_lines(const char *data, size_t size, int count, const char **bounds)
+{
+  const char *end = data + size;
+  bounds[0] = data;
+  for (int i = 1; i < count; i++)
+  {
+    const char *p = data + size / count * i;
+    if (p < bounds[i - 1])
+      p = bounds[i - 1];
+    if (p > data && p < end && p[-1] != '\n')
+    {
+      const char *eol = memchr(p, '\n', end - p);
+      p = eol == NULL ? end : eol + 1;
+    }
+    bounds[i] = p;
+  }
+  bounds[count] = end;
+}
+
+/**
+ * Runs fn on each of the count jobs in the array (job_size bytes apart),
+ * job 0 on this thread and the rest on threads of their own. A job whose
+ * thread can't be started is run here instead.
+ **/
+void run_parse_jobs(ParseJobFn fn, void *jobs, size_t job_size, int count)
+{
+  pthread_t *threads = malloc(count * sizeof(pthread_t));
+  bool *started = calloc(count, sizeof(bool));
+  for (int i = 1; i < count && threads != NULL && started != NULL; i++)
+    started[i] = pthread_create(&threads[i], NULL, fn, (char *)jobs + i * job_size) == 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (started == NULL || !started[i])
+      fn((char *)jobs + i * job_size);
+  }
+  for (int i = 1; i < count && started != NULL; i++)
+  {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  free(started);
+}
+
+// One chunk of the rows of a dense matrix file
+typedef struct dense_rows_job_struct
+{
+  const char *start;
+  const char *end;
+  int first_row; // brand index of the chunk's first row
+  int rows;      // row lines in the chunk, blank and '#' lines aside
+} DenseRowsJob;
+
+void *count_dense_rows(void *arg)
+{
+  DenseRowsJob *job = arg;
+  LineReader r = {job->start, job->end};
+  const char *line, *stop;
+  job->rows = 0;
+  while (next_line(&r, &line, &stop))
+    job->rows++;
+  return NULL;
+}
+
+/**
+ * True if a dense matrix cell marks a pair as similar, i.e. it holds
+ * anything besides zeros ("0", "00", "0.0"), spaces or nothing at all.
+ **/
+bool dense_cell_set(const char *p, const char *end)
+{
+  for (; p < end; p++)
+  {
+    if (*p != '0' && *p != '.' && *p != ' ')
+      return true;
+  }
+  return false;
+}
+
+void *parse_dense_rows(void *arg)
+{
+  DenseRowsJob *job = arg;
+  LineReader r = {job->start, job->end};
+  const char *line, *stop;
+  for (int x = job->first_row; x < num_brands && next_line(&r, &line, &stop); x++)
+  {
+    const char *cell = line;
+    for (int y = 0; y < num_brands; y++)
+    {
+      const char *sep = memchr(cell, ',', stop - cell);
+      if (sep == NULL)
+        sep = stop;
+      if (dense_cell_set(cell, sep))
+        set_brands_similar_atomic(x, y);
+      if (sep == stop)
+        break;
+      cell = sep + 1;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Read from a given file and populate a the brand list and brand matrix.
+ * The first line holds the comma separated brand names, followed by one
+ * row of comma separated cells per brand; any non-zero cell marks the pair
+ * as similar. The matrix is kept symmetric, so a mark in either (x, y) or
+ * (y, x) is enough. Blank lines and lines starting with '#' are skipped,
+ * as in the edge list loaders. Rows are parsed in parallel, a chunk of lines each.
+ **/
+void populate_brand_matrix_unlocked(char *file_name)
+{
+  MappedFile mf;
+  if (map_file(file_name, &mf) != 0)
+  {
+    printf("Could not open '%s'\n", file_name);
+    return;
+  }
+  if (mf.size == 0)
+  {
+    unmap_file(&mf);
+    return;
+  }
+  const char *end = mf.data + mf.size;
+  const char *body = memchr(mf.data, '\n', mf.size);
+  body = body == NULL ? end : body + 1;
+  const char *stop = body;
+  while (stop > mf.data && (stop[-1] == '\n' || stop[-1] == '\r'))
+    stop--;
+
+  // Count the brands, then load up the brand_names array
+  int n = 1;
+  for (const char *c = mf.data; c < stop; c++)
+  {
+    if (*c == ',')
+      n++;
+  }
+  if (alloc_brand_matrix(n) != 0)
+  {
+    printf("Not enough memory for %d brands\n", n);
+    unmap_file(&mf);
+    return;
+  }
+  const char *name = mf.data;
+  char buf[MAX_STR_LEN];
+  for (int i = 0; i < n; i++)
+  {
+    const char *comma = memchr(name, ',', stop - name);
+    if (comma == NULL)
+      comma = stop;
+    size_t len = comma - name;
+    if (len > MAX_STR_LEN - 1)
+      len = MAX_STR_LEN - 1;
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+    brand_names[i] = intern_string(&name_arena, buf);
+    add_brand_to_index(i);
+    name = comma + 1;
+  }
+
+  // Load up the brand_adjacency_matrix: count each chunk's lines to find
+  // the row it starts at, then parse the chunks
+  int threads = parse_threads(end - body);
+  DenseRowsJob *jobs = calloc(threads, sizeof(DenseRowsJob));
+  const char **bounds = malloc((threads + 1) * sizeof(char *));
+  if (jobs == NULL || bounds == NULL)
+  {
+    free(jobs);
+    free(bounds);
+    threads = 1;
+    DenseRowsJob job = {body, end, 0, 0};
+    parse_dense_rows(&job);
+  }
+  else
+  {
+    split_lines(body, end - body, threads, bounds);
+    for (int t = 0; t < threads; t++)
+    {
+      jobs[t].start = bounds[t];
+      jobs[t].end = bounds[t + 1];
+    }
+    if (threads > 1)
+      run_parse_jobs(count_dense_rows, jobs, sizeof(DenseRowsJob), threads);
+    for (int t = 1; t < threads; t++)
+      jobs[t].first_row = jobs[t - 1].first_row + jobs[t - 1].rows;
+    run_parse_jobs(parse_dense_rows, jobs, sizeof(DenseRowsJob), threads);
+    free(jobs);
+    free(bounds);
+  }
+  unmap_file(&mf);
+  rebuild_brand_followers();
+  journal_mark_unlogged();
+  graph_version++;
+}
+
+void populate_brand_matrix(char *file_name)
+{
+  graph_write_lock();
+  populate_brand_matrix_unlocked(file_name);
+  graph_unlock();
+}
+
+// Distinct names, in order of first appearance, with an open addressing
+// table of their ids keyed by hash (-1 = empty slot)
+typedef struct field_set_struct
+{
+  Field *names;
+  uint64_t *hashes;
+  int count;
+  int cap;
+  int *slots;
+  int mask;
+} FieldSet;
+
+/**
+ * Returns the id of the name in the set, adding it if it's new, or -1 if
+ * out of memory.
+ **/
+int field_set_add(FieldSet *fs, Field name, uint64_t hash)
+{
+  if (2 * (fs->count + 1) > fs->mask + 1)
+  {
+    int slots = fs->slots == NULL ? 64 : 2 * (fs->mask + 1);
+    int *table = malloc(slots * sizeof(int));
+    if (table == NULL)
+      return -1;
+    memset(table, -1, slots * sizeof(int));
+    for (int id = 0; id < fs->count; id++)
+    {
+      int i = fs->hashes[id] & (slots - 1);
+      while (table[i] >= 0)
+        i = (i + 1) & (slots - 1);
+      table[i] = id;
+    }
+    free(fs->slots);
+    fs->slots = table;
+    fs->mask = slots - 1;
+  }
+  int i = hash & fs->mask;
+  for (; fs->slots[i] >= 0; i = (i + 1) & fs->mask)
+  {
+    Field *f = &fs->names[fs->slots[i]];
+    if (fs->hashes[fs->slots[i]] == hash && f->len == name.len && memcmp(f->start, name.start, name.len) == 0)
+      return fs->slots[i];
+  }
+  if (fs->count == fs->cap)
+  {
+    int cap = fs->cap == 0 ? 256 : 2 * fs->cap;
+    Field *names = realloc(fs->names, cap * sizeof(Field));
+    if (names == NULL)
+      return -1;
+    fs->names = names;
+    uint64_t *hashes = realloc(fs->hashes, cap * sizeof(uint64_t));
+    if (hashes == NULL)
+      return -1;
+    fs->hashes = hashes;
+    fs->cap = cap;
+  }
+  fs->names[fs->count] = name;
+  fs->hashes[fs->count] = hash;
+  fs->slots[i] = fs->count;
+  return fs->count++;
+}
+
+void free_field_set(FieldSet *fs)
+{
+  free(fs->names);
+  free(fs->hashes);
+  free(fs->slots);
+}
+
+// One chunk of a sparse brand file: the brands it names (local ids) and
+// its pairs of local ids, then the brand index of each local id
+typedef struct brand_edges_job_struct
+{
+  const char *start;
+  const char *end;
+  FieldSet names;
+  KeyBuffer pairs;
+  int *brand;
+  bool failed;
+} BrandEdgesJob;
+
+void *parse_brand_edges(void *arg)
+{
+  BrandEdgesJob *job = arg;
+  LineReader r = {job->start, job->end};
+  Field fields[2];
+  int n;
+  while ((n = next_fields(&r, fields, 2)) >= 0)
+  {
+    int ids[2];
+    int named = 0;
+    for (int i = 0; i < n; i++)
+    {
+      if (fields[i].len == 0)
+        continue;
+      if (fields[i].len > MAX_STR_LEN - 1)
+        fields[i].len = MAX_STR_LEN - 1;
+      ids[named] = field_set_add(&job->names, fields[i], hash_bytes(fields[i].start, fields[i].len));
+      if (ids[named++] < 0)
+      {
+        job->failed = true;
+        return NULL;
+      }
+    }
+    if (named == 2 && ids[0] != ids[1] && push_key(&job->pairs, (uint64_t)ids[0] << 32 | ids[1]) != 0)
+    {
+      job->failed = true;
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+void *mark_brand_edges(void *arg)
+{
+  BrandEdgesJob *job = arg;
+  for (size_t i = 0; i < job->pairs.count; i++)
+  {
+    uint64_t key = job->pairs.keys[i];
+    int a = job->brand[key >> 32];
+    int b = job->brand[key & 0xFFFFFFFF];
+    if (a != b)
+      set_brands_similar_atomic(a, b);
+  }
+  return NULL;
+}
+
+/**
+ * Replaces the brand list and matrix with the brands and similar pairs of
+ * a sparse brand file, one brandA,brandB pair per line. Brands are indexed
+ * in order of first appearance; self pairs are skipped. Returns the number
+ * of brands, or -1 if the file can't be read.
+ **/
+int load_brand_edges_unlocked(char *file_name)
+{
+  MappedFile mf;
+  if (map_file(file_name, &mf) != 0)
+  {
+    printf("Could not open '%s'\n", file_name);
+    return -1;
+  }
+  int threads = parse_threads(mf.size);
+  BrandEdgesJob *jobs = calloc(threads, sizeof(BrandEdgesJob));
+  const char **bounds = malloc((threads + 1) * sizeof(char *));
+  FieldSet brands = {0};
+  int result = -1;
+  if (jobs == NULL || bounds == NULL)
+  {
+    printf("Not enough memory to load '%s'\n", file_name);
+    goto done;
+  }
+  split_lines(mf.data, mf.size, threads, bounds);
+  for (int t = 0; t < threads; t++)
+  {
+    jobs[t].start = bounds[t];
+    jobs[t].end = bounds[t + 1];
+  }
+  run_parse_jobs(parse_brand_edges, jobs, sizeof(BrandEdgesJob), threads);
+
+  // Number the brands in file order, chunk by chunk
+  for (int t = 0; t < threads; t++)
+  {
+    BrandEdgesJob *job = &jobs[t];
+    job->brand = malloc((job->names.count + 1) * sizeof(int));
+    if (job->failed || job->brand == NULL)
+    {
+      printf("Not enough memory to load '%s'\n", file_name);
+      goto done;
+    }
+    for (int i = 0; i < job->names.count; i++)
+    {
+      job->brand[i] = field_set_add(&brands, job->names.names[i], job->names.hashes[i]);
+      if (job->brand[i] < 0)
+      {
+        printf("Not enough memory to load '%s'\n", file_name);
+        goto done;
+      }
+    }
+  }
+  if (alloc_brand_matrix(brands.count) != 0)
+  {
+    printf("Not enough memory for %d brands\n", brands.count);
+    goto done;
+  }
+  char buf[MAX_STR_LEN];
+  for (int i = 0; i < brands.count; i++)
+  {
+    memcpy(buf, brands.names[i].start, brands.names[i].len);
+    buf[brands.names[i].len] = '\0';
+    brand_names[i] = intern_string(&name_arena, buf);
+    add_brand_to_index(i);
+  }
+  run_parse_jobs(mark_brand_edges, jobs, sizeof(BrandEdgesJob), threads);
+  rebuild_brand_followers();
+  journal_mark_unlogged();
+  graph_version++;
+  result = brands.count;
+
+done:
+  for (int t = 0; jobs != NULL && t < threads; t++)
+  {
+    free_field_set(&jobs[t].names);
+    free(jobs[t].pairs.keys);
+    free(jobs[t].brand);
+  }
+  free(jobs);
+  free(bounds);
+  free_field_set(&brands);
+  unmap_file(&mf);
+  return result;
+}
+
+int load_brand_edges(char *file_name)
+{
+  graph_write_lock();
+  int result = load_brand_edges_unlocked(file_name);
+  graph_unlock();
+  return result;
+}
+
+
+// Binary snapshots of the whole graph for fast restarts. The file is a
+// SnapshotHeader followed by 64-byte aligned sections, in native byte order
+// (byte_order tells a reader whether that matches its own):
+//   SEC_NAMES          user names then brand names, each '\0' terminated
+//   SEC_USER_NAMES     uint64 offset of each user's name in SEC_NAMES
+//   SEC_FRIEND_OFFSETS uint32 CSR offsets, num_users + 1 of them
+//   SEC_FRIEND_IDS     uint32 friend indices, name order within each user
+//   SEC_FOLLOW_OFFSETS uint32 CSR offsets, num_users + 1 of them
+//   SEC_FOLLOWS        uint32 brand indices, name order within each user
+//   SEC_BRAND_NAMES    uint64 offset of each brand's name in SEC_NAMES
+//   SEC_BRAND_MATRIX   num_brands rows of brand_row_words uint64 words
+// Users are stored in allUsers (name) order; the first num_listed are the
+// ones in allUsers. Since every list is stored already sorted, restoring is
+// a straight copy into the linked lists with no parsing or sorting.
+#define SNAPSHOT_MAGIC "GRAFFIT"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define SNAPSHOT_ALIGN 64
+
+enum
+{
+  SEC_NAMES,
+  SEC_USER_NAMES,
+  SEC_FRIEND_OFFSETS,
+  SEC_FRIEND_IDS,
+  SEC_FOLLOW_OFFSETS,
+  SEC_FOLLOWS,
+  SEC_BRAND_NAMES,
+  SEC_BRAND_MATRIX,
+  NUM_SECTIONS
+};
+
+typedef struct snapshot_header_struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t num_users;
+  uint32_t num_listed;
+  uint32_t num_brands;
+  uint32_t brand_row_words;
+  uint64_t num_friend_ids;
+  uint64_t num_follows;
+  uint64_t section_offset[NUM_SECTIONS];
+  uint64_t section_size[NUM_SECTIONS];
+} SnapshotHeader;
+
+/**
+ * Writes size bytes of section data at the next aligned offset, recording
+ * where it went in the header. Returns -1 on a write error.
+ **/
+int write_section(FILE *f, SnapshotHeader *h, int sec, const void *data, uint64_t size)
+{
+  static const char zeros[SNAPSHOT_ALIGN];
+  long pos = ftell(f);
+  long pad = (SNAPSHOT_ALIGN - pos % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+  if (pad > 0 && fwrite(zeros, 1, pad, f) != (size_t)pad)
+    return -1;
+  h->section_offset[sec] = pos + pad;
+  h->section_size[sec] = size;
+  if (size > 0 && fwrite(data, 1, size, f) != size)
+    return -1;
+  return 0;
+}
+
+/**
+ * Saves users, names, friendships, follows and the brand matrix to a
+ * binary snapshot file. Returns 0 on success, -1 on failure.
+ **/
+int save_graph_unlocked(char *file_name)
+{
+  GraphSnapshot *s = freeze_graph_ordered_unlocked(SNAPSHOT_ORDER_NAME);
+  if (s == NULL)
+    return -1;
+  int n = s->num_users;
+  SnapshotHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  h.version = SNAPSHOT_VERSION;
+  h.byte_order = SNAPSHOT_BYTE_ORDER;
+  h.num_users = n;
+  h.num_listed = s->num_listed;
+  h.num_brands = num_brands;
+  h.brand_row_words = brand_row_words;
+  h.num_friend_ids = s->friend_offsets[n];
+
+  // Names blob and offsets
+  uint64_t name_bytes = 0;
+  for (int u = 0; u < n; u++)
+    name_bytes += strlen(s->names[u]) + 1;
+  for (int b = 0; b < num_brands; b++)
+    name_bytes += strlen(brand_names[b]) + 1;
+  char *names = malloc(name_bytes + 1);
+  uint64_t *user_names = malloc((n + 1) * sizeof(uint64_t));
+  uint64_t *brand_name_offsets = malloc((num_brands + 1) * sizeof(uint64_t));
+  uint32_t *follow_offsets = malloc((n + 1) * sizeof(uint32_t));
+  uint32_t *follows = malloc((s->brand_offsets[n] + 1) * sizeof(uint32_t));
+  FILE *f = fopen(file_name, "wb");
+  int result = -1;
+  if (names == NULL || user_names == NULL || brand_name_offsets == NULL || follow_offsets == NULL || follows == NULL || f == NULL)
+    goto done;
+  uint64_t pos = 0;
+  for (int u = 0; u < n; u++)
+  {
+    size_t len = strlen(s->names[u]) + 1;
+    user_names[u] = pos;
+    memcpy(names + pos, s->names[u], len);
+    pos += len;
+  }
+  for (int b = 0; b < num_brands; b++)
+  {
+    size_t len = strlen(brand_names[b]) + 1;
+    brand_name_offsets[b] = pos;
+    memcpy(names + pos, brand_names[b], len);
+    pos += len;
+  }
+
+  // Follows straight from the (name sorted) brand lists
+  uint32_t k = 0;
+  for (int u = 0; u < n; u++)
+  {
+    follow_offsets[u] = k;
+    // The snapshot was frozen under this same lock, so its users are live
+    for (BrandNode *b = user_table[s->user_ids[u]]->brands; b != NULL; b = b->next)
+    {
+      if (b->idx >= 0)
+        follows[k++] = b->idx;
+    }
+  }
+  follow_offsets[n] = k;
+  h.num_follows = k;
+
+  // Header goes first, then is rewritten once the offsets are known
+  if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+      write_section(f, &h, SEC_NAMES, names, name_bytes) != 0 ||
+      write_section(f, &h, SEC_USER_NAMES, user_names, n * sizeof(uint64_t)) != 0 ||
+      write_section(f, &h, SEC_FRIEND_OFFSETS, s->friend_offsets, (n + 1) * sizeof(uint32_t)) != 0 ||
+      write_section(f, &h, SEC_FRIEND_IDS, s->friend_ids, h.num_friend_ids * sizeof(uint32_t)) != 0 ||
+      write_section(f, &h, SEC_FOLLOW_OFFSETS, follow_offsets, (n + 1) * sizeof(uint32_t)) != 0 ||
+      write_section(f, &h, SEC_FOLLOWS, follows, (uint64_t)k * sizeof(uint32_t)) != 0 ||
+      write_section(f, &h, SEC_BRAND_NAMES, brand_name_offsets, num_brands * sizeof(uint64_t)) != 0 ||
+      write_section(f, &h, SEC_BRAND_MATRIX, brand_adjacency_matrix, (uint64_t)num_brands * brand_row_words * sizeof(uint64_t)) != 0)
+    goto done;
+  if (fseek(f, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, f) != 1)
+    goto done;
+  result = 0;
+
+done:
+  if (f != NULL && fclose(f) != 0)
+    result = -1;
+  free(names);
+  free(user_names);
+  free(brand_name_offsets);
+  free(follow_offsets);
+  free(follows);
+  free_graph_snapshot(s);
+  return result;
+}
+
+int save_graph(char *file_name)
+{
+  graph_read_lock();
+  int result = save_graph_unlocked(file_name);
+  graph_unlock();
+  return result;
+}
+
+/**
+ * Returns a pointer to the section if it lies inside the file and holds
+ * at least min_size bytes, otherwise NULL.
+ **/
+const void *snapshot_section(MappedFile *mf, const SnapshotHeader *h, int sec, uint64_t min_size)
+{
+  uint64_t off = h->section_offset[sec];
+  uint64_t size = h->section_size[sec];
+  if (size < min_size || off > mf->size || size > mf->size - off)
+    return NULL;
+  return mf->data + off;
+}
+
+/**
+ * Checks that the names blob is terminated and every name offset lies
+ * inside it.
+ **/
+bool snapshot_names_valid(const SnapshotHeader *h, const char *names, const uint64_t *user_names, const uint64_t *brand_name_offsets)
+{
+  uint64_t size = h->section_size[SEC_NAMES];
+  if (size > 0 && names[size - 1] != '\0')
+    return false;
+  for (uint32_t u = 0; u < h->num_users; u++)
+  {
+    if (user_names[u] >= size)
+      return false;
+  }
+  for (uint32_t b = 0; b < h->num_brands; b++)
+  {
+    if (brand_name_offsets[b] >= size)
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Checks that a CSR offsets array (count + 1 entries) starts at 0, never
+ * decreases and ends at total, and that every id it covers is below limit.
+ **/
+bool snapshot_csr_valid(const uint32_t *offsets, uint32_t count, const uint32_t *ids, uint32_t total, uint32_t limit)
+{
+  if (offsets[0] != 0 || offsets[count] != total)
+    return false;
+  for (uint32_t u = 0; u < count; u++)
+  {
+    if (offsets[u] > offsets[u + 1] || offsets[u + 1] > total)
+      return false;
+  }
+  for (uint32_t k = 0; k < total; k++)
+  {
+    if (ids[k] >= limit)
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Undoes a restore that ran out of memory part way: frees the first n
+ * restored users with their lists, allUsers and the brands, leaving the
+ * graph empty again.
+ **/
+void discard_restored_graph(User **users, uint32_t n)
+{
+  while (allUsers != NULL)
+  {
+    FriendNode *next = allUsers->next;
+    slab_free(&friend_node_slab, allUsers);
+    allUsers = next;
+  }
+  free_friend_index(&all_users_index);
+  for (uint32_t u = 0; u < n; u++)
+  {
+    User *user = users[u];
+    while (user->friends != NULL)
+    {
+      FriendNode *next = user->friends->next;
+      slab_free(&friend_node_slab, user->friends);
+      user->friends = next;
+    }
+    free_friend_index(&friend_index[user->id]);
+    user->brands = delete_brand_from_user(user->brands);
+    unindex_user_name(user);
+    unregister_user(user);
+    slab_free(&user_slab, user);
+  }
+  free_brand_matrix();
+}
+
+/**
+ * Restores a graph saved by save_graph() into an empty graph: the file is
+ * mapped and its sorted arrays are copied into users, friend lists, brand
+ * lists and the brand matrix in one linear pass. Every offset and id is
+ * checked before anything is built. Returns the number of users restored,
+ * or -1 (leaving the graph empty) if the file is missing or invalid, there
+ * already are users, or memory runs out.
+ **/
+long restore_graph_unlocked(char *file_name)
+{
+  if (user_slab.live > 0)
   {
+    printf("Can only restore into an empty graph\n");
     return -1;
   }
-  user->brands = delete_brand_from_user(user->brands);
-  FriendNode *temp = user->friends;
-  FriendNode *holder = NULL;
-  while (temp != NULL)
+  MappedFile mf;
+  if (map_file(file_name, &mf) != 0)
+  {
+    printf("Could not open '%s'\n", file_name);
+    return -1;
+  }
+  const SnapshotHeader *h = (const SnapshotHeader *)mf.data;
+  if (mf.size < sizeof(SnapshotHeader) || memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+      h->version != SNAPSHOT_VERSION || h->byte_order != SNAPSHOT_BYTE_ORDER || h->num_listed > h->num_users)
+  {
+    printf("'%s' is not a graffit snapshot this build can read\n", file_name);
+    unmap_file(&mf);
+    return -1;
+  }
+  uint32_t n = h->num_users;
+  const char *names = snapshot_section(&mf, h, SEC_NAMES, 0);
+  const uint64_t *user_names = snapshot_section(&mf, h, SEC_USER_NAMES, n * sizeof(uint64_t));
+  const uint32_t *friend_offsets = snapshot_section(&mf, h, SEC_FRIEND_OFFSETS, (n + 1) * sizeof(uint32_t));
+  const uint32_t *friend_ids = snapshot_section(&mf, h, SEC_FRIEND_IDS, h->num_friend_ids * sizeof(uint32_t));
+  const uint32_t *follow_offsets = snapshot_section(&mf, h, SEC_FOLLOW_OFFSETS, (n + 1) * sizeof(uint32_t));
+  const uint32_t *follows = snapshot_section(&mf, h, SEC_FOLLOWS, h->num_follows * sizeof(uint32_t));
+  const uint64_t *brand_name_offsets = snapshot_section(&mf, h, SEC_BRAND_NAMES, h->num_brands * sizeof(uint64_t));
+  uint64_t matrix_bytes = (uint64_t)h->num_brands * h->brand_row_words * sizeof(uint64_t);
+  const uint64_t *matrix = snapshot_section(&mf, h, SEC_BRAND_MATRIX, matrix_bytes);
+  User **users = malloc((n + 1) * sizeof(User *));
+  if (names == NULL || user_names == NULL || friend_offsets == NULL || friend_ids == NULL || follow_offsets == NULL ||
+      follows == NULL || brand_name_offsets == NULL || matrix == NULL || users == NULL ||
+      h->section_size[SEC_BRAND_MATRIX] != matrix_bytes ||
+      !snapshot_csr_valid(friend_offsets, n, friend_ids, h->num_friend_ids, n) ||
+      !snapshot_csr_valid(follow_offsets, n, follows, h->num_follows, h->num_brands) ||
+      !snapshot_names_valid(h, names, user_names, brand_name_offsets))
+  {
+    printf("'%s' is damaged\n", file_name);
+    free(users);
+    unmap_file(&mf);
+    return -1;
+  }
+
+  // Brands and the similarity matrix
+  if (alloc_brand_matrix(h->num_brands) != 0 || (uint32_t)brand_row_words != h->brand_row_words)
+  {
+    printf("'%s' has an incompatible brand matrix\n", file_name);
+    free_brand_matrix();
+    free(users);
+    unmap_file(&mf);
+    return -1;
+  }
+  uint32_t built = 0;
+  for (uint32_t b = 0; b < h->num_brands; b++)
+  {
+    if ((brand_names[b] = intern_string(&name_arena, names + brand_name_offsets[b])) == NULL)
+      goto out_of_memory;
+    add_brand_to_index(b);
+  }
+  memcpy(brand_adjacency_matrix, matrix, matrix_bytes);
+
+  // Users, appended to allUsers in stored (name) order
+  FriendNode *tail = NULL;
+  for (; built < n; built++)
   {
-    if (in_friend_list(temp->user->friends, user)) {
-      temp->user->friends = delete_from_friend_list(temp->user->friends, user);
+    uint32_t u = built;
+    User *user = slab_alloc(&user_slab);
+    users[u] = user;
+    if (user == NULL || (user->name = intern_string(&name_arena, names + user_names[u])) == NULL || register_user(user) != 0)
+    {
+      if (user != NULL)
+        slab_free(&user_slab, user);
+      goto out_of_memory;
     }
-    temp = temp->next;
+    index_user_name(user);
+    if (u >= h->num_listed)
+      continue;
+    FriendNode *fn = slab_alloc(&friend_node_slab);
+    if (fn == NULL)
+    {
+      built++; // The user itself is registered
+      goto out_of_memory;
+    }
+    fn->user = user;
+    user->listed = true;
+    if (tail == NULL)
+      allUsers = fn;
+    else
+      tail->next = fn;
+    tail = fn;
   }
-  temp = user->friends;
-  while (temp != NULL) {
-    holder = temp->next;
-    free(temp);
-    temp = holder;
+  reindex_friend_list(&allUsers, &all_users_index);
+
+  // Friend and brand lists, already in order
+  for (uint32_t u = 0; u < n; u++)
+  {
+    FriendNode **next = &users[u]->friends;
+    for (uint32_t k = friend_offsets[u]; k < friend_offsets[u + 1]; k++)
+    {
+      if ((*next = slab_alloc(&friend_node_slab)) == NULL)
+        goto out_of_memory;
+      (*next)->user = users[friend_ids[k]];
+      next = &(*next)->next;
+    }
+    reindex_friend_list(&users[u]->friends, &friend_index[users[u]->id]);
+    BrandNode **next_brand = &users[u]->brands;
+    for (uint32_t k = follow_offsets[u]; k < follow_offsets[u + 1]; k++)
+    {
+      if ((*next_brand = slab_alloc(&brand_node_slab)) == NULL)
+        goto out_of_memory;
+      (*next_brand)->brand_name = brand_names[follows[k]];
+      if (index_brand_follow(users[u], *next_brand) != 0)
+        goto out_of_memory;
+      next_brand = &(*next_brand)->next;
+    }
   }
-  allUsers = delete_from_friend_list(allUsers, user);
-  free(user);
-  return 0;
+  free(users);
+  unmap_file(&mf);
+  invalidate_components();
+  journal_mark_unlogged();
+  graph_version++;
+  return n;
+
+out_of_memory:
+  printf("Not enough memory to restore '%s'\n", file_name);
+  discard_restored_graph(users, built);
+  free(users);
+  unmap_file(&mf);
+  invalidate_components();
+  graph_version++;
+  return -1;
 }
 
+long restore_graph(char *file_name)
+{
+  graph_write_lock();
+  long result = restore_graph_unlocked(file_name);
+  graph_unlock();
+  return result;
+}
 
-int add_friend(User *user, User *friend)
+// Journal files are a sequence of frames (see JournalFrame) in native byte
+// order. A frame that is cut short or fails its checksum ends the journal:
+// it was being written when the process died, and none of it counts.
+// Compaction saves a snapshot and empties the journal; should a crash come
+// between the two, replaying the journal over a snapshot that already
+// holds it does no harm, as every record sets or clears a single thing.
+
+/**
+ * fsyncs the file at path, or the directory holding it if parent is true.
+ * Returns -1 on failure.
+ **/
+int sync_path(const char *path, bool parent)
 {
-  if (user == NULL || friend == NULL)
+  char dir[MAX_STR_LEN] = ".";
+  const char *slash = strrchr(path, '/');
+  if (parent && slash == path)
+  {
+    strcpy(dir, "/");
+  }
+  else if (parent && slash != NULL && slash - path < MAX_STR_LEN)
   {
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+  }
+  int fd = open(parent ? dir : path, O_RDONLY);
+  if (fd < 0)
     return -1;
+  int result = fsync(fd);
+  close(fd);
+  return result;
+}
+
+void *journal_flusher(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&journal.lock);
+  while (true)
+  {
+    bool ready = journal.pending_count > 0 && !journal.unlogged && !journal.failed;
+    if (ready && !journal.stop && journal.sync_waiters == 0 && journal.pending_bytes < JOURNAL_BATCH_BYTES)
+    {
+      // Give the batch a little longer to fill
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += journal_flush_ms * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&journal.work, &journal.lock, &deadline);
+      ready = journal.pending_count > 0 && !journal.unlogged && !journal.failed;
+    }
+    else if (!ready)
+    {
+      if (journal.stop)
+        break;
+      pthread_cond_wait(&journal.work, &journal.lock);
+      continue;
+    }
+    if (!ready)
+      continue;
+
+    // Swap buffers, then write the batch as one frame without the lock
+    char *batch = journal.pending;
+    JournalFrame frame = {JOURNAL_MAGIC, journal.pending_count, journal.pending_bytes, 0};
+    unsigned long upto = journal.appended;
+    journal.pending = journal.spare;
+    journal.spare = batch;
+    size_t cap = journal.pending_cap;
+    journal.pending_cap = journal.spare_cap;
+    journal.spare_cap = cap;
+    journal.pending_bytes = 0;
+    journal.pending_count = 0;
+    journal.flushing = true;
+    pthread_mutex_unlock(&journal.lock);
+
+    frame.checksum = hash_bytes(batch + sizeof(JournalFrame), frame.bytes);
+    memcpy(batch, &frame, sizeof(JournalFrame));
+    size_t size = sizeof(JournalFrame) + frame.bytes;
+    size_t written = 0;
+    while (written < size)
+    {
+      ssize_t w = write(journal.fd, batch + written, size - written);
+      if (w <= 0)
+        break;
+      written += w;
+    }
+    bool ok = written == size && fdatasync(journal.fd) == 0;
+
+    pthread_mutex_lock(&journal.lock);
+    if (!ok)
+    {
+      printf("Could not write the journal, it is no longer written\n");
+      journal.failed = true;
+    }
+    else if (upto > journal.durable)
+    {
+      journal.durable = upto;
+    }
+    journal.flushing = false;
+    pthread_cond_broadcast(&journal.done);
   }
-  else if (strcmp(user->name, friend->name) == 0) {
+  pthread_mutex_unlock(&journal.lock);
+  return NULL;
+}
+
+// Runs of creates, friendships and follows are gathered and applied the
+// way a bulk load is; any other record applies what has been gathered first.
+// A bulk merge costs a pass over every user (or brand), so short runs are
+// applied one at a time instead.
+#define REPLAY_BULK_RATIO 16
+
+typedef struct replay_batch_struct
+{
+  BulkUsers users;
+  KeyBuffer friends;
+  KeyBuffer follows;
+} ReplayBatch;
+
+void apply_replay_batch(ReplayBatch *rb)
+{
+  link_bulk_users(&rb->users);
+  if (rb->friends.count * REPLAY_BULK_RATIO >= (size_t)user_slab.live)
+  {
+    merge_friend_pairs(&rb->friends);
+  }
+  else
+  {
+    for (size_t i = 0; i < rb->friends.count; i++)
+      add_friend_unlocked(user_table[rb->friends.keys[i] >> 32], user_table[rb->friends.keys[i] & 0xffffffff]);
+    rb->friends.count = 0;
+  }
+  if (rb->follows.count * REPLAY_BULK_RATIO >= (size_t)num_brands * num_brands)
+  {
+    merge_brand_follows(&rb->follows);
+  }
+  else
+  {
+    for (size_t i = 0; i < rb->follows.count; i++)
+      follow_brand_unlocked(user_table[rb->follows.keys[i] >> 32], brand_names[rb->follows.keys[i] & 0xffffffff]);
+    rb->follows.count = 0;
+  }
+}
+
+void replay_record(ReplayBatch *rb, int op, char *a, char *b)
+{
+  if (op == JOURNAL_CREATE_USER)
+  {
+    bulk_find_or_create(&rb->users, a);
+    return;
+  }
+  User *user = find_user_unlocked(a);
+  if (op == JOURNAL_ADD_FRIEND)
+  {
+    User *friend = find_user_unlocked(b);
+    if (user != NULL && friend != NULL && user != friend)
+      push_key(&rb->friends, (uint64_t)user->id << 32 | (uint32_t)friend->id);
+    return;
+  }
+  if (op == JOURNAL_FOLLOW_BRAND)
+  {
+    int brand = find_brand_index(b);
+    if (user != NULL && brand >= 0)
+      push_key(&rb->follows, (uint64_t)user->id << 32 | (uint32_t)brand);
+    return;
+  }
+  apply_replay_batch(rb);
+  switch (op)
+  {
+  case JOURNAL_DELETE_USER:
+    delete_user_unlocked(user);
+    break;
+  case JOURNAL_REMOVE_FRIEND:
+    remove_friend_unlocked(user, find_user_unlocked(b));
+    break;
+  case JOURNAL_UNFOLLOW_BRAND:
+    unfollow_brand_unlocked(user, b);
+    break;
+  case JOURNAL_CONNECT_BRANDS:
+    connect_similar_brands_unlocked(a, b);
+    break;
+  case JOURNAL_REMOVE_BRANDS:
+    remove_similar_brands_unlocked(a, b);
+    break;
+  }
+}
+
+/**
+ * Applies the records in a journal file's contents, setting *valid to the
+ * length of its intact frames. Returns the number of records replayed.
+ **/
+long replay_journal(char *data, size_t size, size_t *valid)
+{
+  ReplayBatch rb = {0};
+  long replayed = 0;
+  size_t pos = 0;
+  while (size - pos >= sizeof(JournalFrame))
+  {
+    JournalFrame frame;
+    memcpy(&frame, data + pos, sizeof(JournalFrame));
+    char *p = data + pos + sizeof(JournalFrame);
+    if (frame.magic != JOURNAL_MAGIC || frame.bytes > size - pos - sizeof(JournalFrame) ||
+        hash_bytes(p, frame.bytes) != frame.checksum)
+      break;
+    char *end = p + frame.bytes;
+    while (p < end)
+    {
+      int op = (unsigned char)*p++;
+      char *a = p;
+      char *b = memchr(a, '\0', end - a);
+      if (b == NULL)
+        break;
+      b++;
+      bool two = op == JOURNAL_ADD_FRIEND || op == JOURNAL_REMOVE_FRIEND || op == JOURNAL_FOLLOW_BRAND ||
+                 op == JOURNAL_UNFOLLOW_BRAND || op == JOURNAL_CONNECT_BRANDS || op == JOURNAL_REMOVE_BRANDS;
+      p = b;
+      if (two)
+      {
+        char *nul = memchr(b, '\0', end - b);
+        if (nul == NULL)
+          break;
+        p = nul + 1;
+      }
+      replay_record(&rb, op, a, b);
+      replayed++;
+    }
+    pos += sizeof(JournalFrame) + frame.bytes;
+  }
+  apply_replay_batch(&rb);
+  free(rb.friends.keys);
+  free(rb.follows.keys);
+  *valid = pos;
+  return replayed;
+}
+
+/**
+ * Restores the graph from snapshot_file (if it exists), replays
+ * journal_file over it and keeps appending every mutation to the journal.
+ * A torn frame at the end of the journal is dropped. Returns the number of
+ * records replayed, or -1 on failure.
+ **/
+long open_journal_unlocked(char *snapshot_file, char *journal_file)
+{
+  if (journal.fd >= 0)
+  {
+    printf("A journal is already open\n");
     return -1;
   }
-  else if (in_friend_list(user->friends, friend)) {
+  bool have_snapshot = access(snapshot_file, F_OK) == 0;
+  if (have_snapshot && restore_graph_unlocked(snapshot_file) < 0)
+    return -1;
+  MappedFile mf = {0};
+  if (access(journal_file, F_OK) == 0 && map_file(journal_file, &mf) != 0)
+  {
+    printf("Could not open '%s'\n", journal_file);
     return -1;
   }
-  user->friends = insert_into_friend_list(user->friends, friend);
-  friend->friends = insert_into_friend_list(friend->friends, user);
-  return 0;
+  size_t valid = 0;
+  long replayed = replay_journal(mf.data, mf.size, &valid);
+  unmap_file(&mf);
+
+  int fd = open(journal_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  size_t cap = 2 * JOURNAL_BATCH_BYTES;
+  journal.snapshot_file = strdup(snapshot_file);
+  journal.pending = malloc(cap);
+  journal.spare = malloc(cap);
+  if (fd < 0 || ftruncate(fd, valid) != 0 || journal.snapshot_file == NULL || journal.pending == NULL || journal.spare == NULL)
+  {
+    printf("Could not open '%s'\n", journal_file);
+    goto fail;
+  }
+  journal.fd = fd;
+  journal.pending_cap = journal.spare_cap = cap;
+  journal.pending_bytes = 0;
+  journal.pending_count = 0;
+  journal.appended = journal.durable = 0;
+  journal.failed = journal.stop = journal.flushing = false;
+  // Without a snapshot nothing before the journal is on disk yet
+  journal.unlogged = !have_snapshot;
+  if (pthread_create(&journal.flusher, NULL, journal_flusher, NULL) != 0)
+  {
+    journal.fd = -1;
+    goto fail;
+  }
+  return replayed;
+
+fail:
+  if (fd >= 0)
+    close(fd);
+  free(journal.snapshot_file);
+  free(journal.pending);
+  free(journal.spare);
+  journal.snapshot_file = journal.pending = journal.spare = NULL;
+  return -1;
 }
 
+long open_journal(char *snapshot_file, char *journal_file)
+{
+  graph_write_lock();
+  long result = open_journal_unlocked(snapshot_file, journal_file);
+  graph_unlock();
+  return result;
+}
 
-int remove_friend(User *user, User *friend)
+/**
+ * Saves the graph to the journal's snapshot file (via a temporary file, so
+ * the old snapshot stays whole until the new one is) and empties the
+ * journal, whose records the snapshot now holds. Returns 0 on success.
+ **/
+int compact_journal_unlocked()
 {
-  if (user == NULL || friend == NULL || user->friends == NULL || friend->friends == NULL)
+  if (journal.fd < 0)
+    return -1;
+  char tmp[MAX_STR_LEN];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", journal.snapshot_file) >= (int)sizeof(tmp) ||
+      save_graph_unlocked(tmp) != 0 || sync_path(tmp, false) != 0 ||
+      rename(tmp, journal.snapshot_file) != 0 || sync_path(journal.snapshot_file, true) != 0)
+  {
+    printf("Could not compact the journal into '%s'\n", journal.snapshot_file);
+    return -1;
+  }
+  pthread_mutex_lock(&journal.lock);
+  while (journal.flushing)
+    pthread_cond_wait(&journal.done, &journal.lock);
+  journal.pending_bytes = 0;
+  journal.pending_count = 0;
+  journal.unlogged = false;
+  int result = 0;
+  if (ftruncate(journal.fd, 0) != 0 || fsync(journal.fd) != 0)
   {
+    printf("Could not write the journal, it is no longer written\n");
+    journal.failed = true;
+    result = -1;
+  }
+  journal.durable = journal.appended;
+  pthread_cond_broadcast(&journal.done);
+  pthread_mutex_unlock(&journal.lock);
+  return result;
+}
+
+int compact_journal()
+{
+  graph_write_lock();
+  int result = compact_journal_unlocked();
+  graph_unlock();
+  return result;
+}
+
+/**
+ * Waits until every mutation made so far is on disk: the pending batch is
+ * flushed at once, together with any other mutations that arrive while
+ * waiting (or the journal is compacted after a bulk load). Returns 0 on
+ * success, -1 if the journal can't be written or none is open.
+ **/
+int sync_journal()
+{
+  if (journal.fd < 0)
     return -1;
+  pthread_mutex_lock(&journal.lock);
+  bool unlogged = journal.unlogged;
+  pthread_mutex_unlock(&journal.lock);
+  if (unlogged)
+  {
+    graph_write_lock();
+    if (journal.fd >= 0 && journal.unlogged)
+      compact_journal_unlocked();
+    graph_unlock();
+  }
+  pthread_mutex_lock(&journal.lock);
+  unsigned long target = journal.appended;
+  journal.sync_waiters++;
+  pthread_cond_signal(&journal.work);
+  while (journal.durable < target && !journal.failed && !journal.unlogged)
+    pthread_cond_wait(&journal.done, &journal.lock);
+  journal.sync_waiters--;
+  int result = journal.failed ? -1 : 0;
+  pthread_mutex_unlock(&journal.lock);
+  return result;
+}
+
+/**
+ * Flushes (or compacts) whatever is pending and closes the journal.
+ * Mutations are no longer journalled afterwards.
+ **/
+void close_journal()
+{
+  graph_write_lock();
+  if (journal.fd < 0)
+  {
+    graph_unlock();
+    return;
   }
-  else if (!in_friend_list(user->friends, friend))
+  if (journal.unlogged)
+    compact_journal_unlocked();
+  pthread_mutex_lock(&journal.lock);
+  journal.stop = true;
+  pthread_cond_signal(&journal.work);
+  pthread_mutex_unlock(&journal.lock);
+  pthread_join(journal.flusher, NULL);
+  close(journal.fd);
+  journal.fd = -1;
+  free(journal.snapshot_file);
+  free(journal.pending);
+  free(journal.spare);
+  journal.snapshot_file = journal.pending = journal.spare = NULL;
+  graph_unlock();
+}
+
+// Command server. serve_graph() listens on a Unix domain socket for
+// pipelined requests, each a RequestHeader followed by its names:
+//   'C' create_user(a)                  -> int32 0, or -1
+//   'F' add_friend(a, b)                -> int32 result
+//   'B' follow_brand(a, b)              -> int32 result
+//   'D' get_degrees_of_connection(a, b) -> int32 degrees
+//   'S' get_suggested_friends(a, k)     -> int32 n, then n names
+// A name in a reply is a uint16 length and its bytes. Everything is in
+// native byte order, as the socket is local. Each of a pool of threads
+// serves one connection at a time: it takes every request that has
+// arrived, runs each run of reads under one read lock and hands each run
+// of writes to the writer thread, which applies all the runs queued by
+// every connection under one write lock. The replies to a batch are sent
+// together, in request order.
+#define SERVER_BUFFER (64 * 1024)
+#define SERVER_MAX_SUGGEST 255
+
+typedef struct request_header_struct
+{
+  uint8_t op;
+  uint8_t k;
+  uint16_t len_a;
+  uint16_t len_b;
+} RequestHeader;
+
+typedef struct byte_buffer_struct
+{
+  char *data;
+  size_t len;
+  size_t cap;
+} ByteBuffer;
+
+/**
+ * Makes room for at least len more bytes. Returns -1 if out of memory.
+ **/
+int buffer_reserve(ByteBuffer *b, size_t len)
+{
+  if (b->len + len > b->cap)
   {
+    size_t cap = b->cap == 0 ? SERVER_BUFFER : b->cap;
+    while (cap < b->len + len)
+      cap *= 2;
+    char *grown = realloc(b->data, cap);
+    if (grown == NULL)
+      return -1;
+    b->data = grown;
+    b->cap = cap;
+  }
+  return 0;
+}
+
+int buffer_put(ByteBuffer *b, const void *data, size_t len)
+{
+  if (buffer_reserve(b, len) != 0)
     return -1;
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+  return 0;
+}
+
+int send_all(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+    if (sent <= 0)
+      return -1;
+    data += sent;
+    len -= sent;
   }
-  user->friends = delete_from_friend_list(user->friends, friend);
-  friend->friends = delete_from_friend_list(friend->friends, user);
   return 0;
 }
 
+// A parsed request; a and b are offsets into the batch's name buffer
+typedef struct request_struct
+{
+  int op;
+  int k;
+  size_t a;
+  size_t b;
+  int32_t result;
+} Request;
 
-int follow_brand(User *user, char *brand_name)
+bool request_writes(const Request *r)
+{
+  return r->op == 'C' || r->op == 'F' || r->op == 'B';
+}
+
+// A run of writes from one connection, waiting in the writer queue
+typedef struct write_run_struct
+{
+  Request *requests;
+  int count;
+  const char *names;
+  bool done;
+  struct write_run_struct *next;
+} WriteRun;
+
+typedef struct graph_server_struct
+{
+  int listen_fd;
+  bool stop;        // Set by stop_graph_server(): accept no more connections
+  bool writer_stop; // Set by serve_graph() once no connection can queue writes
+  WriteRun *queue;  // Oldest first
+  WriteRun *queue_tail;
+  pthread_mutex_t lock;
+  pthread_cond_t queued;
+  pthread_cond_t applied;
+} GraphServer;
+
+GraphServer graph_server = {.listen_fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .queued = PTHREAD_COND_INITIALIZER, .applied = PTHREAD_COND_INITIALIZER};
+
+void *server_writer(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&graph_server.lock);
+  while (true)
+  {
+    while (graph_server.queue == NULL && !graph_server.writer_stop)
+      pthread_cond_wait(&graph_server.queued, &graph_server.lock);
+    if (graph_server.queue == NULL)
+      break;
+    WriteRun *runs = graph_server.queue;
+    graph_server.queue = graph_server.queue_tail = NULL;
+    pthread_mutex_unlock(&graph_server.lock);
+
+    graph_write_lock();
+    for (WriteRun *run = runs; run != NULL; run = run->next)
+    {
+      for (int i = 0; i < run->count; i++)
+      {
+        Request *r = &run->requests[i];
+        char *a = (char *)run->names + r->a;
+        char *b = (char *)run->names + r->b;
+        if (r->op == 'C')
+          r->result = create_user_unlocked(a) != NULL ? 0 : -1;
+        else if (r->op == 'F')
+          r->result = add_friend_unlocked(find_user_unlocked(a), find_user_unlocked(b));
+        else
+          r->result = follow_brand_unlocked(find_user_unlocked(a), b);
+      }
+    }
+    graph_unlock();
+
+    pthread_mutex_lock(&graph_server.lock);
+    for (WriteRun *run = runs; run != NULL; run = run->next)
+      run->done = true;
+    pthread_cond_broadcast(&graph_server.applied);
+  }
+  pthread_mutex_unlock(&graph_server.lock);
+  return NULL;
+}
+
+/**
+ * Queues a run of writes for the writer thread and waits until it has
+ * been applied.
+ **/
+void submit_writes(Request *requests, int count, const char *names)
+{
+  WriteRun run = {requests, count, names, false, NULL};
+  pthread_mutex_lock(&graph_server.lock);
+  if (graph_server.queue_tail == NULL)
+    graph_server.queue = &run;
+  else
+    graph_server.queue_tail->next = &run;
+  graph_server.queue_tail = &run;
+  pthread_cond_signal(&graph_server.queued);
+  while (!run.done)
+    pthread_cond_wait(&graph_server.applied, &graph_server.lock);
+  pthread_mutex_unlock(&graph_server.lock);
+}
+
+/**
+ * Runs a run of reads under one read lock, appending their replies.
+ **/
+void run_reads(Request *requests, int count, const char *names, ByteBuffer *out)
+{
+  User *suggested[SERVER_MAX_SUGGEST];
+  graph_read_lock();
+  for (int i = 0; i < count; i++)
+  {
+    Request *r = &requests[i];
+    User *user = find_user_unlocked(names + r->a);
+    if (r->op == 'D')
+    {
+      int32_t degrees = get_degrees_of_connection_unlocked(user, find_user_unlocked(names + r->b));
+      buffer_put(out, &degrees, sizeof(degrees));
+      continue;
+    }
+    int32_t n = r->op == 'S' ? get_suggested_friends_unlocked(user, suggested, r->k) : -1;
+    buffer_put(out, &n, sizeof(n));
+    for (int j = 0; j < n; j++)
+    {
+      uint16_t len = strlen(suggested[j]->name);
+      buffer_put(out, &len, sizeof(len));
+      buffer_put(out, suggested[j]->name, len);
+    }
+  }
+  graph_unlock();
+}
+
+/**
+ * Serves one connection until the client closes it or sends a malformed
+ * request.
+ **/
+void serve_connection(int fd)
+{
+  ByteBuffer in = {0}, out = {0}, names = {0};
+  Request *requests = NULL;
+  int request_cap = 0;
+  // A request is at most a header and two names, so this always fits one
+  while (buffer_reserve(&in, sizeof(RequestHeader) + 2 * MAX_STR_LEN) == 0)
+  {
+    ssize_t got = recv(fd, in.data + in.len, in.cap - in.len, 0);
+    if (got <= 0)
+      break;
+    in.len += got;
+
+    // Parse every complete request
+    size_t pos = 0;
+    int count = 0;
+    bool bad = false;
+    names.len = 0;
+    while (in.len - pos >= sizeof(RequestHeader))
+    {
+      RequestHeader h;
+      memcpy(&h, in.data + pos, sizeof(h));
+      if (h.len_a >= MAX_STR_LEN || h.len_b >= MAX_STR_LEN)
+      {
+        bad = true;
+        break;
+      }
+      if (in.len - pos < sizeof(h) + h.len_a + h.len_b)
+        break;
+      if (count == request_cap)
+      {
+        request_cap = request_cap == 0 ? 1024 : 2 * request_cap;
+        Request *grown = realloc(requests, request_cap * sizeof(Request));
+        if (grown == NULL)
+        {
+          bad = true;
+          break;
+        }
+        requests = grown;
+      }
+      Request *r = &requests[count++];
+      const char *a = in.data + pos + sizeof(h);
+      r->op = h.op;
+      r->k = h.k;
+      r->a = names.len;
+      r->b = names.len + h.len_a + 1;
+      if (buffer_put(&names, a, h.len_a) != 0 || buffer_put(&names, "", 1) != 0 ||
+          buffer_put(&names, a + h.len_a, h.len_b) != 0 || buffer_put(&names, "", 1) != 0)
+      {
+        bad = true;
+        break;
+      }
+      pos += sizeof(h) + h.len_a + h.len_b;
+    }
+    memmove(in.data, in.data + pos, in.len - pos);
+    in.len -= pos;
+
+    out.len = 0;
+    for (int i = 0; i < count;)
+    {
+      int j = i;
+      bool writes = request_writes(&requests[i]);
+      while (j < count && request_writes(&requests[j]) == writes)
+        j++;
+      if (writes)
+      {
+        submit_writes(requests + i, j - i, names.data);
+        for (int w = i; w < j; w++)
+          buffer_put(&out, &requests[w].result, sizeof(int32_t));
+      }
+      else
+      {
+        run_reads(requests + i, j - i, names.data, &out);
+      }
+      i = j;
+    }
+    if (bad || send_all(fd, out.data, out.len) != 0)
+      break;
+  }
+  close(fd);
+  free(in.data);
+  free(out.data);
+  free(names.data);
+  free(requests);
+}
+
+void *server_worker(void *arg)
+{
+  (void)arg;
+  while (true)
+  {
+    int fd = accept(graph_server.listen_fd, NULL, NULL);
+    if (fd < 0)
+    {
+      if (__atomic_load_n(&graph_server.stop, __ATOMIC_ACQUIRE))
+        break;
+      continue;
+    }
+    serve_connection(fd);
+  }
+  free_query_context();
+  return NULL;
+}
+
+/**
+ * Serves the graph on a Unix domain socket at socket_path with
+ * num_threads connection threads (one per CPU if num_threads <= 0) and one
+ * writer thread. Blocks until stop_graph_server() is called and every
+ * open connection has closed. Returns 0, or -1 if it couldn't listen.
+ **/
+int serve_graph(const char *socket_path, int num_threads)
 {
-  int brand_i = get_brand_index(brand_name);
-  if (user == NULL || brand_i == -1)
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path))
   {
+    printf("Socket path '%s' is too long\n", socket_path);
     return -1;
   }
-  else if (in_brand_list(user->brands, brand_name))
+  strcpy(addr.sun_path, socket_path);
+  unlink(socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0)
   {
+    printf("Could not listen on '%s'\n", socket_path);
+    if (fd >= 0)
+      close(fd);
     return -1;
   }
-  user->brands = insert_into_brand_list(user->brands, brand_name);
+  if (num_threads <= 0)
+    num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads <= 0)
+    num_threads = 1;
+  pthread_t *workers = malloc(num_threads * sizeof(pthread_t));
+  pthread_t writer;
+  graph_server.listen_fd = fd;
+  graph_server.stop = false;
+  graph_server.writer_stop = false;
+  if (workers == NULL || pthread_create(&writer, NULL, server_writer, NULL) != 0)
+  {
+    free(workers);
+    close(fd);
+    graph_server.listen_fd = -1;
+    return -1;
+  }
+  int started = 0;
+  for (int t = 0; t < num_threads; t++)
+  {
+    if (pthread_create(&workers[started], NULL, server_worker, NULL) == 0)
+      started++;
+  }
+  if (started == 0)
+    server_worker(NULL);
+  for (int t = 0; t < started; t++)
+    pthread_join(workers[t], NULL);
+
+  // Only now that every connection has closed may the writer go
+  pthread_mutex_lock(&graph_server.lock);
+  graph_server.writer_stop = true;
+  pthread_cond_signal(&graph_server.queued);
+  pthread_mutex_unlock(&graph_server.lock);
+  pthread_join(writer, NULL);
+  free(workers);
+  close(fd);
+  unlink(socket_path);
+  graph_server.listen_fd = -1;
   return 0;
 }
 
+/**
+ * Makes serve_graph() stop accepting connections and return once the open
+ * ones have closed.
+ **/
+void stop_graph_server()
+{
+  __atomic_store_n(&graph_server.stop, true, __ATOMIC_RELEASE);
+  if (graph_server.listen_fd >= 0)
+    shutdown(graph_server.listen_fd, SHUT_RDWR);
+}
 
-int unfollow_brand(User *user, char *brand_name)
+// Load generator for serve_graph(). Every connection keeps depth requests
+// in flight: it sends a window of them in one write, then reads all their
+// replies. The mix is write_percent writes (friendships, plus follows of
+// brand if it isn't NULL) and otherwise 3 degree queries to each suggestion.
+typedef struct load_job_struct
 {
-  if (user == NULL || get_brand_index(brand_name) == -1)
-  {
-    return -1;
-  }
-  user->brands = delete_from_brand_list(user->brands, brand_name);
-  return 0;
+  const char *socket_path;
+  unsigned long long seed;
+  int users;
+  long requests;
+  int depth;
+  int write_percent;
+  const char *brand;
+  long done;
+  long failed; // Requests that returned -1
+} LoadJob;
+
+unsigned long long load_random(unsigned long long *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
 }
 
+void put_request(ByteBuffer *b, int op, int k, const char *a, const char *name_b)
+{
+  RequestHeader h = {op, k, strlen(a), name_b == NULL ? 0 : strlen(name_b)};
+  buffer_put(b, &h, sizeof(h));
+  buffer_put(b, a, h.len_a);
+  buffer_put(b, name_b, h.len_b);
+}
 
-int get_mutual_friends(User *a, User *b)
+// Buffered reads of replies
+typedef struct reply_reader_struct
 {
-  if (a == NULL || b == NULL || a->friends == NULL || b->friends == NULL)
-  {
-    return 0;
-  }
-  int num_friends = 0;
-  FriendNode *a_temp = a->friends;
-  FriendNode *b_temp = b->friends;
-  while (a_temp != NULL)
+  int fd;
+  char buf[SERVER_BUFFER];
+  size_t pos;
+  size_t len;
+} ReplyReader;
+
+int read_reply(ReplyReader *r, void *dest, size_t len)
+{
+  char *d = dest;
+  while (len > 0)
   {
-    while (b_temp != NULL)
+    if (r->pos == r->len)
     {
-      if (strcmp(a_temp->user->name, b_temp->user->name) == 0)
-      {
-        num_friends++;
-      }
-      b_temp = b_temp->next;
+      ssize_t got = recv(r->fd, r->buf, sizeof(r->buf), 0);
+      if (got <= 0)
+        return -1;
+      r->pos = 0;
+      r->len = got;
     }
-    b_temp = b->friends;
-    a_temp = a_temp->next;
+    size_t n = r->len - r->pos < len ? r->len - r->pos : len;
+    memcpy(d, r->buf + r->pos, n);
+    r->pos += n;
+    d += n;
+    len -= n;
   }
-  return num_friends;
+  return 0;
 }
 
-
-void massReset() {
-  FriendNode *temp = allUsers;
-  while (temp != NULL) {
-    if (temp->user->visited) {
-      temp->user->visited = false;
-    }
-    temp = temp->next;
+int connect_graph_server(const char *socket_path)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+  {
+    close(fd);
+    fd = -1;
   }
-  return;
+  return fd;
 }
 
-int numUsers(){
-  int count = 0;
-  FriendNode *temp = allUsers;
-  while(temp != NULL) {
-    count++;
-    temp = temp->next;
+void *load_worker(void *arg)
+{
+  LoadJob *job = arg;
+  ReplyReader *r = malloc(sizeof(ReplyReader));
+  char *ops = malloc(job->depth);
+  ByteBuffer out = {0};
+  char a[32], b[32], name[MAX_STR_LEN];
+  if (r == NULL || ops == NULL || (r->fd = connect_graph_server(job->socket_path)) < 0)
+  {
+    free(r);
+    free(ops);
+    return NULL;
   }
-  return count;
-}
-
-int checkQueue(User **queue, User *user, int total) {
-  int i = 0;
-  while (queue[i] != NULL && i < total) {
-    if (strcmp(user->name, queue[i]->name) == 0) {
-      return -1;
+  r->pos = r->len = 0;
+  while (job->done < job->requests)
+  {
+    int window = job->requests - job->done < job->depth ? job->requests - job->done : job->depth;
+    out.len = 0;
+    for (int i = 0; i < window; i++)
+    {
+      snprintf(a, sizeof(a), "load%d", (int)(load_random(&job->seed) % job->users));
+      snprintf(b, sizeof(b), "load%d", (int)(load_random(&job->seed) % job->users));
+      int roll = load_random(&job->seed) % 100;
+      if (roll < job->write_percent)
+        ops[i] = job->brand != NULL && roll % 4 == 0 ? 'B' : 'F';
+      else
+        ops[i] = roll % 4 == 0 ? 'S' : 'D';
+      put_request(&out, ops[i], 10, a, ops[i] == 'B' ? job->brand : ops[i] == 'S' ? NULL : b);
     }
-    i++;
-  }
-  if (i == total -1) {
-    return -1;
-  }
-  return i;
-}
-
-int addToQueue(FriendNode *currentFriends, User **queue, int total) {
-  FriendNode *temp = currentFriends;
-  int num;
-  int count = 0;
-  while (temp != NULL) {
-    if (!temp->user->visited) {
-      num = checkQueue(queue, temp->user, total);
-      if (num != -1) {
-        temp->user->visited = true;
-        queue[num] = temp->user;
-        count++;
+    if (send_all(r->fd, out.data, out.len) != 0)
+      break;
+    for (int i = 0; i < window; i++)
+    {
+      int32_t result;
+      if (read_reply(r, &result, sizeof(result)) != 0)
+        goto done;
+      if (result < 0 && ops[i] != 'D')
+        job->failed++;
+      for (int j = 0; ops[i] == 'S' && j < result; j++)
+      {
+        uint16_t len;
+        if (read_reply(r, &len, sizeof(len)) != 0 || len >= MAX_STR_LEN || read_reply(r, name, len) != 0)
+          goto done;
       }
     }
-    temp = temp->next;
+    job->done += window;
   }
-  return count;
+done:
+  close(r->fd);
+  free(r);
+  free(ops);
+  free(out.data);
+  return NULL;
 }
 
-User* removeFirstFromQueue(User **queue, int total) {
-  int i = 0;
-  User *holder = queue[0];
-  while (i + 1 < total) {
-    queue[i] = queue[i + 1];
-    i++;
+/**
+ * Drives the server at socket_path: creates users named load0..load<users>
+ * with 4 random friendships each, then sends requests from connections
+ * connections at once, depth in flight on each, and prints the throughput.
+ * Returns the number of requests completed, or -1 if the server can't be
+ * reached.
+ **/
+long run_load_generator(const char *socket_path, int connections, int users, long requests, int depth, int write_percent, const char *brand)
+{
+  if (connections <= 0 || users <= 0 || depth <= 0)
+    return -1;
+  ByteBuffer setup = {0};
+  char a[32], b[32];
+  unsigned long long seed = 88172645463325252ULL;
+  for (int i = 0; i < users; i++)
+  {
+    snprintf(a, sizeof(a), "load%d", i);
+    put_request(&setup, 'C', 0, a, NULL);
   }
-  return holder;
-}
-
-void fillQueueLength(int *queueLength, int total) {
-  for(int i = 0; i < total; i++) {
-    queueLength[i] = 0;
+  for (long i = 0; i < 4L * users; i++)
+  {
+    snprintf(a, sizeof(a), "load%d", (int)(load_random(&seed) % users));
+    snprintf(b, sizeof(b), "load%d", (int)(load_random(&seed) % users));
+    put_request(&setup, 'F', 0, a, b);
   }
-  return;
-}
-
-int bfs(FriendNode *currentFriends, User** queue, User *b, int total) {
-  int i = 1;
-  int count = 1;
-  int final = -1;
-  int queueLength[total];
-  int segment;
-  fillQueueLength(queueLength, total);
-  User *current = NULL;
-  segment = addToQueue(currentFriends, queue, total);
-  queueLength[0] = segment;
-
-  while(queue[0] != NULL) {
-    current = removeFirstFromQueue(queue, total);
-    if(current != NULL) {
-      if (segment == 0) {
-        count++;
-        segment = queueLength[i];
-        i++;
-      }
-      if (in_friend_list(current->friends, b)) {
-        final = count + 1;
-        break;
-      }
-      queueLength[i] = queueLength[i] + addToQueue(current->friends, queue, total);
+  ReplyReader *r = malloc(sizeof(ReplyReader));
+  int fd = connect_graph_server(socket_path);
+  if (r == NULL || fd < 0)
+  {
+    printf("Could not connect to '%s'\n", socket_path);
+    free(r);
+    free(setup.data);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  // Send the setup in windows so neither side's socket buffer fills up
+  r->fd = fd;
+  r->pos = r->len = 0;
+  long sent = 0;
+  long total = users + 4L * users;
+  size_t pos = 0;
+  while (sent < total)
+  {
+    size_t start = pos;
+    long window = 0;
+    for (; window < 4096 && sent + window < total; window++)
+    {
+      RequestHeader h;
+      memcpy(&h, setup.data + pos, sizeof(h));
+      pos += sizeof(h) + h.len_a + h.len_b;
     }
-    segment--;
+    int32_t result;
+    if (send_all(fd, setup.data + start, pos - start) != 0)
+      break;
+    for (long i = 0; i < window && read_reply(r, &result, sizeof(result)) == 0; i++)
+      ;
+    sent += window;
   }
-  return final;
-}
+  close(fd);
+  free(r);
+  free(setup.data);
 
-int get_degrees_of_connection(User *a, User *b)
-{
-  if (a == NULL || b == NULL || a->friends == NULL || b->friends == NULL)
+  LoadJob *jobs = calloc(connections, sizeof(LoadJob));
+  pthread_t *threads = malloc(connections * sizeof(pthread_t));
+  if (jobs == NULL || threads == NULL)
   {
+    free(jobs);
+    free(threads);
     return -1;
   }
-  else if (strcmp(a->name, b->name) == 0) {
-    return 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int started = 0;
+  for (int c = 0; c < connections; c++)
+  {
+    jobs[c] = (LoadJob){socket_path, seed + c * 0x9E3779B97F4A7C15ULL, users, requests / connections + (c < requests % connections), depth, write_percent, brand, 0, 0};
+    if (pthread_create(&threads[started], NULL, load_worker, &jobs[c]) == 0)
+      started++;
   }
-  else if (in_friend_list(a->friends, b)) {
-    return 1;
+  long done = 0, failed = 0;
+  for (int c = 0; c < started; c++)
+  {
+    pthread_join(threads[c], NULL);
   }
-  int total = numUsers();
-  User *queue[total];
-  for (int i = 0; i < total; i++) {
-    queue[i] = NULL;
+  for (int c = 0; c < connections; c++)
+  {
+    done += jobs[c].done;
+    failed += jobs[c].failed;
   }
-  massReset();
-  a->visited = true;
-  return bfs(a->friends, queue, b, total);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%ld requests (%ld failed) on %d connections in %.3fs: %.0f ops/s\n", done, failed, connections, seconds,
+         seconds > 0 ? done / seconds : 0.0);
+  free(jobs);
+  free(threads);
+  return done;
 }
 
+// Synthetic benchmark. run_benchmark() builds a friend graph with the bulk
+// loaders, either Erdos-Renyi (degree * users / 2 friendships between
+// uniformly random users) or Barabasi-Albert (each user befriends degree / 2
+// earlier users, picked in proportion to their degree). Each user follows
+// 1-5 of brands generated brands, picked by Zipf's law (s = 1), and each
+// brand is similar to BENCH_SIMILAR random others. Then it times samples
+// calls of each operation, one at a time, and writes a row per operation
+// with its throughput, latency percentiles and the memory in use.
+#define BENCH_SIMILAR 4
 
-void connect_similar_brands(char *brandNameA, char *brandNameB)
+enum
 {
-  int a_idx = get_brand_index(brandNameA);
-  int b_idx = get_brand_index(brandNameB);
-  if (a_idx == -1 || b_idx == -1)
-  {
-    return;
-  }
-  brand_adjacency_matrix[a_idx][b_idx] = 1;
-  brand_adjacency_matrix[b_idx][a_idx] = 1;
-  return;
-}
+  BENCH_ERDOS_RENYI,
+  BENCH_BARABASI_ALBERT
+};
 
+enum
+{
+  BENCH_CSV,
+  BENCH_JSON
+};
 
-void remove_similar_brands(char *brandNameA, char *brandNameB)
+typedef struct bench_report_struct
 {
-  int a_idx = get_brand_index(brandNameA);
-  int b_idx = get_brand_index(brandNameB);
-  if (a_idx == -1 || b_idx == -1)
-  {
-    return;
-  }
-  brand_adjacency_matrix[a_idx][b_idx] = 0;
-  brand_adjacency_matrix[b_idx][a_idx] = 0;
-  return;
+  FILE *out;
+  int format;
+  int rows;
+  const char *model;
+  long users;
+  int degree;
+  int brands;
+} BenchReport;
+
+long long bench_now_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
 }
 
+double bench_uniform(unsigned long long *state)
+{
+  return (load_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
 
-int get_sim_brands_user(User *user, User *other)
+/**
+ * Picks a brand index with probability proportional to 1 / (rank + 1), by
+ * binary search in cdf (the running sums of those weights, normalized).
+ **/
+int bench_zipf(const double *cdf, int n, unsigned long long *state)
 {
-  if (user == NULL || other == NULL)
-  {
-    return 0;
-  }
-  int sim_brands = 0;
-  BrandNode *brand = other->brands;
-  while (brand != NULL && user->brands != NULL)
+  double u = bench_uniform(state);
+  int lo = 0, hi = n - 1;
+  while (lo < hi)
   {
-    if (in_brand_list(user->brands, brand->brand_name))
-    {
-      sim_brands++;
-    }
-    brand = brand->next;
+    int mid = (lo + hi) / 2;
+    if (cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  return sim_brands;
+  return lo;
 }
 
-User *get_suggested_friend(User *user)
+/**
+ * Writes one row. latency holds count per-call times in nanoseconds (it is
+ * sorted here), or is NULL for a phase timed as a whole.
+ **/
+void bench_report(BenchReport *r, const char *op, long count, long long ns, uint64_t *latency)
 {
-  if (user == NULL)
-  {
-    return NULL;
-  }
-  User *most_sim = NULL;
-  FriendNode *temp = allUsers;
-  int sim_brands = 0;
-  int current_user = 0;
-  while (temp != NULL)
+  uint64_t pct[5] = {0};
+  if (latency != NULL && count > 0)
   {
-    current_user = get_sim_brands_user(user, temp->user);
-    if (current_user >= sim_brands && strcmp(temp->user->name, user->name) != 0 && !in_friend_list(user->friends, temp->user))
+    uint64_t *tmp = malloc(count * sizeof(uint64_t));
+    if (tmp != NULL)
     {
-      if (current_user == sim_brands && most_sim != NULL && strcmp(temp->user->name, most_sim->name) > 0) {
-        most_sim = temp->user;
-      }
-      else {
-        sim_brands = current_user;
-        most_sim = temp->user;
-      }
+      radix_sort_u64(latency, tmp, count);
+      free(tmp);
     }
-    temp = temp->next;
+    const double at[5] = {0.5, 0.9, 0.99, 0.999, 1.0};
+    for (int i = 0; i < 5; i++)
+      pct[i] = latency[(size_t)(at[i] * (count - 1))];
   }
-  return most_sim;
-}
+  size_t user_bytes, edge_bytes, follow_bytes;
+  memory_usage(&user_bytes, &edge_bytes, &follow_bytes);
+  size_t graph_bytes = user_bytes + edge_bytes + follow_bytes + (size_t)num_brands * brand_row_words * sizeof(uint64_t);
+  long rss_kb = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm != NULL)
+  {
+    long pages;
+    if (fscanf(statm, "%*s %ld", &pages) == 1)
+      rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    fclose(statm);
+  }
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  double seconds = ns / 1e9;
+  double rate = seconds > 0 ? count / seconds : 0.0;
 
-// Adds a suggested friend based off of the number of similar brands shared
-int add_suggested_friends(User *user, int n)
-{
-  if (user == NULL || n <= 0)
+  if (r->format == BENCH_JSON)
   {
-    return 0;
+    fprintf(r->out, "%s\n  {\"model\": \"%s\", \"users\": %ld, \"degree\": %d, \"brands\": %d, \"op\": \"%s\", \"calls\": %ld, "
+                    "\"seconds\": %.6f, \"ops_per_sec\": %.1f, ",
+            r->rows == 0 ? "[" : ",", r->model, r->users, r->degree, r->brands, op, count, seconds, rate);
+    if (latency != NULL)
+      fprintf(r->out, "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, ",
+              (unsigned long long)pct[0], (unsigned long long)pct[1], (unsigned long long)pct[2], (unsigned long long)pct[3], (unsigned long long)pct[4]);
+    else
+      fprintf(r->out, "\"p50_ns\": null, \"p90_ns\": null, \"p99_ns\": null, \"p999_ns\": null, \"max_ns\": null, ");
+    fprintf(r->out, "\"graph_bytes\": %zu, \"rss_kb\": %ld, \"peak_rss_kb\": %ld}", graph_bytes, rss_kb, ru.ru_maxrss);
   }
-  int count = 0;
-  User *toAdd = get_suggested_friend(user);
-  while (toAdd != NULL && count < n)
+  else
   {
-    add_friend(user, toAdd);
-    toAdd = get_suggested_friend(user);
-    count++;
+    if (r->rows == 0)
+      fprintf(r->out, "model,users,degree,brands,op,calls,seconds,ops_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,graph_bytes,rss_kb,peak_rss_kb\n");
+    fprintf(r->out, "%s,%ld,%d,%d,%s,%ld,%.6f,%.1f,", r->model, r->users, r->degree, r->brands, op, count, seconds, rate);
+    if (latency != NULL)
+      fprintf(r->out, "%llu,%llu,%llu,%llu,%llu,", (unsigned long long)pct[0], (unsigned long long)pct[1], (unsigned long long)pct[2],
+              (unsigned long long)pct[3], (unsigned long long)pct[4]);
+    else
+      fprintf(r->out, ",,,,,");
+    fprintf(r->out, "%zu,%ld,%ld\n", graph_bytes, rss_kb, ru.ru_maxrss);
   }
-  return count;
+  r->rows++;
+  fflush(r->out);
 }
 
-int sim_brand_num(BrandNode *head, char *brand)
+/**
+ * Makes the benchmark's brands: brands brand0..brand<brands - 1>, each
+ * similar to BENCH_SIMILAR random others. Returns 0, or -1 if out of memory.
+ **/
+int bench_make_brands(int brands, unsigned long long *seed)
 {
-  if (head == NULL)
+  if (alloc_brand_matrix(brands) != 0)
+    return -1;
+  char name[32];
+  for (int i = 0; i < brands; i++)
   {
-    return 0;
-  };
-  int num = 0;
-  int brand_idx = get_brand_index(brand);
-  int u_brand_idx;
-  BrandNode *temp = head;
-  while (temp != NULL)
+    snprintf(name, sizeof(name), "brand%d", i);
+    brand_names[i] = intern_string(&name_arena, name);
+    if (brand_names[i] == NULL)
+      return -1;
+    add_brand_to_index(i);
+  }
+  for (int i = 0; brands > 1 && i < brands; i++)
   {
-    u_brand_idx = get_brand_index(temp->brand_name);
-    if (brand_adjacency_matrix[u_brand_idx][brand_idx] == 1)
+    for (int j = 0; j < BENCH_SIMILAR; j++)
     {
-      num++;
-    }
-    temp = temp->next;
-  };
-  return num;
-}
-
-bool in_brand_array(char brands_to_add[MAT_SIZE][MAX_STR_LEN], char* brand) {
-  for (int i = 0; i < MAT_SIZE; i++) {
-    if (strcmp(brand, brands_to_add[i]) == 0) {
-      return true;
+      int other = load_random(seed) % brands;
+      if (other != i)
+        set_brands_similar(i, other, true);
     }
   }
-  return false;
+  return rebuild_brand_followers();
 }
 
-void fill_brand_rec(User *user, char brands_to_add[MAT_SIZE][MAX_STR_LEN])
+/**
+ * Adds the benchmark's friendships between the users (by index into users)
+ * to pairs. Returns 0, or -1 if out of memory.
+ **/
+int bench_make_friends(KeyBuffer *pairs, User **users, long n, int model, int degree, unsigned long long *seed)
 {
-  if (user == NULL)
+  if (model == BENCH_ERDOS_RENYI)
   {
-    return;
+    for (long e = 0; e < n * degree / 2; e++)
+    {
+      long a = load_random(seed) % n;
+      long b = load_random(seed) % n;
+      if (a != b && push_key(pairs, (uint64_t)users[a]->id << 32 | (uint32_t)users[b]->id) != 0)
+        return -1;
+    }
+    return 0;
   }
-  BrandNode *temp = user->brands;
-  char *newBrand = NULL;
-  int sim_brands = -1;
-  int num;
-  for (int j = 0; j < MAT_SIZE; j++)
+  // Every friendship puts both ends in ends, so a uniform pick from it is a
+  // pick in proportion to degree
+  int m = degree / 2 > 0 ? degree / 2 : 1;
+  long *ends = malloc(2 * (n * m + 1) * sizeof(long));
+  long num_ends = 0;
+  if (ends == NULL)
+    return -1;
+  for (long v = 1; v < n; v++)
   {
-    if (!in_brand_list(temp, brand_names[j]) && strcmp(brand_names[j], "") != 0 && !in_brand_array(brands_to_add, brand_names[j]))
+    for (int j = 0; j < m; j++)
     {
-      num = sim_brand_num(temp, brand_names[j]);
-      if (num > sim_brands) {
-        sim_brands = num;
-        newBrand = brand_names[j];
-      }
-      else if (num == sim_brands && strcmp(brand_names[j], newBrand) > 0) {
-        newBrand = brand_names[j];
+      long u = v <= m || num_ends == 0 ? (long)(load_random(seed) % v) : ends[load_random(seed) % num_ends];
+      if (push_key(pairs, (uint64_t)users[v]->id << 32 | (uint32_t)users[u]->id) != 0)
+      {
+        free(ends);
+        return -1;
       }
+      ends[num_ends++] = u;
+      ends[num_ends++] = v;
     }
   }
-  if (newBrand != NULL) {
-    for(int k = 0; k < MAT_SIZE; k++) {
-      if (strcmp(brands_to_add[k], "") == 0) {
-        strcpy(brands_to_add[k], newBrand);
-        break;
-      }
-    }
+  free(ends);
+  return 0;
+}
+
+// One benchmarked call on users a and b
+typedef void (*BenchFn)(User *a, User *b);
+
+long bench_created; // Users made by bench_create_user
+
+void bench_create_user(User *a, User *b)
+{
+  (void)a;
+  (void)b;
+  char name[32];
+  snprintf(name, sizeof(name), "bench%ld", bench_created++);
+  create_user(name);
+}
+
+void bench_add_friend(User *a, User *b)
+{
+  add_friend(a, b);
+}
+
+void bench_mutual_friends(User *a, User *b)
+{
+  get_mutual_friends(a, b);
+}
+
+void bench_degrees(User *a, User *b)
+{
+  get_degrees_of_connection(a, b);
+}
+
+void bench_suggested_friend(User *a, User *b)
+{
+  (void)b;
+  get_suggested_friend(a);
+}
+
+void bench_follow_suggested(User *a, User *b)
+{
+  (void)b;
+  follow_suggested_brands(a, 1);
+}
+
+void bench_delete_user(User *a, User *b)
+{
+  (void)b;
+  delete_user(a);
+}
+
+/**
+ * Times samples calls of fn and reports them as op. Each call gets two
+ * random users from users, or with in_order the i'th user as a.
+ **/
+void bench_time(BenchReport *r, const char *op, BenchFn fn, User **users, long n, long samples, bool in_order,
+                unsigned long long *seed, uint64_t *latency)
+{
+  long long start = bench_now_ns();
+  for (long i = 0; i < samples; i++)
+  {
+    User *a = users[in_order ? i : (long)(load_random(seed) % n)];
+    User *b = users[load_random(seed) % n];
+    long long t = bench_now_ns();
+    fn(a, b);
+    latency[i] = bench_now_ns() - t;
   }
-  return;
+  bench_report(r, op, samples, bench_now_ns() - start, latency);
 }
 
-// follows n suggested brands based off of the brands the user currently follows
-// performed in reverse-alphanumeric order
-int follow_suggested_brands(User *user, int n)
+/**
+ * Builds the graph described above into an empty graph and writes the
+ * build time and the timings of create_user, add_friend,
+ * get_mutual_friends, get_degrees_of_connection, get_suggested_friend,
+ * follow_suggested_brands and delete_user to out, as CSV or JSON (format
+ * BENCH_CSV or BENCH_JSON). Every operation gets samples calls on random
+ * users. Returns 0, or -1 for bad arguments, a graph that isn't empty or
+ * too little memory.
+ **/
+int run_benchmark(FILE *out, int format, int model, long users, int degree, int brands, long samples)
 {
-  if (user == NULL || n <= 0)
+  if (users < 2 || users > INT32_MAX || degree < 0 || brands <= 0 || samples <= 0 ||
+      (model != BENCH_ERDOS_RENYI && model != BENCH_BARABASI_ALBERT))
+    return -1;
+  if (user_slab.live > 0)
   {
-    return 0;
+    printf("Can only benchmark an empty graph\n");
+    return -1;
   }
-  int count = 0;
-  char brands_to_add[MAT_SIZE][MAX_STR_LEN];
-  for (int i = 0; i < MAT_SIZE; i++)
+  BenchReport report = {out, format, 0, model == BENCH_ERDOS_RENYI ? "erdos_renyi" : "barabasi_albert", users, degree, brands};
+  unsigned long long seed = 88172645463325252ULL;
+  User **by_index = malloc(users * sizeof(User *));
+  uint64_t *latency = malloc(samples * sizeof(uint64_t));
+  double *cdf = malloc(brands * sizeof(double));
+  BulkUsers bu = {0};
+  KeyBuffer keys = {0};
+  char name[32];
+  int result = -1;
+  if (by_index == NULL || latency == NULL || cdf == NULL)
+    goto done;
+  double sum = 0;
+  for (int i = 0; i < brands; i++)
+    cdf[i] = sum += 1.0 / (i + 1);
+  for (int i = 0; i < brands; i++)
+    cdf[i] /= sum;
+
+  // Build with the bulk loaders, which is the only way to reach 10M users
+  // in reasonable time
+  graph_write_lock();
+  long long start = bench_now_ns();
+  bool built = bench_make_brands(brands, &seed) == 0;
+  for (long i = 0; built && i < users; i++)
+  {
+    snprintf(name, sizeof(name), "user%ld", i);
+    by_index[i] = bulk_find_or_create(&bu, name);
+    built = by_index[i] != NULL;
+  }
+  link_bulk_users(&bu);
+  built = built && bench_make_friends(&keys, by_index, users, model, degree, &seed) == 0;
+  long edges = built ? merge_friend_pairs(&keys) : -1;
+  built = edges >= 0;
+  for (long i = 0; built && i < users; i++)
   {
-    strcpy(brands_to_add[i], "");
+    for (int f = 1 + load_random(&seed) % 5; built && f > 0; f--)
+      built = push_key(&keys, (uint64_t)by_index[i]->id << 32 | (uint32_t)bench_zipf(cdf, brands, &seed)) == 0;
   }
-  for (int j = 0; j < n; j++) {
-    fill_brand_rec(user, brands_to_add);
+  long follows = built ? merge_brand_follows(&keys) : -1;
+  long long build_ns = bench_now_ns() - start;
+  graph_unlock();
+  if (follows < 0)
+  {
+    printf("Not enough memory to build %ld users\n", users);
+    goto done;
   }
-  while (n > 0 && strcmp(brands_to_add[count], "") != 0) {
-    user->brands = insert_into_brand_list(user->brands, brands_to_add[count]);
-    n--;
-    count++;
+  bench_report(&report, "build", users + edges + follows, build_ns, NULL);
+
+  bench_created = 0;
+  bench_time(&report, "create_user", bench_create_user, by_index, users, samples, false, &seed, latency);
+  bench_time(&report, "add_friend", bench_add_friend, by_index, users, samples, false, &seed, latency);
+  bench_time(&report, "get_mutual_friends", bench_mutual_friends, by_index, users, samples, false, &seed, latency);
+  bench_time(&report, "get_degrees_of_connection", bench_degrees, by_index, users, samples, false, &seed, latency);
+  bench_time(&report, "get_suggested_friend", bench_suggested_friend, by_index, users, samples, false, &seed, latency);
+  bench_time(&report, "follow_suggested_brands", bench_follow_suggested, by_index, users, samples, false, &seed, latency);
+
+  // Each user can only be deleted once, so shuffle a sample to the front
+  if (samples > users)
+    samples = users;
+  for (long i = 0; i < samples; i++)
+  {
+    long j = i + load_random(&seed) % (users - i);
+    User *tmp = by_index[i];
+    by_index[i] = by_index[j];
+    by_index[j] = tmp;
   }
-  return count;
+  bench_time(&report, "delete_user", bench_delete_user, by_index, users, samples, true, &seed, latency);
+  result = 0;
+
+done:
+  // A failed build still leaves a well-formed (empty) JSON array
+  if (format == BENCH_JSON)
+    fprintf(out, report.rows == 0 ? "[]\n" : "\n]\n");
+  free(by_index);
+  free(latency);
+  free(cdf);
+  free(bu.users);
+  free(keys.keys);
+  return result;
 }
@@ -0,0 +1,209 @@
+/**
+ * Crash and recovery driver for the journal and binary snapshots in
+ * graffit.c.
+ *
+ * A child process opens a fresh journal, applies a few thousand random
+ * mutations (with one compaction part way), syncs, writes down the graph
+ * it ended up with and exits without closing the journal, as if it had
+ * crashed. The parent then checks that damaged snapshots (truncated, or
+ * with an oversized section) are refused with -1, replays the journal and
+ * compares the graph with the child's. Build it with
+ *   gcc -g -fsanitize=address -pthread j_driver.c -o j_driver
+ * and run it from this folder, next to brands.txt.
+ */
+
+#include "graffit.c"
+#include <sys/wait.h>
+
+#define NUM_USERS 300
+#define NUM_OPS 6000
+
+#define SNAP_FILE "j_driver.snap"
+#define JOURNAL_FILE "j_driver.journal"
+#define COPY_FILE "j_driver.copy"
+#define BAD_FILE "j_driver.bad"
+#define EXPECT_FILE "j_driver.expect"
+#define GOT_FILE "j_driver.got"
+
+/**
+ * Writes every user with their friends and brands, then the similar brand
+ * pairs, to file_name.
+ **/
+void dump_graph(const char *file_name)
+{
+  FILE *f = fopen(file_name, "w");
+  for (FriendNode *u = allUsers; u != NULL; u = u->next)
+  {
+    fprintf(f, "%s:", u->user->name);
+    for (FriendNode *fr = u->user->friends; fr != NULL; fr = fr->next)
+      fprintf(f, " %s", fr->user->name);
+    fprintf(f, " |");
+    for (BrandNode *b = u->user->brands; b != NULL; b = b->next)
+      fprintf(f, " %s", b->brand_name);
+    fprintf(f, "\n");
+  }
+  for (int x = 0; x < num_brands; x++)
+  {
+    for (int y = 0; y < num_brands; y++)
+    {
+      if (brands_similar(x, y))
+        fprintf(f, "%s~%s\n", brand_names[x], brand_names[y]);
+    }
+  }
+  fclose(f);
+}
+
+bool same_files(const char *a, const char *b)
+{
+  MappedFile fa, fb;
+  if (map_file(a, &fa) != 0)
+    return false;
+  if (map_file(b, &fb) != 0)
+  {
+    unmap_file(&fa);
+    return false;
+  }
+  bool same = fa.size == fb.size && (fa.size == 0 || memcmp(fa.data, fb.data, fa.size) == 0);
+  unmap_file(&fa);
+  unmap_file(&fb);
+  return same;
+}
+
+/**
+ * Writes the first size bytes of from to to, then extra zero bytes.
+ **/
+void copy_file(const char *from, const char *to, size_t size, size_t extra)
+{
+  MappedFile mf;
+  map_file(from, &mf);
+  FILE *f = fopen(to, "wb");
+  fwrite(mf.data, 1, size < mf.size ? size : mf.size, f);
+  for (size_t i = 0; i < extra; i++)
+    fputc(0, f);
+  fclose(f);
+  unmap_file(&mf);
+}
+
+User *random_user(unsigned int *seed)
+{
+  char name[16];
+  sprintf(name, "user%03d", rand_r(seed) % NUM_USERS);
+  return find_user(name);
+}
+
+void apply_random_ops(unsigned int *seed, int count)
+{
+  char name[16];
+  for (int i = 0; i < count; i++)
+  {
+    int op = rand_r(seed) % 100;
+    User *a = random_user(seed);
+    User *b = random_user(seed);
+    char *brand = brand_names[rand_r(seed) % num_brands];
+    char *other = brand_names[rand_r(seed) % num_brands];
+    if (op < 10)
+    {
+      sprintf(name, "user%03d", rand_r(seed) % NUM_USERS);
+      create_user(name);
+    }
+    else if (op < 14)
+      delete_user(a);
+    else if (op < 60)
+      add_friend(a, b);
+    else if (op < 70)
+      remove_friend(a, b);
+    else if (op < 85)
+      follow_brand(a, brand);
+    else if (op < 92)
+      unfollow_brand(a, brand);
+    else if (op < 96)
+      connect_similar_brands(brand, other);
+    else
+      remove_similar_brands(brand, other);
+  }
+}
+
+/**
+ * The child: mutates the graph through the journal and "crashes".
+ **/
+void run_writer()
+{
+  if (open_journal(SNAP_FILE, JOURNAL_FILE) < 0)
+    _exit(1);
+  populate_brand_matrix("brands.txt");
+  char name[16];
+  for (int i = 0; i < NUM_USERS / 2; i++)
+  {
+    sprintf(name, "user%03d", i);
+    create_user(name);
+  }
+  unsigned int seed = 12345;
+  apply_random_ops(&seed, NUM_OPS / 3);
+  if (compact_journal() != 0)
+    _exit(1);
+  apply_random_ops(&seed, NUM_OPS - NUM_OPS / 3);
+  if (sync_journal() != 0 || save_graph(COPY_FILE) != 0)
+    _exit(1);
+  dump_graph(EXPECT_FILE);
+  _exit(0); // No close_journal(), so nothing is compacted
+}
+
+int main()
+{
+  const char *files[] = {SNAP_FILE, JOURNAL_FILE, COPY_FILE, BAD_FILE, EXPECT_FILE, GOT_FILE};
+  for (int i = 0; i < 6; i++)
+    unlink(files[i]);
+  int failures = 0;
+
+  pid_t child = fork();
+  if (child == 0)
+    run_writer();
+  int status;
+  if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    printf("The writer failed\n");
+    return 1;
+  }
+
+  // A truncated snapshot, then one whose brand matrix claims more bytes
+  // than the matrix holds, must both be refused without touching the graph
+  MappedFile mf;
+  map_file(COPY_FILE, &mf);
+  size_t size = mf.size;
+  SnapshotHeader h = *(const SnapshotHeader *)mf.data;
+  unmap_file(&mf);
+  copy_file(COPY_FILE, BAD_FILE, size / 2, 0);
+  if (restore_graph(BAD_FILE) != -1 || user_slab.live != 0)
+  {
+    printf("FAIL: truncated snapshot was restored\n");
+    failures++;
+  }
+  copy_file(COPY_FILE, BAD_FILE, size, 4096);
+  h.section_size[SEC_BRAND_MATRIX] += 4096;
+  FILE *f = fopen(BAD_FILE, "r+b");
+  fwrite(&h, sizeof(h), 1, f);
+  fclose(f);
+  if (restore_graph(BAD_FILE) != -1 || user_slab.live != 0)
+  {
+    printf("FAIL: oversized brand matrix was restored\n");
+    failures++;
+  }
+
+  // Replay the snapshot and journal the writer left behind
+  long replayed = open_journal(SNAP_FILE, JOURNAL_FILE);
+  dump_graph(GOT_FILE);
+  if (replayed <= 0 || !same_files(EXPECT_FILE, GOT_FILE))
+  {
+    printf("FAIL: replaying %ld records did not rebuild the graph\n", replayed);
+    failures++;
+  }
+  close_journal();
+
+  if (failures == 0)
+  {
+    printf("Replayed %ld journal records, all checks passed\n", replayed);
+    for (int i = 0; i < 6; i++)
+      unlink(files[i]);
+  }
+  return failures != 0;
+}